@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "CInt.h"
+#include "config.h"
+#include "eri_cache.h"
+
+static inline size_t hash_key(uint64_t key)
+{
+    key ^= key >> 29;
+    key *= 0x9E3779B97F4A7C15ULL;
+    key ^= key >> 32;
+    return (size_t) key;
+}
+
+static inline uint64_t quartet_key(ERICache_t cache, int MN, int PQ)
+{
+    // 0 marks an empty slot
+    return (uint64_t) MN * (uint64_t) cache->nnz + (uint64_t) PQ + 1;
+}
+
+ERICache_t create_ERICache(
+    int nnz, int nthreads, int max_dim, int ntasks, int myrank,
+    double mem_MB, const char *disk_dir, double disk_MB, double disk_bw_MBs
+)
+{
+    if (mem_MB < 0.0) mem_MB = 0.0;
+    if (mem_MB == 0.0 && disk_dir == NULL) return NULL;
+
+    ERICache_t cache = (ERICache_t) malloc(sizeof(struct ERICache));
+    assert(cache != NULL);
+    memset(cache, 0, sizeof(struct ERICache));
+
+    cache->state       = ERI_CACHE_SURVEY;
+    cache->nthreads    = nthreads;
+    cache->nnz         = nnz;
+    cache->mem_MB      = mem_MB;
+    cache->disk_fd     = -1;
+    cache->disk_MB     = disk_MB;
+    cache->disk_bw_MBs = disk_bw_MBs;
+    cache->ntasks      = ntasks;
+
+    cache->class_nints     = (size_t*) calloc(nthreads * ERI_CACHE_NCLASS, sizeof(size_t));
+    cache->class_nquartets = (size_t*) calloc(nthreads * ERI_CACHE_NCLASS, sizeof(size_t));
+    cache->class_time      = (double*) calloc(nthreads * ERI_CACHE_NCLASS, sizeof(double));
+    cache->nhits           = (size_t*) calloc(nthreads, sizeof(size_t));
+    assert(cache->class_nints     != NULL);
+    assert(cache->class_nquartets != NULL);
+    assert(cache->class_time      != NULL);
+    assert(cache->nhits           != NULL);
+
+    int max_nints = max_dim * max_dim * max_dim * max_dim;
+    cache->replay_buf_size = (size_t) _SIMINT_NSHELL_SIMD * max_nints;
+    cache->replay_buf = (double*) malloc(sizeof(double) * nthreads * cache->replay_buf_size);
+    assert(cache->replay_buf != NULL);
+
+    // The file is unlinked at once, so it goes away with the process
+    if (disk_dir != NULL && disk_MB > 0.0)
+    {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/gtfock_eri.%d.bin", disk_dir, myrank);
+        cache->disk_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (cache->disk_fd < 0)
+        {
+            printf("  ERI cache: cannot open %s, disk tier disabled\n", path);
+        } else {
+            unlink(path);
+            cache->task_extent = (size_t*) malloc(sizeof(size_t) * 2 * ntasks);
+            assert(cache->task_extent != NULL);
+            for (int i = 0; i < ntasks; i++)
+            {
+                cache->task_extent[2 * i]     = SIZE_MAX;
+                cache->task_extent[2 * i + 1] = 0;
+            }
+        }
+    }
+
+    return cache;
+}
+
+void free_ERICache(ERICache_t cache)
+{
+    if (cache == NULL) return;
+    if (cache->disk_map != NULL)
+        munmap(cache->disk_map, sizeof(double) * MIN(cache->disk_used, cache->disk_size));
+    if (cache->disk_fd >= 0) close(cache->disk_fd);
+    free(cache->class_nints);
+    free(cache->class_nquartets);
+    free(cache->class_time);
+    free(cache->nhits);
+    free(cache->replay_buf);
+    free(cache->task_extent);
+    free(cache->arena);
+    free(cache->keys);
+    free(cache->offsets);
+    free(cache);
+}
+
+void begin_ERICache_build(ERICache_t cache)
+{
+    if (cache == NULL) return;
+    memset(cache->nhits, 0, sizeof(size_t) * cache->nthreads);
+}
+
+// Pick the largest size classes that fit in the memory budget, then the
+// classes that are cheaper to read from disk than to recompute, and
+// allocate the arena and the hash table for them
+static void plan_ERICache(ERICache_t cache, int myrank)
+{
+    size_t nints[ERI_CACHE_NCLASS], nquartets[ERI_CACHE_NCLASS];
+    double ctime[ERI_CACHE_NCLASS];
+    for (int cls = 0; cls < ERI_CACHE_NCLASS; cls++)
+    {
+        nints[cls] = 0;
+        nquartets[cls] = 0;
+        ctime[cls] = 0.0;
+        for (int t = 0; t < cache->nthreads; t++)
+        {
+            nints[cls]     += cache->class_nints[t * ERI_CACHE_NCLASS + cls];
+            nquartets[cls] += cache->class_nquartets[t * ERI_CACHE_NCLASS + cls];
+            ctime[cls]     += cache->class_time[t * ERI_CACHE_NCLASS + cls];
+        }
+    }
+
+    // Memory tier, each stored quartet costs its integrals plus two hash table slots
+    size_t budget = (size_t) (cache->mem_MB * 1048576.0);
+    size_t entry_bytes = 2 * (sizeof(uint64_t) + sizeof(size_t));
+    size_t mem_nints = 0, mem_nquartets = 0, used = 0;
+    size_t left_nints[ERI_CACHE_NCLASS], left_nquartets[ERI_CACHE_NCLASS];
+    for (int cls = ERI_CACHE_NCLASS - 1; cls >= 0; cls--)
+    {
+        left_nints[cls] = nints[cls];
+        left_nquartets[cls] = nquartets[cls];
+        if (nquartets[cls] == 0 || used >= budget) continue;
+        size_t cls_bytes = nints[cls] * sizeof(double) + nquartets[cls] * entry_bytes;
+        size_t nfit = nquartets[cls];
+        // The last class may be stored partially, the arena limits it
+        if (used + cls_bytes > budget)
+            nfit = (budget - used) / (cls_bytes / nquartets[cls]);
+        if (nfit == 0)
+        {
+            used = budget;
+            continue;
+        }
+        size_t fit_nints = nints[cls];
+        if (nfit < nquartets[cls]) fit_nints = nfit * (nints[cls] / nquartets[cls]);
+        cache->class_mem[cls] = 1;
+        mem_nints += fit_nints;
+        mem_nquartets += nfit;
+        used += fit_nints * sizeof(double) + nfit * entry_bytes;
+        left_nints[cls] -= fit_nints;
+        left_nquartets[cls] -= nfit;
+    }
+
+    // Disk tier, keep a class if reading it back is faster than Simint
+    size_t disk_nints = 0, disk_nquartets = 0;
+    if (cache->disk_fd >= 0)
+    {
+        size_t disk_budget = (size_t) (cache->disk_MB * 1048576.0 / sizeof(double));
+        double read_time = sizeof(double) / (cache->disk_bw_MBs * 1048576.0);
+        for (int cls = ERI_CACHE_NCLASS - 1; cls >= 0; cls--)
+        {
+            if (left_nquartets[cls] == 0 || disk_nints >= disk_budget) continue;
+            double comp_time = ctime[cls] / (double) nints[cls];
+            if (comp_time <= read_time) continue;
+            cache->class_disk[cls] = 1;
+            disk_nints += left_nints[cls];
+            disk_nquartets += left_nquartets[cls];
+        }
+        cache->disk_size = MIN(disk_nints, disk_budget);
+    }
+
+    size_t total_nquartets = mem_nquartets + disk_nquartets;
+    if (total_nquartets == 0)
+    {
+        cache->state = ERI_CACHE_OFF;
+        return;
+    }
+
+    size_t table_size = 1;
+    while (table_size < 2 * total_nquartets) table_size *= 2;
+    cache->table_mask = table_size - 1;
+    cache->arena_size = mem_nints;
+    cache->arena   = (double*)   malloc(sizeof(double) * (mem_nints + 1));
+    cache->keys    = (uint64_t*) calloc(table_size, sizeof(uint64_t));
+    cache->offsets = (size_t*)   malloc(sizeof(size_t) * table_size);
+    if (cache->arena == NULL || cache->keys == NULL || cache->offsets == NULL)
+    {
+        printf("  ERI cache: memory allocation failed, disabled\n");
+        cache->state = ERI_CACHE_OFF;
+        return;
+    }
+    cache->state = ERI_CACHE_RECORD;
+
+    if (myrank == 0)
+    {
+        printf("  ERI cache: %zu quartets in memory (%.2lf MB), ", mem_nquartets,
+               (double) (mem_nints * sizeof(double) + table_size * entry_bytes / 2) / 1048576.0);
+        printf("%zu quartets on disk (%.2lf MB)\n", disk_nquartets,
+               (double) cache->disk_size * sizeof(double) / 1048576.0);
+    }
+}
+
+// Map the disk tier for replay
+static void map_ERICache_disk(ERICache_t cache)
+{
+    size_t disk_used = MIN(cache->disk_used, cache->disk_size);
+    if (cache->disk_fd < 0 || disk_used == 0) return;
+    void *map = mmap(NULL, sizeof(double) * disk_used, PROT_READ, MAP_SHARED, cache->disk_fd, 0);
+    if (map == MAP_FAILED)
+    {
+        printf("  ERI cache: mmap failed, disk tier disabled\n");
+        return;
+    }
+    madvise(map, sizeof(double) * disk_used, MADV_RANDOM);
+    cache->disk_map = (double*) map;
+}
+
+void end_ERICache_build(ERICache_t cache, int myrank)
+{
+    if (cache == NULL) return;
+
+    if (cache->state == ERI_CACHE_SURVEY)
+    {
+        plan_ERICache(cache, myrank);
+    } else if (cache->state == ERI_CACHE_RECORD) {
+        cache->state = ERI_CACHE_REPLAY;
+        map_ERICache_disk(cache);
+        if (myrank == 0)
+        {
+            printf("  ERI cache: %zu quartets stored, %.2lf MB in memory, %.2lf MB on disk\n",
+                   cache->nstored,
+                   (double) MIN(cache->arena_used, cache->arena_size) * sizeof(double) / 1048576.0,
+                   (double) MIN(cache->disk_used, cache->disk_size) * sizeof(double) / 1048576.0);
+        }
+    } else if (cache->state == ERI_CACHE_REPLAY) {
+        size_t nhits = 0;
+        for (int t = 0; t < cache->nthreads; t++) nhits += cache->nhits[t];
+        if (myrank == 0) printf("  ERI cache: %zu quartets replayed\n", nhits);
+    }
+}
+
+void prefetch_ERICache_task(ERICache_t cache, int task)
+{
+    if (cache == NULL) return;
+    if (cache->state != ERI_CACHE_REPLAY || cache->disk_map == NULL) return;
+    if (task < 0 || task >= cache->ntasks) return;
+
+    // Read ahead the task's extent while its first batches are computed
+    size_t first = cache->task_extent[2 * task];
+    size_t last  = cache->task_extent[2 * task + 1];
+    if (first >= last) return;
+    size_t page  = (size_t) sysconf(_SC_PAGESIZE);
+    size_t start = (first * sizeof(double)) & ~(page - 1);
+    size_t end   = last * sizeof(double);
+    madvise((char*) cache->disk_map + start, end - start, MADV_WILLNEED);
+}
+
+static inline double *find_quartet(ERICache_t cache, uint64_t key)
+{
+    size_t h = hash_key(key) & cache->table_mask;
+    while (cache->keys[h] != 0)
+    {
+        if (cache->keys[h] == key)
+        {
+            size_t offset = cache->offsets[h];
+            if (offset & ERI_CACHE_DISK_BIT)
+            {
+                if (cache->disk_map == NULL) return NULL;
+                return cache->disk_map + (offset & ~ERI_CACHE_DISK_BIT);
+            }
+            return cache->arena + offset;
+        }
+        h = (h + 1) & cache->table_mask;
+    }
+    return NULL;
+}
+
+int load_ERICache_batch(
+    ERICache_t cache, int tid, int MN, int *PQ_list, int npairs,
+    int nints, double **batch_integrals
+)
+{
+    if (cache == NULL || cache->state != ERI_CACHE_REPLAY) return 0;
+    int cls = nints_class(nints);
+    if (!cache->class_mem[cls] && !cache->class_disk[cls]) return 0;
+
+    // A single quartet is used in place
+    if (npairs == 1)
+    {
+        double *src = find_quartet(cache, quartet_key(cache, MN, PQ_list[0]));
+        if (src == NULL) return 0;
+        *batch_integrals = src;
+        cache->nhits[tid]++;
+        return 1;
+    }
+
+    double *dst = cache->replay_buf + (size_t) tid * cache->replay_buf_size;
+    for (int ipair = 0; ipair < npairs; ipair++)
+    {
+        double *src = find_quartet(cache, quartet_key(cache, MN, PQ_list[ipair]));
+        if (src == NULL) return 0;
+        memcpy(dst + (size_t) ipair * nints, src, sizeof(double) * nints);
+    }
+    *batch_integrals = dst;
+    cache->nhits[tid] += npairs;
+    return 1;
+}
+
+// Reserve n hash table slots, keep the table at most half full
+static inline int reserve_slots(ERICache_t cache, int n)
+{
+    size_t nstored = __atomic_fetch_add(&cache->nstored, (size_t) n, __ATOMIC_RELAXED);
+    if (nstored + n > (cache->table_mask + 1) / 2)
+    {
+        __atomic_fetch_sub(&cache->nstored, (size_t) n, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+static inline void insert_quartet(ERICache_t cache, uint64_t key, size_t offset)
+{
+    // Each quartet is computed once per build, so keys are unique
+    size_t h = hash_key(key) & cache->table_mask;
+    while (!__sync_bool_compare_and_swap(&cache->keys[h], 0, key))
+        h = (h + 1) & cache->table_mask;
+    cache->offsets[h] = offset;
+}
+
+// Append the quartets of a batch to the file with a single write
+static void store_disk_quartets(
+    ERICache_t cache, int task, int MN, int *PQ_list, int npairs,
+    int nints, double *integrals
+)
+{
+    if (!reserve_slots(cache, npairs)) return;
+
+    size_t count  = (size_t) npairs * nints;
+    size_t offset = __atomic_fetch_add(&cache->disk_used, count, __ATOMIC_RELAXED);
+    if (offset + count > cache->disk_size)
+    {
+        __atomic_fetch_sub(&cache->nstored, (size_t) npairs, __ATOMIC_RELAXED);
+        return;
+    }
+
+    char  *buf   = (char*) integrals;
+    size_t bytes = count * sizeof(double);
+    off_t  pos   = (off_t) (offset * sizeof(double));
+    while (bytes > 0)
+    {
+        ssize_t ret = pwrite(cache->disk_fd, buf, bytes, pos);
+        if (ret <= 0)
+        {
+            __atomic_fetch_sub(&cache->nstored, (size_t) npairs, __ATOMIC_RELAXED);
+            return;
+        }
+        buf   += ret;
+        pos   += ret;
+        bytes -= ret;
+    }
+
+    for (int ipair = 0; ipair < npairs; ipair++)
+    {
+        size_t quartet_offset = (offset + (size_t) ipair * nints) | ERI_CACHE_DISK_BIT;
+        insert_quartet(cache, quartet_key(cache, MN, PQ_list[ipair]), quartet_offset);
+    }
+
+    // Extent of the task in the file, for read-ahead
+    if (task >= 0 && task < cache->ntasks)
+    {
+        #pragma omp critical(eri_cache_extent)
+        {
+            size_t *extent = cache->task_extent + 2 * task;
+            extent[0] = MIN(extent[0], offset);
+            extent[1] = MAX(extent[1], offset + count);
+        }
+    }
+}
+
+void store_ERICache_batch(
+    ERICache_t cache, int task, int MN, int *PQ_list, int npairs,
+    int nints, double *batch_integrals
+)
+{
+    if (cache == NULL || cache->state != ERI_CACHE_RECORD) return;
+    int cls = nints_class(nints);
+
+    // Memory tier first
+    int ipair = 0;
+    if (cache->class_mem[cls])
+    {
+        for (; ipair < npairs; ipair++)
+        {
+            if (!reserve_slots(cache, 1)) return;
+            size_t offset = __atomic_fetch_add(&cache->arena_used, (size_t) nints, __ATOMIC_RELAXED);
+            if (offset + nints > cache->arena_size)
+            {
+                __atomic_fetch_sub(&cache->nstored, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            memcpy(cache->arena + offset, batch_integrals + (size_t) ipair * nints, sizeof(double) * nints);
+            insert_quartet(cache, quartet_key(cache, MN, PQ_list[ipair]), offset);
+        }
+    }
+
+    // The rest of the batch goes to disk
+    if (ipair < npairs && cache->class_disk[cls])
+    {
+        store_disk_quartets(
+            cache, task, MN, PQ_list + ipair, npairs - ipair,
+            nints, batch_integrals + (size_t) ipair * nints
+        );
+    }
+}
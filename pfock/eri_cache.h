@@ -0,0 +1,123 @@
+#ifndef __ERI_CACHE_H__
+#define __ERI_CACHE_H__
+
+#include <stdint.h>
+
+// Semi-direct cache of shell quartet integrals. The first Fock build
+// surveys the sizes and the compute cost of all computed quartets, the
+// second build stores the selected quartets, and all later builds replay
+// them. Quartets are stored in two tiers:
+// (1) memory: the largest (most expensive) size classes that fit in the
+//     memory budget are kept in an arena;
+// (2) disk: the remaining classes that are cheaper to read back than to
+//     recompute are appended to a per-rank file on node-local scratch and
+//     mmap-ed for replay, each task's extent is prefetched when it starts.
+// A quartet is identified by its bra and ket indices in shellid/shellrid.
+
+#define ERI_CACHE_OFF     0
+#define ERI_CACHE_SURVEY  1
+#define ERI_CACHE_RECORD  2
+#define ERI_CACHE_REPLAY  3
+
+// Size class of a quartet is floor(log2(number of integrals))
+#define ERI_CACHE_NCLASS  32
+
+// Offsets with this bit set are in the disk tier
+#define ERI_CACHE_DISK_BIT ((size_t) 1 << (sizeof(size_t) * 8 - 1))
+
+struct ERICache
+{
+    int      state;       // ERI_CACHE_{OFF, SURVEY, RECORD, REPLAY}
+    int      nthreads;
+    int      nnz;         // Number of shell pairs, key = MN * nnz + PQ + 1
+    double   mem_MB;      // Memory budget
+    char     class_mem[ERI_CACHE_NCLASS];  // Size classes stored in memory
+    char     class_disk[ERI_CACHE_NCLASS]; // Size classes stored on disk
+
+    // Survey counters and Simint time, [tid][class]
+    size_t   *class_nints;
+    size_t   *class_nquartets;
+    double   *class_time;
+
+    // Arena for the integrals, bump allocated
+    double   *arena;
+    size_t   arena_size;
+    size_t   arena_used;
+
+    // Disk tier, sizes are in doubles
+    int      disk_fd;
+    double   disk_MB;     // Disk budget
+    double   disk_bw_MBs; // Read bandwidth for the cost model
+    double   *disk_map;
+    size_t   disk_size;
+    size_t   disk_used;
+    int      ntasks;      // Number of tasks over all processes
+    size_t   *task_extent; // [task][2], first and last + 1 offset in the file
+
+    // Open addressing hash table from key to arena or file offset
+    uint64_t *keys;
+    size_t   *offsets;
+    size_t   table_mask;
+    size_t   nstored;
+
+    // Per-thread buffer to gather a replayed batch, and hit counters
+    double   *replay_buf;
+    size_t   replay_buf_size;
+    size_t   *nhits;
+};
+
+typedef struct ERICache *ERICache_t;
+
+// Return NULL if neither the memory budget nor the disk tier is set.
+// disk_dir == NULL disables the disk tier.
+ERICache_t create_ERICache(
+    int nnz, int nthreads, int max_dim, int ntasks, int myrank,
+    double mem_MB, const char *disk_dir, double disk_MB, double disk_bw_MBs
+);
+
+void free_ERICache(ERICache_t cache);
+
+// Called before and after each Fock build, advance the state
+void begin_ERICache_build(ERICache_t cache);
+
+void end_ERICache_build(ERICache_t cache, int myrank);
+
+// Called before each task, prefetch its disk extent when replaying
+void prefetch_ERICache_task(ERICache_t cache, int task);
+
+static inline int nints_class(int nints)
+{
+    int cls = 0;
+    while ((nints >> (cls + 1)) > 0) cls++;
+    return cls;
+}
+
+// Count a quartet that will be computed in the survey build
+static inline void survey_ERICache_quartet(ERICache_t cache, int tid, int nints)
+{
+    int cls = nints_class(nints);
+    cache->class_nints[tid * ERI_CACHE_NCLASS + cls] += nints;
+    cache->class_nquartets[tid * ERI_CACHE_NCLASS + cls]++;
+}
+
+// Add the Simint time of a batch in the survey build
+static inline void time_ERICache_batch(ERICache_t cache, int tid, int nints, double sec)
+{
+    cache->class_time[tid * ERI_CACHE_NCLASS + nints_class(nints)] += sec;
+}
+
+// Find all quartets of a batch, return 1 and set *batch_integrals
+// to the gathered integrals if all of them are cached
+int load_ERICache_batch(
+    ERICache_t cache, int tid, int MN, int *PQ_list, int npairs,
+    int nints, double **batch_integrals
+);
+
+// Save the quartets of a computed batch of task if their size class is
+// stored, the task's disk extent is grown for the read-ahead
+void store_ERICache_batch(
+    ERICache_t cache, int task, int MN, int *PQ_list, int npairs,
+    int nints, double *batch_integrals
+);
+
+#endif /* #define __ERI_CACHE_H__ */
@@ -15,19 +15,231 @@
 #include "fock_buf.h"
 
 #include "GTMatrix.h"
+#include "gtm_nonblock.h"
 
-// NOTICE: load_full_DenMat() and store_local_bufF() needs that num_dmat2==1
+// D_mat, F1, F2 and F3 hold num_dmat2 densities one after another.
+// Without symmetry, slots [0, num_dmat) are the symmetric parts of the
+// densities and slots [num_dmat, num_dmat2) the antisymmetric parts
+
+// A node-shared D_mat is only written by the node leader
+static int write_DenMat(PFock_t pfock)
+{
+    return (!pfock->D_shared || pfock->node_rank == 0);
+}
+
+// Make the leader's update of a node-shared D_mat visible on the node
+static void sync_DenMat(PFock_t pfock)
+{
+    if (!pfock->D_shared) return;
+    MPI_Win_sync(pfock->D_win);
+    MPI_Barrier(pfock->node_comm);
+    MPI_Win_sync(pfock->D_win);
+}
+
+// Replicate D with one MPI_Allgatherv per block row of the process grid.
+// The processes of that block row send their packed local blocks, so each
+// owner sends its block once instead of serving a get from every process.
+static void allgather_DenMat(PFock_t pfock)
+{
+    int nbf = pfock->nbf;
+    size_t nbf2 = (size_t) nbf * nbf;
+    GTMatrix_t gtm = pfock->gtm_Dmats[0];
+    int nprocs = gtm->comm_size;
+    int my_nrows = gtm->r_blklens[gtm->my_rowblk];
+    int my_ncols = gtm->c_blklens[gtm->my_colblk];
+    int max_nrows = 0;
+    for (int bi = 0; bi < gtm->r_blocks; bi++)
+        max_nrows = MAX(max_nrows, gtm->r_blklens[bi]);
+    
+    int *counts = (int *) malloc(sizeof(int) * 2 * nprocs);
+    int *displs = counts + nprocs;
+    double *sendbuf = (double *) malloc(sizeof(double) * MAX(my_nrows * my_ncols, 1));
+    double *recvbuf = (double *) malloc(sizeof(double) * (size_t) max_nrows * nbf);
+    assert(counts != NULL && sendbuf != NULL && recvbuf != NULL);
+    
+    for (int i = 0; i < pfock->num_dmat; i++)
+    {
+        GTMatrix_t gtm_Dmat = pfock->gtm_Dmats[i];
+        double *D_mat = pfock->D_mat + i * nbf2;
+        GTM_sync(gtm_Dmat);
+        for (int r = 0; r < my_nrows; r++)
+        {
+            memcpy(sendbuf + r * my_ncols, gtm_Dmat->mat_block + r * gtm_Dmat->ld_local,
+                   sizeof(double) * my_ncols);
+        }
+        
+        // Block row bi arrives as its column blocks one after another
+        for (int bi = 0; bi < gtm->r_blocks; bi++)
+        {
+            int nrows = gtm->r_blklens[bi];
+            for (int p = 0; p < nprocs; p++)
+            {
+                int in_row = (p / gtm->c_blocks == bi);
+                int bj = p % gtm->c_blocks;
+                counts[p] = in_row ? nrows * gtm->c_blklens[bj] : 0;
+                displs[p] = in_row ? nrows * gtm->c_displs[bj] : 0;
+            }
+            int sendcount = (gtm->my_rowblk == bi) ? my_nrows * my_ncols : 0;
+            MPI_Allgatherv(sendbuf, sendcount, MPI_DOUBLE, recvbuf, counts, displs,
+                           MPI_DOUBLE, gtm_Dmat->mpi_comm);
+            if (!write_DenMat(pfock)) continue;
+            
+            #pragma omp parallel for
+            for (int bj = 0; bj < gtm->c_blocks; bj++)
+            {
+                int ncols = gtm->c_blklens[bj];
+                double *src = recvbuf + (size_t) nrows * gtm->c_displs[bj];
+                double *dst = D_mat + (size_t) gtm->r_displs[bi] * nbf + gtm->c_displs[bj];
+                for (int r = 0; r < nrows; r++)
+                    memcpy(dst + (size_t) r * nbf, src + r * ncols, sizeof(double) * ncols);
+            }
+        }
+    }
+    
+    free(counts);
+    free(sendbuf);
+    free(recvbuf);
+    sync_DenMat(pfock);
+}
 
 void load_full_DenMat(PFock_t pfock)
 {
-    GTM_startBatchGet(pfock->gtm_Dmat);
-    GTM_addGetBlockRequest(pfock->gtm_Dmat, 0, pfock->nbf, 0, pfock->nbf, pfock->D_mat, pfock->nbf);
-    GTM_execBatchGet(pfock->gtm_Dmat);
-    GTM_stopBatchGet(pfock->gtm_Dmat);
-    GTM_sync(pfock->gtm_Dmat);
+    size_t nbf2 = (size_t) pfock->nbf * pfock->nbf;
+    if (pfock->D_collective)
+    {
+        allgather_DenMat(pfock);
+        return;
+    }
+    for (int i = 0; i < pfock->num_dmat; i++)
+    {
+        GTMatrix_t gtm_Dmat = pfock->gtm_Dmats[i];
+        double *D_mat = pfock->D_mat + i * nbf2;
+        if (write_DenMat(pfock))
+        {
+            GTM_startBatchGet(gtm_Dmat);
+            GTM_addGetBlockRequest(gtm_Dmat, 0, pfock->nbf, 0, pfock->nbf, D_mat, pfock->nbf);
+            GTM_execBatchGet(gtm_Dmat);
+            GTM_stopBatchGet(gtm_Dmat);
+        }
+        GTM_sync(gtm_Dmat);
+    }
+    sync_DenMat(pfock);
+}
+
+// Start getting rows [r0, r1) of a density into D_mat, one request per
+// owner block
+static int get_DenMat_rows(struct GTMNonblock *nb, double *D_mat, int nbf, int r0, int r1, MPI_Request *req)
+{
+    return start_GTMNonblock_get(nb, r0, r1 - r0, 0, nbf, D_mat + (size_t) r0 * nbf, nbf, req);
+}
+
+void start_DenMat_fetch(PFock_t pfock, int nfirst, int *first_shells)
+{
+    int nbf = pfock->nbf;
+    int nshells = pfock->nshells;
+    int nblks_row = pfock->nprow * pfock->nbp_p;
+    int *blkrowptr_sh = pfock->blkrowptr_sh;
+    size_t nbf2 = (size_t) nbf * nbf;
+    
+    // Each block row is split by at most nprow + 1 owner rows
+    GTMatrix_t gtm_Dmat = pfock->gtm_Dmats[0];
+    int maxreq = (nblks_row + gtm_Dmat->r_blocks) * gtm_Dmat->c_blocks * pfock->num_dmat;
+    if (maxreq > pfock->D_fetch_maxreq)
+    {
+        PFOCK_FREE(pfock->D_fetch_req);
+        pfock->D_fetch_req = (MPI_Request *) PFOCK_MALLOC(sizeof(MPI_Request) * maxreq);
+        assert(pfock->D_fetch_req != NULL);
+        pfock->D_fetch_maxreq = maxreq;
+    }
+    
+    char *first_blk = (char *) malloc(sizeof(char) * (nblks_row + nshells));
+    char *first_sh  = first_blk + nblks_row;
+    assert(first_blk != NULL);
+    memset(first_sh, 0, sizeof(char) * nshells);
+    for (int i = 0; i < nfirst; i++) first_sh[first_shells[i]] = 1;
+    for (int b = 0; b < nblks_row; b++)
+    {
+        first_blk[b] = 0;
+        for (int M = blkrowptr_sh[b]; M < blkrowptr_sh[b + 1]; M++)
+            first_blk[b] |= first_sh[M];
+    }
+    
+    MPI_Request *req = pfock->D_fetch_req;
+    int nreq = 0;
+    for (int pass = 1; pass >= 0; pass--)
+    {
+        for (int b = 0; b < nblks_row; b++)
+        {
+            if (first_blk[b] != pass) continue;
+            int r0 = pfock->f_startind[blkrowptr_sh[b]];
+            int r1 = pfock->f_startind[blkrowptr_sh[b + 1]];
+            for (int i = 0; i < pfock->num_dmat; i++)
+            {
+                nreq += get_DenMat_rows(
+                    pfock->gtmnb_Dmats[i], pfock->D_mat + i * nbf2, nbf, r0, r1, req + nreq
+                );
+            }
+        }
+        if (pass == 1) pfock->D_fetch_nfirst = nreq;
+    }
+    pfock->D_fetch_nreq = nreq;
+    free(first_blk);
+}
+
+void wait_DenMat_fetch(PFock_t pfock, int all)
+{
+    int nreq = all ? pfock->D_fetch_nreq : pfock->D_fetch_nfirst;
+    MPI_Waitall(nreq, pfock->D_fetch_req, MPI_STATUSES_IGNORE);
+}
+
+int test_DenMat_fetch(PFock_t pfock)
+{
+    int flag;
+    MPI_Testall(pfock->D_fetch_nreq, pfock->D_fetch_req, &flag, MPI_STATUSES_IGNORE);
+    return flag;
+}
+
+// D <- (D + D^T) / 2, D_a <- (D - D^T) / 2
+void split_nonsymm_DenMat(PFock_t pfock)
+{
+    int nbf = pfock->nbf;
+    size_t nbf2 = (size_t) nbf * nbf;
+    if (!write_DenMat(pfock))
+    {
+        sync_DenMat(pfock);
+        return;
+    }
+    for (int i = 0; i < pfock->num_dmat; i++)
+    {
+        double *D = pfock->D_mat + i * nbf2;
+        double *D_a = pfock->D_mat + (pfock->num_dmat + i) * nbf2;
+        #pragma omp parallel for schedule(dynamic)
+        for (int r = 0; r < nbf; r++)
+        {
+            D_a[r * nbf + r] = 0.0;
+            for (int c = r + 1; c < nbf; c++)
+            {
+                double Drc = D[r * nbf + c];
+                double Dcr = D[c * nbf + r];
+                double s = 0.5 * (Drc + Dcr);
+                double a = 0.5 * (Drc - Dcr);
+                D[r * nbf + c] = s;
+                D[c * nbf + r] = s;
+                D_a[r * nbf + c] = a;
+                D_a[c * nbf + r] = -a;
+            }
+        }
+    }
+    sync_DenMat(pfock);
 }
 
 void store_local_bufF(PFock_t pfock)
+{
+    for (int i = 0; i < pfock->num_dmat2; i++)
+        store_local_bufF_dmat(pfock, i);
+}
+
+void store_local_bufF_dmat(PFock_t pfock, int dmat_id)
 {
     int *loadrow = pfock->loadrow;
     int *loadcol = pfock->loadcol;
@@ -38,11 +250,11 @@ void store_local_bufF(PFock_t pfock)
     int lo[2];
     int hi[2];
     
-    GTMatrix_t gtm_J = pfock->gtm_Fmat;
+    GTMatrix_t gtm_J = pfock->gtm_Fmats[dmat_id];
     #ifdef __SCF__
-    GTMatrix_t gtm_K = pfock->gtm_Fmat;
+    GTMatrix_t gtm_K = pfock->gtm_Fmats[dmat_id];
     #else
-    GTMatrix_t gtm_K = pfock->gtm_Kmat;
+    GTMatrix_t gtm_K = pfock->gtm_Kmats[dmat_id];
     #endif
     
     lo[0] = myrank;
@@ -53,49 +265,54 @@ void store_local_bufF(PFock_t pfock)
     int ldF1 = pfock->ldX1;
     int ldF2 = pfock->ldX2;
     int ldF3 = pfock->ldX3;    
-    double *F1 = pfock->gtm_F1->mat_block;
-    double *F2 = pfock->gtm_F2->mat_block;
-    double *F3 = pfock->gtm_F3->mat_block;
-    
-    GTM_startBatchAcc(gtm_J);
+    double *F1 = pfock->gtm_F1->mat_block + dmat_id * pfock->sizeX1;
+    double *F2 = pfock->gtm_F2->mat_block + dmat_id * pfock->sizeX2;
+    double *F3 = pfock->gtm_F3->mat_block + dmat_id * pfock->sizeX3;
     
-    // update F1
-    lo[0] = pfock->sfunc_row;
-    hi[0] = pfock->efunc_row;
-    for (int A = 0; A < sizerow; A++) 
+    // J of an antisymmetric density is zero, only K is stored
+    int K_only = (dmat_id >= pfock->num_dmat);
+    if (!K_only)
     {
-        lo[1] = loadrow[PLEN * A + P_LO];
-        hi[1] = loadrow[PLEN * A + P_HI];
-        int posrow = loadrow[PLEN * A + P_W];
+        GTM_startBatchAcc(gtm_J);
+    
+        // update F1
+        lo[0] = pfock->sfunc_row;
+        hi[0] = pfock->efunc_row;
+        for (int A = 0; A < sizerow; A++) 
+        {
+            lo[1] = loadrow[PLEN * A + P_LO];
+            hi[1] = loadrow[PLEN * A + P_HI];
+            int posrow = loadrow[PLEN * A + P_W];
         
-        GTM_addAccBlockRequest(
-            gtm_J, 
-            lo[0], hi[0] - lo[0] + 1,
-            lo[1], hi[1] - lo[1] + 1,
-            F1 + posrow, ldF1
-        );
-    }
-
-    // update F2
-    lo[0] = pfock->sfunc_col;
-    hi[0] = pfock->efunc_col;
-    for (int B = 0; B < sizecol; B++) 
-    {
-        lo[1] = loadcol[PLEN * B + P_LO];
-        hi[1] = loadcol[PLEN * B + P_HI];
-        int poscol = loadcol[PLEN * B + P_W];
+            GTM_addAccBlockRequest(
+                gtm_J, 
+                lo[0], hi[0] - lo[0] + 1,
+                lo[1], hi[1] - lo[1] + 1,
+                F1 + posrow, ldF1
+            );
+        }
+
+        // update F2
+        lo[0] = pfock->sfunc_col;
+        hi[0] = pfock->efunc_col;
+        for (int B = 0; B < sizecol; B++) 
+        {
+            lo[1] = loadcol[PLEN * B + P_LO];
+            hi[1] = loadcol[PLEN * B + P_HI];
+            int poscol = loadcol[PLEN * B + P_W];
         
-        GTM_addAccBlockRequest(
-            gtm_J, 
-            lo[0], hi[0] - lo[0] + 1,
-            lo[1], hi[1] - lo[1] + 1,
-            F2 + poscol, ldF2
-        );
-    }
+            GTM_addAccBlockRequest(
+                gtm_J, 
+                lo[0], hi[0] - lo[0] + 1,
+                lo[1], hi[1] - lo[1] + 1,
+                F2 + poscol, ldF2
+            );
+        }
 
-    GTM_execBatchAcc(gtm_J);
-    GTM_stopBatchAcc(gtm_J);
-    GTM_sync(gtm_J);
+        GTM_execBatchAcc(gtm_J);
+        GTM_stopBatchAcc(gtm_J);
+        GTM_sync(gtm_J);
+    }
     
     // update F3
     GTM_startBatchAcc(gtm_K);
@@ -124,6 +341,119 @@ void store_local_bufF(PFock_t pfock)
 }
 
 
+// G <- G + (A - A^T) / 2, G and A have the same distribution
+static void add_antisym_part(GTMatrix_t gtm_G, GTMatrix_t gtm_A, double *AT_block)
+{
+    int nrows = gtm_A->r_blklens[gtm_A->my_rowblk];
+    int ncols = gtm_A->c_blklens[gtm_A->my_colblk];
+    int srow  = gtm_A->r_displs[gtm_A->my_rowblk];
+    int scol  = gtm_A->c_displs[gtm_A->my_colblk];
+    int ldA = gtm_A->ld_local;
+    int ldG = gtm_G->ld_local;
+    double *A = gtm_A->mat_block;
+    double *G = gtm_G->mat_block;
+
+    // A^T of my block is the mirrored block of A
+    GTM_startBatchGet(gtm_A);
+    GTM_addGetBlockRequest(gtm_A, scol, ncols, srow, nrows, AT_block, nrows);
+    GTM_execBatchGet(gtm_A);
+    GTM_stopBatchGet(gtm_A);
+    GTM_sync(gtm_A);
+
+    #pragma omp parallel for
+    for (int i = 0; i < nrows; i++)
+    {
+        double *G_i = G + i * ldG;
+        double *A_i = A + i * ldA;
+        for (int j = 0; j < ncols; j++)
+            G_i[j] += 0.5 * (A_i[j] - AT_block[j * nrows + i]);
+    }
+    GTM_sync(gtm_G);
+}
+
+
+// Add the exchange of the antisymmetric parts of the densities
+void correct_nonsymm_FockMat(PFock_t pfock)
+{
+    int num_dmat = pfock->num_dmat;
+    for (int i = 0; i < num_dmat; i++)
+    {
+        #ifdef __SCF__
+        add_antisym_part(pfock->gtm_Fmats[i], pfock->gtm_Fmats[num_dmat + i], pfock->FT_block);
+        #else
+        add_antisym_part(pfock->gtm_Kmats[i], pfock->gtm_Kmats[num_dmat + i], pfock->FT_block);
+        #endif
+    }
+}
+
+
+// D_mat <- D_k - D_{k-1} for an incremental build, D_prev <- D_k
+void update_incr_DenMat(PFock_t pfock)
+{
+    size_t nbf2 = (size_t)pfock->nbf * pfock->nbf * pfock->num_dmat;
+    double *D_mat = pfock->D_mat;
+    double *D_prev = pfock->D_prev;
+
+    // D_prev is only kept up to date on the writer of D_mat
+    if (!write_DenMat(pfock))
+    {
+        sync_DenMat(pfock);
+        return;
+    }
+    if (pfock->incr_active)
+    {
+        #pragma omp parallel for
+        for (size_t i = 0; i < nbf2; i++)
+        {
+            double D = D_mat[i];
+            D_mat[i] = D - D_prev[i];
+            D_prev[i] = D;
+        }
+    } else {
+        memcpy(D_prev, D_mat, sizeof(double) * nbf2);
+    }
+    sync_DenMat(pfock);
+}
+
+
+static void update_incr_block(GTMatrix_t gtm, double *prev, int incr_active)
+{
+    int nrows = gtm->r_blklens[gtm->my_rowblk];
+    int ncols = gtm->c_blklens[gtm->my_colblk];
+    int ld = gtm->ld_local;
+    double *blk = gtm->mat_block;
+
+    #pragma omp parallel for
+    for (int i = 0; i < nrows; i++)
+    {
+        double *blk_i = blk + i * ld;
+        double *prev_i = prev + i * ncols;
+        if (incr_active)
+        {
+            PRAGMA_SIMD
+            for (int j = 0; j < ncols; j++) blk_i[j] += prev_i[j];
+        }
+        memcpy(prev_i, blk_i, sizeof(double) * ncols);
+    }
+    GTM_sync(gtm);
+}
+
+
+// F <- F(delta D) + F_{k-1} for an incremental build, F_prev <- F
+void update_incr_FockMat(PFock_t pfock)
+{
+    GTMatrix_t gtm = pfock->gtm_Fmat;
+    size_t blksize = (size_t)gtm->r_blklens[gtm->my_rowblk] *
+                     gtm->c_blklens[gtm->my_colblk];
+    for (int i = 0; i < pfock->num_dmat; i++)
+    {
+        update_incr_block(pfock->gtm_Fmats[i], pfock->F_prev + i * blksize, pfock->incr_active);
+        #ifndef __SCF__
+        update_incr_block(pfock->gtm_Kmats[i], pfock->K_prev + i * blksize, pfock->incr_active);
+        #endif
+    }
+}
+
 void compute_FD_ptr(PFock_t pfock, int startM, int endM, int *ptrrow, int *rowsize)
 {
     for (int A = 0; A < pfock->nshells; A++) {
@@ -14,8 +14,28 @@
 
 void load_full_DenMat(PFock_t pfock);
 
+// Start fetching D into D_mat by task block rows, the block rows that
+// contain one of the nfirst shells in first_shells are requested first
+void start_DenMat_fetch(PFock_t pfock, int nfirst, int *first_shells);
+
+// Wait for the first block rows (all == 0) or for all of D (all == 1)
+void wait_DenMat_fetch(PFock_t pfock, int all);
+
+// Return 1 if all of D has arrived
+int test_DenMat_fetch(PFock_t pfock);
+
+void split_nonsymm_DenMat(PFock_t pfock);
+
 void store_local_bufF(PFock_t pfock);
 
+void store_local_bufF_dmat(PFock_t pfock, int dmat_id);
+
+void correct_nonsymm_FockMat(PFock_t pfock);
+
+void update_incr_DenMat(PFock_t pfock);
+
+void update_incr_FockMat(PFock_t pfock);
+
 void compute_FD_ptr(PFock_t pfock, int startM, int endM, int *ptrrow, int *rowsize);
 
 void init_FD_load(PFock_t pfock, int *ptrrow, int **loadrow, int *loadsize);
@@ -0,0 +1,135 @@
+#ifndef __FOCK_ENGINE_H__
+#define __FOCK_ENGINE_H__
+
+#include <omp.h>
+#include "pfock.h"
+#include "CInt.h"
+#include "GTMatrix.h"
+#include "thread_quartet_buf.h"
+#include "eri_cache.h"
+
+// How J_PQ blocks are accumulated, selected by env JPQ_ACC
+#define JPQ_ACC_ATOMIC 0  // Shared F_PQ_blocks, CAS atomic add
+#define JPQ_ACC_DUP    1  // One full F_PQ_blocks copy per thread
+#define JPQ_ACC_TILE   2  // Thread-private sparse tiles of the task's ket pairs
+
+// Working state of the Fock tasks of one PFock_t, created by init_block_buf()
+// and owned by the PFock_t, so that several engines can work in one process
+struct FockEngine
+{
+    int JPQ_acc_mode;
+
+    // Serializes this engine's task queue refills and statistics flushes,
+    // an omp critical would serialize them across all engines of the process
+    omp_lock_t task_lock;
+
+    // Array of thread quartet lists and the Simint multishellpair
+    ThreadQuartetLists_t *thread_quartet_listss;
+    void **thread_multi_shellpairs;
+
+    // update_F thread-local buffer
+    double *update_F_buf;
+    int update_F_buf_size;
+    int maxAM, max_dim, nthreads;
+
+    // Arrays for packed D and F storage, each density has its own copy of
+    // D_blocks, F_PQ_blocks, F_MNPQ_blocks, the band buffers and the tiles.
+    // Only the footprint of the task owner is packed: its row and column
+    // shells and their significant partners, which are all shells a task
+    // of this owner can reach after Schwarz screening
+    int    *blk_shell_idx;       // Index of each shell in the footprint, -1 if not in it
+    int    *blk_shell_fptr;      // Offset of each footprint shell's 1st function in the footprint
+    int    *blk_shells;          // Shells in the footprint, in ascending order
+    int    blk_nshells, blk_nbf; // Number of shells and functions in the current footprint
+    int    blk_max_nshells, blk_max_nbf, blk_nbf2;
+    int    *F_PQ_blocks_to_F2;   // Mapping blocks in F_PQ_blocks to F2
+    int    *F_MNPQ_blocks_to_F3; // Mapping blocks in F_MNPQ_blocks to F3
+    int    *visited_shells;      // Flags for marking if (M, i) and (N, i) are updated
+    int    *touched_shells;      // List of the shells i with visited_shells[i] set
+    double *D_blocks;            // Packed density matrix (D) blocks
+    double *D_scrval;            // Maximum (in absolute) value of each D block
+    double *F_PQ_blocks;         // Packed F_PQ (J_PQ) blocks
+    double *F_MNPQ_blocks;       // Packed F_{MP, NP, MQ, NQ} (K_{MP, NP, MQ, NQ}) blocks
+    double *F_M_band_blocks;     // Thread-private buffer for F_MP and F_MQ blocks with the same M
+    double *F_N_band_blocks;     // Thread-private buffer for F_NP and F_NQ blocks with the same N
+    int    *J_PQ_tile_ptr;       // Offset of ket pair j's J_PQ block in the packed sparse tile
+    int    J_PQ_tile_size;       // Size of each thread's J_PQ tile
+    int    J_PQ_tile_npairs;     // Maximum number of ket pairs in a task
+    double *J_PQ_tiles;          // Thread-private J_PQ tiles, merged at the end of each task
+    char   *J_PQ_tile_flags;     // Flags for marking if a ket pair's tile block is updated
+    double *shell_time_buf;      // Thread-private measured time of each bra shell row
+
+    // Partial D replication: D_fp holds D of the current footprint with rows and
+    // columns in footprint order, [blk_nbf][blk_nbf] per density. D_fp_prev is
+    // the previous footprint of this build, its blocks are reused on a repack
+    int    D_partial;
+    double *D_fp, *D_fp_prev;
+    int    *fp_prev_fptr;        // blk_shell_fptr of the previous footprint, -1 if not in it
+    int    fp_prev_nbf;
+    int    *fp_runs;             // [3][blk_max_nshells] start, end and cached flag of shell runs
+    GTMatrix_t *gtm_Dmats;
+
+    // Max |D| of each shell block (M, N) of the whole D, built once per build
+    // from D_mat and used by every pack of that build instead of rescanning
+    // the blocks. Not used with partial D replication.
+    float  *D_blockmax;
+    int    D_blockmax_valid;
+
+    // Ket pairs of each task column block, bucketed by the AM class of (P, Q).
+    // In each bucket the pairs of one P are contiguous, the P groups are 
+    // sorted by decreasing largest |Schwarz value| and the pairs of a group 
+    // by decreasing |Schwarz value|. Position k runs
+    // over [shellptr[startP], shellptr[endP + 1]) of the column block, the
+    // SoA arrays hold the per-pair values that do not depend on the bra
+    int    *ket_bucket_ptr;      // [ntask_cols][_SIMINT_AM_PAIRS + 1] first position of each bucket
+    int    *ket_P, *ket_Q, *ket_j;
+    int    *ket_iX3P, *ket_iXQ;  // colpos[P] and colptr[j]
+    double *ket_value;           // shellvalue[j]
+    double *ket_group_max;       // Largest |shellvalue| of the P group of position k
+    int    *ket_rank;            // Position of ket pair j in its column block
+
+    // Fixed pointers & values from PFock_t
+    BasisSet_t basis;
+    SIMINT_t   simint;
+    int    nbf, nshells, nbf2, F_PQ_block_size, nbp_p, ntask_cols;
+    int    F_PQ_offset, myrank, maxcolfuncs, num_CPU_F, num_dup_F;
+    int    ncpu_f, num_dmat, max_numdmat2, sizeX1, sizeX2, sizeX3, ldX1, ldX2, ldX3;
+    int    band_size;
+    int    *f_startind, *shell_bf_num;
+    int    *shellptr, *shellid, *shellrid;
+    int    *rowpos, *colpos, *rowptr, *colptr;
+    int    *blkrowptr_sh, *blkcolptr_sh;
+    double tolscr2, *shellvalue, *D_mat, *F1, *nitl, *nsq;
+    int    task_screening;
+    double *Dshellmax, *blkcol_scrmax, *blkcol_Dmax;
+
+    // Semi-direct ERI cache, NULL if disabled
+    ERICache_t eri_cache;
+
+    // SoA workspace for update_F_simd_batch()
+    double *update_F_simd_buf;
+    int update_F_simd_buf_size, update_F_simd;
+
+    // Low-precision tier: ket pairs with a screening bound below sp_tol go to
+    // separate quartet lists and are digested by update_F_sp_batch()
+    double sp_tol, *sp_usq, *sp_err;
+    float  *update_F_sp_buf;
+    ThreadQuartetLists_t *thread_quartet_listss_sp;
+
+    // Bra batching: the partial ket lists of up to bra_batch consecutive bra
+    // pairs with the same M and AM class are merged per ket pair. Simint is
+    // called with the ket pair as the bra and the bra pairs as the kets, so
+    // the bras fill the SIMD lanes. Slot 0 of a batch uses the ordinary
+    // thread buffers, slots 1 to bra_batch - 1 use the buffers below
+    int    bra_batch;
+    double *bra_J_MN_buf;        // J_MN of each slot, [nthreads][bra_batch][max_numdmat2][update_F_buf_size]
+    double *bra_N_band_blocks;   // F_N band of slots 1.., [nthreads][bra_batch - 1][max_numdmat2][band_size]
+    int    *bra_visited_shells;  // Touched shells of slots 1.. and of the shared F_M band,
+    int    *bra_touched_shells;  // [nthreads][bra_batch][nshells]
+    ThreadQuartetLists_t *bra_quartet_listss;  // [nthreads][bra_batch - 1]
+    double *simint_calls, *simint_pairs;
+};
+
+typedef struct FockEngine *FockEngine_t;
+
+#endif /* #define __FOCK_ENGINE_H__ */
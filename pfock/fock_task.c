@@ -4,6 +4,7 @@
 #include <mpi.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
 #include <omp.h>
 #include <unistd.h>
 //#include <macdecls.h>
@@ -13,52 +14,37 @@
 #include "config.h"
 #include "taskq.h"
 #include "fock_task.h"
+#include "screening.h"
 #include "cint_basisset.h"
 
-// Using global variables is a bad habit, but it is convenient.
-// Consider fix this problem later.
-
-//#define DUP_F_PQ_BUF
-
-// Array of thread quartet lists and the Simint multishellpair
-#include "thread_quartet_buf.h"
-ThreadQuartetLists_t *thread_quartet_listss;
-void **thread_multi_shellpairs;
-
-// update_F thread-local buffer
-double *update_F_buf  = NULL;
-int update_F_buf_size = 0;
-int maxAM, max_dim, nthreads;
-
-// Arrays for packed D and F storage
-int    *mat_block_ptr;       // The offset of the 1st element of a block in the packed buffer
-int    *F_PQ_blocks_to_F2;   // Mapping blocks in F_PQ_blocks to F2
-int    *F_MNPQ_blocks_to_F3; // Mapping blocks in F_MNPQ_blocks to F3
-int    *visited_Mpairs;      // Flags for marking if (M, i) is updated 
-int    *visited_Npairs;      // Flags for marking if (N, i) is updated 
-double *D_blocks;            // Packed density matrix (D) blocks
-double *D_scrval;            // Maximum (in absolute) value of each D block
-double *F_PQ_blocks;         // Packed F_PQ (J_PQ) blocks
-double *F_MNPQ_blocks;       // Packed F_{MP, NP, MQ, NQ} (K_{MP, NP, MQ, NQ}) blocks
-double *F_M_band_blocks;     // Thread-private buffer for F_MP and F_MQ blocks with the same M
-double *F_N_band_blocks;     // Thread-private buffer for F_NP and F_NQ blocks with the same N
-
-// Fixed pointers & values from PFock_t
-BasisSet_t basis;
-SIMINT_t   simint;
-int    nbf, nshells, nsp, nbf2, F_PQ_block_size;
-int    F_PQ_offset, myrank, maxcolfuncs, num_CPU_F, num_dup_F;
-int    ncpu_f, num_dmat, sizeX1, sizeX2, sizeX3, ldX1, ldX2, ldX3;
-int    *f_startind, *shell_bf_num; 
-int    *shellptr, *shellid, *shellrid;
-int    *rowpos, *colpos, *rowptr, *colptr;
-int    *blkrowptr_sh, *blkcolptr_sh;
-double tolscr2, *shellvalue, *D_mat, *F1, *nitl, *nsq;
+#include "fock_engine.h"
+
+// The offset of the 1st element of block (M, N) in the packed buffer,
+// all blocks of a shell row are stored one after another
+static inline int block_ptr(FockEngine_t fe, int M, int N)
+{
+    return fe->blk_shell_fptr[M] * fe->blk_nbf + fe->shell_bf_num[M] * fe->blk_shell_fptr[N];
+}
+
+// The offset of the 1st block of shell row M in the packed buffer
+static inline int row_block_ptr(FockEngine_t fe, int M)
+{
+    return fe->blk_shell_fptr[M] * fe->blk_nbf;
+}
+
+// Index of block (M, N) in the block maps
+static inline int block_id(FockEngine_t fe, int M, int N)
+{
+    return fe->blk_shell_idx[M] * fe->blk_nshells + fe->blk_shell_idx[N];
+}
 
 #include "update_F.h"
+#include "update_F_simd.h"
+#include "update_F_sp.h"
+#include "update_F_bra.h"
 
 #define UPDATE_F_OPT_BUFFER_ARGS \
-    tid, num_dmat, &batch_integrals[ipair * batch_nints], \
+    fe, tid, dmat_id, &batch_integrals[ipair * batch_nints], \
     fock_info_list[0],  \
     fock_info_list[1],  \
     fock_info_list[2],  \
@@ -70,29 +56,65 @@ double tolscr2, *shellvalue, *D_mat, *F1, *nitl, *nsq;
     M, N, P_list[ipair], Q_list[ipair], \
     thread_F_M_band_blocks, thread_M_bank_offset, \
     thread_F_N_band_blocks, thread_N_bank_offset, \
-    thread_F_PQ_blocks
+    J_PQ
 
-void update_F_with_KetShellPairList(
-    int tid, int num_dmat, double *batch_integrals, int batch_nints, int npairs, 
-    int M, int N, KetShellPairList_s *target_shellpair_list, 
-    double *thread_F_M_band_blocks, double *thread_F_N_band_blocks
+// Destination of the J_PQ block of ket pair PQ_id in the current task
+static inline double *J_PQ_block(FockEngine_t fe, int tid, int dmat_id, int PQ_id, int P, int Q, int startPQ)
+{
+    if (fe->JPQ_acc_mode == JPQ_ACC_TILE)
+    {
+        double *thread_J_PQ_tile = fe->J_PQ_tiles + (size_t) (tid * fe->max_numdmat2 + dmat_id) * fe->J_PQ_tile_size;
+        return thread_J_PQ_tile + (fe->J_PQ_tile_ptr[PQ_id] - fe->J_PQ_tile_ptr[startPQ]);
+    }
+    double *thread_F_PQ_blocks = fe->F_PQ_blocks + (size_t) (dmat_id * fe->num_dup_F + tid / fe->num_CPU_F) * fe->F_PQ_block_size;
+    return thread_F_PQ_blocks + (block_ptr(fe, P, Q) - fe->F_PQ_offset);
+}
+
+static void update_F_with_KetShellPairList_dmat(
+    FockEngine_t fe, int tid, int dmat_id, double *batch_integrals, int batch_nints, int npairs, 
+    int M, int N, int startPQ, KetShellPairList_s *target_shellpair_list, 
+    double *thread_F_M_band_blocks, double *thread_F_N_band_blocks, int sp_tier
 )
 {
     int load_P, write_P;
     int same_P_s = 0, same_P_e = 0;
     int *P_list = target_shellpair_list->P_list;
     int *Q_list = target_shellpair_list->Q_list;
-    int thread_M_bank_offset = mat_block_ptr[M * nshells];
-    int thread_N_bank_offset = mat_block_ptr[N * nshells];
-    #ifdef DUP_F_PQ_BUF
-    double *thread_F_PQ_blocks = F_PQ_blocks + (tid / num_CPU_F) * F_PQ_block_size;
-    #else
-    double *thread_F_PQ_blocks = F_PQ_blocks;
-    #endif
+    int *PQ_list = target_shellpair_list->PQ_list;
+    int thread_M_bank_offset = row_block_ptr(fe, M);
+    int thread_N_bank_offset = row_block_ptr(fe, N);
+    
+    // Find the J_PQ destination of each ket pair
+    double *J_PQ_list[_SIMINT_NSHELL_SIMD];
+    for (int ipair = 0; ipair < npairs; ipair++)
+        J_PQ_list[ipair] = J_PQ_block(fe, tid, dmat_id, PQ_list[ipair], P_list[ipair], Q_list[ipair], startPQ);
     
     int *fock_info_list = target_shellpair_list->fock_quartet_info;
     int is_1111 = fock_info_list[0] * fock_info_list[1] * fock_info_list[2] * fock_info_list[3];
     
+    if (sp_tier)
+    {
+        update_F_sp_batch(
+            fe, tid, dmat_id, batch_integrals, batch_nints, npairs, M, N, 
+            P_list, Q_list, fock_info_list, J_PQ_list,
+            thread_F_M_band_blocks, thread_M_bank_offset,
+            thread_F_N_band_blocks, thread_N_bank_offset
+        );
+        return;
+    }
+    
+    // Vectorize across the ket pairs of this batch
+    if (fe->update_F_simd && npairs > 1)
+    {
+        update_F_simd_batch(
+            fe, tid, dmat_id, batch_integrals, batch_nints, npairs, M, N, 
+            P_list, Q_list, fock_info_list, J_PQ_list,
+            thread_F_M_band_blocks, thread_M_bank_offset,
+            thread_F_N_band_blocks, thread_N_bank_offset
+        );
+        return;
+    }
+    
     int curr_P = P_list[0];
     while (same_P_e < npairs)
     {
@@ -108,6 +130,8 @@ void update_F_with_KetShellPairList(
             else write_P = 0;
             
             fock_info_list = target_shellpair_list->fock_quartet_info + ipair * 16;
+            double *J_PQ = J_PQ_list[ipair];
+            
             if (is_1111 == 1)
             {
                 update_F_1111(UPDATE_F_OPT_BUFFER_ARGS);
@@ -126,144 +150,615 @@ void update_F_with_KetShellPairList(
     }
 }
 
-void init_block_buf(BasisSet_t _basis, PFock_t pfock)
+// Contract a batch of integrals with all densities while it is in cache
+void update_F_with_KetShellPairList(
+    FockEngine_t fe, int tid, double *batch_integrals, int batch_nints, int npairs, 
+    int M, int N, int startPQ, KetShellPairList_s *target_shellpair_list, 
+    double *thread_F_M_band_blocks, double *thread_F_N_band_blocks, int sp_tier
+)
 {
-    if (pfock->num_dmat != 1)
+    if (fe->JPQ_acc_mode == JPQ_ACC_TILE)
     {
-        printf("  FATAL: currently JKD blocking only supports num_dmat==1 !! Please check scf.c\n");
-        assert(num_dmat == 1);
+        char *thread_J_PQ_tile_flags = fe->J_PQ_tile_flags + (size_t) tid * fe->J_PQ_tile_npairs;
+        for (int ipair = 0; ipair < npairs; ipair++)
+            thread_J_PQ_tile_flags[target_shellpair_list->PQ_list[ipair] - startPQ] = 1;
     }
+    
+    for (int dmat_id = 0; dmat_id < fe->num_dmat; dmat_id++)
+    {
+        update_F_with_KetShellPairList_dmat(
+            fe, tid, dmat_id, batch_integrals, batch_nints, npairs,
+            M, N, startPQ, target_shellpair_list,
+            thread_F_M_band_blocks + (size_t) dmat_id * fe->band_size,
+            thread_F_N_band_blocks + (size_t) dmat_id * fe->band_size, sp_tier
+        );
+    }
+}
 
-    if (update_F_buf_size > 0) return;
+// Add shells [start_sh, end_sh) and their significant partners to the 
+// footprint marks in blk_shell_idx, return the number of newly added shells
+static int mark_footprint(FockEngine_t fe, int start_sh, int end_sh)
+{
+    int cnt = 0;
+    for (int M = start_sh; M < end_sh; M++)
+    {
+        if (fe->blk_shell_idx[M] == -1) 
+        {
+            fe->blk_shell_idx[M] = 0;
+            cnt++;
+        }
+        for (int i = fe->shellptr[M]; i < fe->shellptr[M + 1]; i++)
+        {
+            int N = fe->shellid[i];
+            if (fe->blk_shell_idx[N] == -1) 
+            {
+                fe->blk_shell_idx[N] = 0;
+                cnt++;
+            }
+        }
+    }
+    return cnt;
+}
+
+// Set the footprint to the shells reachable from the row shells 
+// [srow_sh, erow_sh) and the column shells [scol_sh, ecol_sh)
+static void set_block_footprint(FockEngine_t fe, int srow_sh, int erow_sh, int scol_sh, int ecol_sh)
+{
+    for (int i = 0; i < fe->blk_nshells; i++)
+        fe->blk_shell_idx[fe->blk_shells[i]] = -1;
     
-    MPI_Comm_rank(MPI_COMM_WORLD, &myrank);
+    mark_footprint(fe, srow_sh, erow_sh);
+    mark_footprint(fe, scol_sh, ecol_sh);
+    
+    fe->blk_nshells = 0;
+    fe->blk_nbf     = 0;
+    for (int M = 0; M < fe->nshells; M++)
+    {
+        if (fe->blk_shell_idx[M] == -1) continue;
+        fe->blk_shell_idx[M]  = fe->blk_nshells;
+        fe->blk_shell_fptr[M] = fe->blk_nbf;
+        fe->blk_shells[fe->blk_nshells] = M;
+        fe->blk_nshells++;
+        fe->blk_nbf += fe->shell_bf_num[M];
+    }
+    assert(fe->blk_nshells <= fe->blk_max_nshells);
+    assert(fe->blk_nbf     <= fe->blk_max_nbf);
+}
+
+// Size the J_PQ tiles for the largest column task block, they only 
+// grow when the task blocks are changed
+static void alloc_J_PQ_tiles(FockEngine_t fe)
+{
+    int tile_size = 0, tile_npairs = 0;
+    if (fe->JPQ_acc_mode == JPQ_ACC_TILE)
+    {
+        for (int i = 0; i < fe->ntask_cols; i++)
+        {
+            int startPQ = fe->shellptr[fe->blkcolptr_sh[i]];
+            int endPQ   = fe->shellptr[fe->blkcolptr_sh[i + 1]];
+            tile_size   = MAX(tile_size, fe->J_PQ_tile_ptr[endPQ] - fe->J_PQ_tile_ptr[startPQ]);
+            tile_npairs = MAX(tile_npairs, endPQ - startPQ);
+        }
+    }
+    if (fe->J_PQ_tiles != NULL && tile_size <= fe->J_PQ_tile_size && tile_npairs <= fe->J_PQ_tile_npairs) return;
+    
+    if (fe->J_PQ_tiles != NULL)
+    {
+        free(fe->J_PQ_tiles);
+        free(fe->J_PQ_tile_flags);
+    }
+    fe->J_PQ_tile_size   = tile_size;
+    fe->J_PQ_tile_npairs = tile_npairs;
+    fe->J_PQ_tiles      = (double*) calloc((size_t) fe->nthreads * fe->max_numdmat2 * fe->J_PQ_tile_size + 1, sizeof(double));
+    fe->J_PQ_tile_flags = (char*)   calloc((size_t) fe->nthreads * fe->J_PQ_tile_npairs + 1, sizeof(char));
+    assert(fe->J_PQ_tiles      != NULL);
+    assert(fe->J_PQ_tile_flags != NULL);
+}
+
+typedef struct
+{
+    double groupmax;  // Largest absval of the ket pairs with the same P
+    double absval;
+    int    P, j;
+} KetSortKey_s;
+
+// P groups by decreasing groupmax, each group stays contiguous
+static int cmp_ket_sort_key(const void *a, const void *b)
+{
+    const KetSortKey_s *ka = (const KetSortKey_s *) a;
+    const KetSortKey_s *kb = (const KetSortKey_s *) b;
+    if (ka->groupmax > kb->groupmax) return -1;
+    if (ka->groupmax < kb->groupmax) return  1;
+    if (ka->P != kb->P) return ka->P - kb->P;
+    if (ka->absval > kb->absval) return -1;
+    if (ka->absval < kb->absval) return  1;
+    return ka->j - kb->j;
+}
+
+// Build the AM-bucketed ket pair lists of all task column blocks
+static void build_ket_lists(FockEngine_t fe)
+{
+    const int nbuckets = _SIMINT_AM_PAIRS;
+    #pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < fe->ntask_cols; c++)
+    {
+        int startP  = fe->blkcolptr_sh[c];
+        int startPQ = fe->shellptr[startP];
+        int endPQ   = fe->shellptr[fe->blkcolptr_sh[c + 1]];
+        int *bucket_ptr = fe->ket_bucket_ptr + c * (nbuckets + 1);
+        
+        int *am_index = (int*) malloc(sizeof(int) * (endPQ - startPQ + 1));
+        KetSortKey_s *keys = (KetSortKey_s*) malloc(sizeof(KetSortKey_s) * (endPQ - startPQ + 1));
+        double *P_max = (double*) malloc(sizeof(double) * (fe->blkcolptr_sh[c + 1] - startP + 1));
+        assert(am_index != NULL && keys != NULL && P_max != NULL);
+        
+        int bucket_cnt[_SIMINT_AM_PAIRS + 1];
+        memset(bucket_cnt, 0, sizeof(int) * (nbuckets + 1));
+        for (int j = startPQ; j < endPQ; j++)
+        {
+            am_index[j - startPQ] = CInt_SIMINT_getShellpairAMIndex(fe->simint, fe->shellrid[j], fe->shellid[j]);
+            bucket_cnt[am_index[j - startPQ] + 1]++;
+        }
+        bucket_ptr[0] = startPQ;
+        for (int b = 0; b < nbuckets; b++)
+            bucket_ptr[b + 1] = bucket_ptr[b] + bucket_cnt[b + 1];
+        
+        int pos[_SIMINT_AM_PAIRS];
+        for (int b = 0; b < nbuckets; b++) pos[b] = bucket_ptr[b] - startPQ;
+        for (int j = startPQ; j < endPQ; j++)
+        {
+            KetSortKey_s *key = &keys[pos[am_index[j - startPQ]]++];
+            key->absval = fabs(fe->shellvalue[j]);
+            key->P      = fe->shellrid[j];
+            key->j      = j;
+        }
+        
+        // Sort the P groups of each bucket by their largest value, the 
+        // K_MP / K_NP reloads in the digestion happen once per P run
+        for (int b = 0; b < nbuckets; b++)
+        {
+            KetSortKey_s *bkeys = keys + bucket_ptr[b] - startPQ;
+            int cnt = bucket_ptr[b + 1] - bucket_ptr[b];
+            for (int k = 0; k < cnt; k++) P_max[bkeys[k].P - startP] = 0.0;
+            for (int k = 0; k < cnt; k++)
+                P_max[bkeys[k].P - startP] = MAX(P_max[bkeys[k].P - startP], bkeys[k].absval);
+            for (int k = 0; k < cnt; k++) bkeys[k].groupmax = P_max[bkeys[k].P - startP];
+            if (cnt > 1) qsort(bkeys, cnt, sizeof(KetSortKey_s), cmp_ket_sort_key);
+        }
+        
+        for (int k = startPQ; k < endPQ; k++)
+        {
+            int j = keys[k - startPQ].j;
+            int P = fe->shellrid[j];
+            fe->ket_j[k]     = j;
+            fe->ket_P[k]     = P;
+            fe->ket_Q[k]     = fe->shellid[j];
+            fe->ket_iX3P[k]  = fe->colpos[P];
+            fe->ket_iXQ[k]   = fe->colptr[j];
+            fe->ket_value[k] = fe->shellvalue[j];
+            fe->ket_group_max[k] = keys[k - startPQ].groupmax;
+            fe->ket_rank[j]  = k;
+        }
+        
+        free(am_index);
+        free(keys);
+        free(P_max);
+    }
+}
+
+void update_task_blocks(PFock_t pfock)
+{
+    FockEngine_t fe = pfock->fock_engine;
+    alloc_J_PQ_tiles(fe);
+    build_ket_lists(fe);
+}
+
+void collect_shell_time(PFock_t pfock, double *shell_time)
+{
+    FockEngine_t fe = pfock->fock_engine;
+    for (int t = 0; t < fe->nthreads; t++)
+    {
+        double *thread_shell_time = fe->shell_time_buf + (size_t) t * fe->nshells;
+        for (int M = 0; M < fe->nshells; M++)
+        {
+            shell_time[M] += thread_shell_time[M];
+            thread_shell_time[M] = 0.0;
+        }
+    }
+}
+
+void set_F1_buffer(PFock_t pfock, double *_F1)
+{
+    pfock->fock_engine->F1 = _F1;
+}
+
+void init_block_buf(BasisSet_t _basis, PFock_t pfock)
+{
+    // The engine is created by the first call, later calls only update it.
+    // The number of densities may change between builds, 
+    // all buffers are allocated for max_numdmat2 densities.
+    // Without symmetry each density is split into two slots
+    FockEngine_t fe = pfock->fock_engine;
+    if (fe == NULL)
+    {
+        fe = (FockEngine_t) calloc(1, sizeof(struct FockEngine));
+        assert(fe != NULL);
+        omp_init_lock(&fe->task_lock);
+        pfock->fock_engine = fe;
+    }
+    fe->num_dmat = pfock->num_dmat2;
+    
+    // Partial D replication is turned off by an incremental build
+    fe->D_mat     = pfock->D_mat;
+    fe->D_partial = pfock->D_partial;
+    
+    // The block maxima are of the previous D until update_D_bounds()
+    // has seen all of the new D
+    fe->D_blockmax_valid = 0;
+    
+    if (fe->update_F_buf_size > 0) return;
+    
+    MPI_Comm_rank(MPI_COMM_WORLD, &fe->myrank);
     
     // Copy fixed pointers
-    basis        = _basis;
-    simint       = pfock->simint;
-    ncpu_f       = pfock->ncpu_f;
-    num_dmat     = pfock->num_dmat2;
-    shellptr     = pfock->shellptr;
-    shellvalue   = pfock->shellvalue;
-    shellid      = pfock->shellid;
-    shellrid     = pfock->shellrid;
-    f_startind   = pfock->f_startind;
-    rowpos       = pfock->rowpos;
-    colpos       = pfock->colpos;
-    rowptr       = pfock->rowptr;
-    colptr       = pfock->colptr;
-    tolscr2      = pfock->tolscr2;
-    nbf          = pfock->nbf;
-    nshells      = pfock->nshells;
-    nsp          = nshells * nshells;
-    nbf2         = nbf * nbf;
-    maxcolfuncs  = pfock->maxcolfuncs;
-    nthreads     = pfock->nthreads;
-    D_mat        = pfock->D_mat;
-    F1           = pfock->F1;
-    nitl         = &pfock->uitl;
-    nsq          = &pfock->usq;
-    sizeX1       = pfock->sizeX1;
-    sizeX2       = pfock->sizeX2;
-    sizeX3       = pfock->sizeX3;
-    ldX1         = pfock->maxrowsize;
-    ldX2         = pfock->maxcolsize;
-    ldX3         = pfock->maxcolsize;
-    blkrowptr_sh = pfock->blkrowptr_sh;
-    blkcolptr_sh = pfock->blkcolptr_sh;
-    
-    // Decide how many copies of F_PQ_blocks to use
-    #ifdef DUP_F_PQ_BUF
-    num_CPU_F = 1;
-    num_dup_F = nthreads;
-    #else
-    num_CPU_F = nthreads;
-    num_dup_F = 1;
-    #endif
-    if (myrank == 0)
-    {
-        if (num_CPU_F == 1) printf("  F_PQ_blocks won't use atomic add\n");
-        else printf("  F_PQ_blocks will use atomic add\n");
+    fe->basis        = _basis;
+    fe->simint       = pfock->simint;
+    fe->ncpu_f       = pfock->ncpu_f;
+    fe->max_numdmat2 = pfock->max_numdmat2;
+    fe->shellptr     = pfock->shellptr;
+    fe->shellvalue   = pfock->shellvalue;
+    fe->shellid      = pfock->shellid;
+    fe->shellrid     = pfock->shellrid;
+    fe->f_startind   = pfock->f_startind;
+    fe->rowpos       = pfock->rowpos;
+    fe->colpos       = pfock->colpos;
+    fe->rowptr       = pfock->rowptr;
+    fe->colptr       = pfock->colptr;
+    fe->tolscr2      = pfock->tolscr2;
+    fe->nbf          = pfock->nbf;
+    fe->nshells      = pfock->nshells;
+    fe->nbf2         = fe->nbf * fe->nbf;
+    fe->maxcolfuncs  = pfock->maxcolfuncs;
+    fe->nthreads     = pfock->nthreads;
+    fe->F1           = pfock->F1;
+    fe->nitl         = &pfock->uitl;
+    fe->nsq          = &pfock->usq;
+    fe->sizeX1       = pfock->sizeX1;
+    fe->sizeX2       = pfock->sizeX2;
+    fe->sizeX3       = pfock->sizeX3;
+    fe->ldX1         = pfock->maxrowsize;
+    fe->ldX2         = pfock->maxcolsize;
+    fe->ldX3         = pfock->maxcolsize;
+    fe->blkrowptr_sh = pfock->blkrowptr_sh;
+    fe->blkcolptr_sh = pfock->blkcolptr_sh;
+    fe->task_screening = pfock->task_screening;
+    fe->Dshellmax    = pfock->Dshellmax;
+    fe->blkcol_scrmax = pfock->blkcol_scrmax;
+    fe->blkcol_Dmax  = pfock->blkcol_Dmax;
+    fe->nbp_p        = pfock->nbp_p;
+    fe->ntask_cols   = pfock->npcol * pfock->nbp_p;
+    fe->eri_cache    = pfock->eri_cache;
+    fe->sp_tol       = pfock->sp_tol;
+    fe->sp_usq       = &pfock->sp_usq;
+    fe->sp_err       = &pfock->sp_err;
+    fe->simint_calls = &pfock->simint_calls;
+    fe->simint_pairs = &pfock->simint_pairs;
+    
+    // Decide how to accumulate J_PQ and how many copies of F_PQ_blocks to use
+    char *JPQ_acc_str = getenv("JPQ_ACC");
+    fe->JPQ_acc_mode = JPQ_ACC_TILE;
+    if (JPQ_acc_str != NULL)
+    {
+        fe->JPQ_acc_mode = atoi(JPQ_acc_str);
+        if ((fe->JPQ_acc_mode < JPQ_ACC_ATOMIC) || (fe->JPQ_acc_mode > JPQ_ACC_TILE)) 
+            fe->JPQ_acc_mode = JPQ_ACC_TILE;
+    }
+    if (fe->JPQ_acc_mode == JPQ_ACC_DUP)
+    {
+        fe->num_CPU_F = 1;
+        fe->num_dup_F = fe->nthreads;
+    } else {
+        fe->num_CPU_F = fe->nthreads;
+        fe->num_dup_F = 1;
     }
     
+    fe->shell_bf_num = (int*) malloc(sizeof(int) * fe->nshells);
+    assert(fe->shell_bf_num != NULL);
+    for (int i = 0; i < fe->nshells; i++)
+        fe->shell_bf_num[i] = fe->f_startind[i + 1] - fe->f_startind[i];
+    
+    // The largest footprint over all task owners bounds the packed buffers
+    fe->blk_shell_idx  = (int*) malloc(sizeof(int) * fe->nshells);
+    fe->blk_shell_fptr = (int*) malloc(sizeof(int) * fe->nshells);
+    fe->blk_shells     = (int*) malloc(sizeof(int) * fe->nshells);
+    assert(fe->blk_shell_idx  != NULL);
+    assert(fe->blk_shell_fptr != NULL);
+    assert(fe->blk_shells     != NULL);
+    for (int i = 0; i < fe->nshells; i++) fe->blk_shell_idx[i] = -1;
+    int max_row_nshells = 0, max_col_nshells = 0;
+    for (int i = 0; i < pfock->nprow; i++)
+    {
+        int cnt = mark_footprint(fe, pfock->rowptr_sh[i], pfock->rowptr_sh[i + 1]);
+        max_row_nshells = MAX(max_row_nshells, cnt);
+        for (int j = 0; j < fe->nshells; j++) fe->blk_shell_idx[j] = -1;
+    }
+    for (int i = 0; i < pfock->npcol; i++)
+    {
+        int cnt = mark_footprint(fe, pfock->colptr_sh[i], pfock->colptr_sh[i + 1]);
+        max_col_nshells = MAX(max_col_nshells, cnt);
+        for (int j = 0; j < fe->nshells; j++) fe->blk_shell_idx[j] = -1;
+    }
+    fe->blk_nshells     = 0;
+    fe->blk_max_nshells = MIN(fe->nshells, max_row_nshells + max_col_nshells);
+    fe->blk_max_nbf     = MIN(fe->nbf, pfock->maxrowsize + pfock->maxcolsize);
+    fe->blk_nbf2        = fe->blk_max_nbf * fe->blk_max_nbf;
+    int blk_nsp     = fe->blk_max_nshells * fe->blk_max_nshells;
+    
     // Allocate memory for blocked matrices
-    F_PQ_block_size = nbf * maxcolfuncs;
-    shell_bf_num  = (int*) malloc(sizeof(int) * nshells);
-    mat_block_ptr = (int*) malloc(sizeof(int) * nsp);
-    D_blocks      = (double*) malloc(sizeof(double) * nbf2);
-    D_scrval      = (double*) malloc(sizeof(double) * nshells * nshells);
-    F_PQ_blocks   = (double*) malloc(sizeof(double) * F_PQ_block_size * num_dup_F);
-    F_MNPQ_blocks = (double*) malloc(sizeof(double) * nbf2);
-    F_PQ_blocks_to_F2   = (int*) malloc(sizeof(int) * nsp);
-    F_MNPQ_blocks_to_F3 = (int*) malloc(sizeof(int) * nsp);
-    assert(mat_block_ptr != NULL);
-    assert(shell_bf_num  != NULL);
-    assert(D_blocks      != NULL);
-    assert(D_scrval      != NULL);
-    assert(F_PQ_blocks   != NULL);
-    assert(F_MNPQ_blocks != NULL);
-    assert(F_PQ_blocks_to_F2   != NULL);
-    assert(F_MNPQ_blocks_to_F3 != NULL);
-    double block_mem_MB = (double) nbf2 * 2 * sizeof(double);
-    block_mem_MB += (double) nsp * 3 * sizeof(int);
+    fe->F_PQ_block_size = fe->blk_max_nbf * fe->maxcolfuncs;
+    fe->D_blocks      = (double*) malloc(sizeof(double) * fe->blk_nbf2 * fe->max_numdmat2);
+    fe->D_scrval      = (double*) malloc(sizeof(double) * blk_nsp);
+    fe->F_PQ_blocks   = (double*) malloc(sizeof(double) * fe->F_PQ_block_size * fe->num_dup_F * fe->max_numdmat2);
+    fe->F_MNPQ_blocks = (double*) malloc(sizeof(double) * fe->blk_nbf2 * fe->max_numdmat2);
+    fe->F_PQ_blocks_to_F2   = (int*) malloc(sizeof(int) * blk_nsp);
+    fe->F_MNPQ_blocks_to_F3 = (int*) malloc(sizeof(int) * blk_nsp);
+    assert(fe->D_blocks      != NULL);
+    assert(fe->D_scrval      != NULL);
+    assert(fe->F_PQ_blocks   != NULL);
+    assert(fe->F_MNPQ_blocks != NULL);
+    assert(fe->F_PQ_blocks_to_F2   != NULL);
+    assert(fe->F_MNPQ_blocks_to_F3 != NULL);
+    fe->D_fp = NULL;
+    fe->D_fp_prev = NULL;
+    fe->fp_prev_fptr = NULL;
+    fe->fp_runs = NULL;
+    fe->gtm_Dmats = pfock->gtm_Dmats;
+    if (fe->D_partial)
+    {
+        fe->D_fp         = (double*) malloc(sizeof(double) * fe->blk_nbf2 * fe->max_numdmat2);
+        fe->D_fp_prev    = (double*) malloc(sizeof(double) * fe->blk_nbf2 * fe->max_numdmat2);
+        fe->fp_prev_fptr = (int*) malloc(sizeof(int) * fe->nshells);
+        fe->fp_runs      = (int*) malloc(sizeof(int) * 3 * fe->blk_max_nshells);
+        assert(fe->D_fp         != NULL);
+        assert(fe->D_fp_prev    != NULL);
+        assert(fe->fp_prev_fptr != NULL);
+        assert(fe->fp_runs      != NULL);
+        for (int M = 0; M < fe->nshells; M++) fe->fp_prev_fptr[M] = -1;
+        fe->fp_prev_nbf = 0;
+    }
+    // The block maxima table is nshells^2 floats per process, set env
+    // D_BLOCKMAX to 1 to trade that memory for the D rescans of each pack
+    char *blockmax_str = getenv("D_BLOCKMAX");
+    int use_blockmax = (blockmax_str != NULL) ? atoi(blockmax_str) : 0;
+    fe->D_blockmax = NULL;
+    if (use_blockmax && !fe->D_partial)
+    {
+        fe->D_blockmax = (float*) malloc(sizeof(float) * fe->nshells * fe->nshells);
+        assert(fe->D_blockmax != NULL);
+    }
+    double block_mem_MB = (double) fe->blk_nbf2 * (fe->D_partial ? 4 : 2) * sizeof(double) * fe->max_numdmat2;
+    if (fe->D_blockmax != NULL) block_mem_MB += (double) fe->nshells * fe->nshells * sizeof(float);
+    block_mem_MB += (double) blk_nsp * (2 * sizeof(int) + sizeof(double));
+    block_mem_MB += (double) fe->nshells * 4 * sizeof(int);
     block_mem_MB /= 1048576.0;
 
     // Allocate memory for thread-local submatrices
-    _maxMomentum(basis, &maxAM);
-    max_dim = (maxAM + 1) * (maxAM + 2) / 2;
-    F_M_band_blocks = (double*) malloc(sizeof(double) * nthreads * max_dim * nbf);
-    F_N_band_blocks = (double*) malloc(sizeof(double) * nthreads * max_dim * nbf);
-    visited_Mpairs  = (int*) malloc(sizeof(int) * nthreads * nshells);
-    visited_Npairs  = (int*) malloc(sizeof(int) * nthreads * nshells);
-    assert(F_M_band_blocks != NULL);
-    assert(F_N_band_blocks != NULL);
-    assert(visited_Mpairs  != NULL);
-    assert(visited_Npairs  != NULL);
-    double thread_buf_mem_MB = (double) nbf * 2 * (double) max_dim * sizeof(double);
-    thread_buf_mem_MB += (double) nshells * 2 * sizeof(int);
-    thread_buf_mem_MB *= (double) nthreads;
-    thread_buf_mem_MB += (double) F_PQ_block_size * num_dup_F * sizeof(double);
+    _maxMomentum(fe->basis, &fe->maxAM);
+    fe->max_dim = (fe->maxAM + 1) * (fe->maxAM + 2) / 2;
+    fe->band_size = fe->max_dim * fe->blk_max_nbf;
+    // Band buffers and flags are zeroed once here, after that only the 
+    // touched blocks are flushed and reset for each (M, N) pair
+    fe->F_M_band_blocks = (double*) calloc((size_t) fe->nthreads * fe->max_numdmat2 * fe->band_size, sizeof(double));
+    fe->F_N_band_blocks = (double*) calloc((size_t) fe->nthreads * fe->max_numdmat2 * fe->band_size, sizeof(double));
+    fe->visited_shells  = (int*) calloc(fe->nthreads * fe->nshells, sizeof(int));
+    fe->shell_time_buf  = (double*) calloc((size_t) fe->nthreads * fe->nshells, sizeof(double));
+    assert(fe->shell_time_buf != NULL);
+    fe->touched_shells  = (int*) malloc(sizeof(int) * fe->nthreads * fe->nshells);
+    assert(fe->F_M_band_blocks != NULL);
+    assert(fe->F_N_band_blocks != NULL);
+    assert(fe->visited_shells  != NULL);
+    assert(fe->touched_shells  != NULL);
+    double thread_buf_mem_MB = (double) fe->band_size * 2 * fe->max_numdmat2 * sizeof(double);
+    thread_buf_mem_MB += (double) fe->nshells * 2 * sizeof(int);
+    thread_buf_mem_MB *= (double) fe->nthreads;
+    thread_buf_mem_MB += (double) fe->F_PQ_block_size * fe->num_dup_F * fe->max_numdmat2 * sizeof(double);
     thread_buf_mem_MB /= 1048576.0;
     
-    int max_buf_entry_size = max_dim * max_dim;
-    update_F_buf_size = 6 * max_buf_entry_size;
-    update_F_buf = _mm_malloc(sizeof(double) * nthreads * update_F_buf_size, 64);
-    assert(update_F_buf != NULL);
-    
-    if (myrank == 0) 
+    // J_PQ tiles: each thread packs the J_PQ blocks of a task's ket pairs 
+    // contiguously, so a tile only needs the screened footprint of one task
+    int nnz = pfock->nnz;
+    fe->J_PQ_tile_ptr = (int*) malloc(sizeof(int) * (nnz + 1));
+    assert(fe->J_PQ_tile_ptr != NULL);
+    fe->J_PQ_tile_ptr[0] = 0;
+    for (int j = 0; j < nnz; j++)
     {
-        printf("  Blocking matrix = %.2lf MB, ", block_mem_MB);
-        printf("thread-local blocking buffer = %.2lf MB\n", thread_buf_mem_MB);
+        int dimP = fe->f_startind[fe->shellrid[j] + 1] - fe->f_startind[fe->shellrid[j]];
+        int dimQ = fe->f_startind[fe->shellid[j]  + 1] - fe->f_startind[fe->shellid[j]];
+        fe->J_PQ_tile_ptr[j + 1] = fe->J_PQ_tile_ptr[j] + dimP * dimQ;
     }
+    fe->J_PQ_tiles = NULL;
+    alloc_J_PQ_tiles(fe);
+    
+    fe->ket_bucket_ptr = (int*) malloc(sizeof(int) * fe->ntask_cols * (_SIMINT_AM_PAIRS + 1));
+    fe->ket_P     = (int*) malloc(sizeof(int) * nnz);
+    fe->ket_Q     = (int*) malloc(sizeof(int) * nnz);
+    fe->ket_j     = (int*) malloc(sizeof(int) * nnz);
+    fe->ket_iX3P  = (int*) malloc(sizeof(int) * nnz);
+    fe->ket_iXQ   = (int*) malloc(sizeof(int) * nnz);
+    fe->ket_rank  = (int*) malloc(sizeof(int) * nnz);
+    fe->ket_value = (double*) malloc(sizeof(double) * nnz);
+    fe->ket_group_max = (double*) malloc(sizeof(double) * nnz);
+    assert(fe->ket_bucket_ptr != NULL);
+    assert(fe->ket_P    != NULL && fe->ket_Q   != NULL && fe->ket_j    != NULL);
+    assert(fe->ket_iX3P != NULL && fe->ket_iXQ != NULL && fe->ket_rank != NULL);
+    assert(fe->ket_value != NULL && fe->ket_group_max != NULL);
+    build_ket_lists(fe);
+    block_mem_MB += ((double) nnz * (6 * sizeof(int) + sizeof(double)) 
+                  + (double) fe->ntask_cols * (_SIMINT_AM_PAIRS + 1) * sizeof(int)) / 1048576.0;
+    double tile_mem_MB = (double) fe->J_PQ_tile_size * fe->max_numdmat2 * sizeof(double) + (double) fe->J_PQ_tile_npairs;
+    tile_mem_MB *= (double) fe->nthreads;
+    tile_mem_MB += (double) (nnz + 1) * sizeof(int);
+    tile_mem_MB /= 1048576.0;
     
-    for (int i = 0; i < nshells; i++)
-        shell_bf_num[i] = f_startind[i + 1] - f_startind[i];
+    int max_buf_entry_size = fe->max_dim * fe->max_dim;
+    fe->update_F_buf_size = 6 * max_buf_entry_size;
+    fe->update_F_buf = _mm_malloc(sizeof(double) * fe->nthreads * fe->max_numdmat2 * fe->update_F_buf_size, 64);
+    assert(fe->update_F_buf != NULL);
     
-    int pos = 0, idx = 0;
-    for (int i = 0; i < nshells; i++)
+    // Batch-vectorized update_F, set env UPDATE_F_SIMD=0 to use per-pair kernels
+    char *update_F_simd_str = getenv("UPDATE_F_SIMD");
+    fe->update_F_simd = (update_F_simd_str != NULL) ? atoi(update_F_simd_str) : 1;
+    fe->update_F_simd_buf_size = update_F_simd_buf_entries(fe->max_dim);
+    if (fe->update_F_simd)
     {
-        for (int j = 0; j < nshells; j++)
+        fe->update_F_simd_buf = _mm_malloc(sizeof(double) * fe->nthreads * fe->update_F_simd_buf_size, 64);
+        assert(fe->update_F_simd_buf != NULL);
+        thread_buf_mem_MB += (double) fe->nthreads * fe->update_F_simd_buf_size * sizeof(double) / 1048576.0;
+    }
+    if (fe->sp_tol > 0.0)
+    {
+        fe->update_F_sp_buf = _mm_malloc(sizeof(float) * fe->nthreads * fe->update_F_simd_buf_size, 64);
+        assert(fe->update_F_sp_buf != NULL);
+        thread_buf_mem_MB += (double) fe->nthreads * fe->update_F_simd_buf_size * sizeof(float) / 1048576.0;
+    }
+    
+    // Bra batching, set env BRA_BATCH to the number of bra pairs per chunk.
+    // The swapped integrals are not stored by the ERI cache, it is off then
+    char *bra_batch_str = getenv("BRA_BATCH");
+    fe->bra_batch = (bra_batch_str != NULL) ? atoi(bra_batch_str) : 0;
+    fe->bra_batch = MIN(fe->bra_batch, _SIMINT_NSHELL_SIMD);
+    if (fe->eri_cache != NULL) fe->bra_batch = 0;
+    if (fe->bra_batch > 1)
+    {
+        size_t nslots = (size_t) fe->nthreads * (fe->bra_batch - 1);
+        fe->bra_J_MN_buf       = (double*) malloc(sizeof(double) * fe->nthreads * fe->bra_batch * fe->max_numdmat2 * fe->update_F_buf_size);
+        fe->bra_N_band_blocks  = (double*) calloc(nslots * fe->max_numdmat2 * fe->band_size, sizeof(double));
+        fe->bra_visited_shells = (int*) calloc((size_t) fe->nthreads * fe->bra_batch * fe->nshells, sizeof(int));
+        fe->bra_touched_shells = (int*) malloc(sizeof(int) * fe->nthreads * fe->bra_batch * fe->nshells);
+        fe->bra_quartet_listss = (ThreadQuartetLists_t*) malloc(sizeof(ThreadQuartetLists_t) * nslots);
+        assert(fe->bra_J_MN_buf       != NULL);
+        assert(fe->bra_N_band_blocks  != NULL);
+        assert(fe->bra_visited_shells != NULL);
+        assert(fe->bra_touched_shells != NULL);
+        assert(fe->bra_quartet_listss != NULL);
+        for (size_t i = 0; i < nslots; i++)
         {
-            mat_block_ptr[idx] = pos;
-            pos += shell_bf_num[i] * shell_bf_num[j];
-            idx++;
+            fe->bra_quartet_listss[i] = (ThreadQuartetLists_t) malloc(sizeof(ThreadQuartetLists_s));
+            init_ThreadQuartetLists(fe->bra_quartet_listss[i]);
         }
+        double bra_mem_MB = (double) nslots * fe->max_numdmat2 * fe->band_size * sizeof(double);
+        bra_mem_MB += (double) fe->nthreads * fe->bra_batch * (fe->max_numdmat2 * fe->update_F_buf_size * sizeof(double) + fe->nshells * 2 * sizeof(int));
+        thread_buf_mem_MB += bra_mem_MB / 1048576.0;
     }
-
+    
+    if (fe->myrank == 0) 
+    {
+        printf("  Blocking matrix = %.2lf MB (%d of %d shells), ", block_mem_MB, fe->blk_max_nshells, fe->nshells);
+        printf("thread-local blocking buffer = %.2lf MB\n", thread_buf_mem_MB);
+        if (fe->JPQ_acc_mode == JPQ_ACC_ATOMIC) 
+            printf("  J_PQ accumulation: atomic add on shared F_PQ_blocks\n");
+        if (fe->JPQ_acc_mode == JPQ_ACC_DUP) 
+            printf("  J_PQ accumulation: %d F_PQ_blocks copies\n", fe->num_dup_F);
+        if (fe->JPQ_acc_mode == JPQ_ACC_TILE) 
+            printf("  J_PQ accumulation: thread-private tiles = %.2lf MB\n", tile_mem_MB);
+        if (fe->update_F_simd) printf("  update_F vectorized across ket batches\n");
+        if (fe->bra_batch > 1) printf("  Bra batching: up to %d bra pairs per Simint batch\n", fe->bra_batch);
+    }
+    
     // Allocate and init each thread's shell quartet list and simint multi shellpair
-    thread_quartet_listss   = (ThreadQuartetLists_t*) malloc(sizeof(ThreadQuartetLists_t) * nthreads);
-    thread_multi_shellpairs = (void**) malloc(sizeof(void*) * nthreads);
-    assert(thread_quartet_listss   != NULL);
-    assert(thread_multi_shellpairs != NULL); 
-    for (int i = 0; i < nthreads; i++)
+    fe->thread_quartet_listss    = (ThreadQuartetLists_t*) malloc(sizeof(ThreadQuartetLists_t) * fe->nthreads);
+    fe->thread_quartet_listss_sp = (ThreadQuartetLists_t*) malloc(sizeof(ThreadQuartetLists_t) * fe->nthreads);
+    fe->thread_multi_shellpairs  = (void**) malloc(sizeof(void*) * fe->nthreads);
+    assert(fe->thread_quartet_listss    != NULL);
+    assert(fe->thread_quartet_listss_sp != NULL);
+    assert(fe->thread_multi_shellpairs  != NULL); 
+    for (int i = 0; i < fe->nthreads; i++)
     {
-        thread_quartet_listss[i] = (ThreadQuartetLists_t) malloc(sizeof(ThreadQuartetLists_s));
-        init_ThreadQuartetLists(thread_quartet_listss[i]);
+        fe->thread_quartet_listss[i] = (ThreadQuartetLists_t) malloc(sizeof(ThreadQuartetLists_s));
+        init_ThreadQuartetLists(fe->thread_quartet_listss[i]);
+        
+        fe->thread_quartet_listss_sp[i] = NULL;
+        if (fe->sp_tol > 0.0)
+        {
+            fe->thread_quartet_listss_sp[i] = (ThreadQuartetLists_t) malloc(sizeof(ThreadQuartetLists_s));
+            init_ThreadQuartetLists(fe->thread_quartet_listss_sp[i]);
+        }
 
-        CInt_SIMINT_createThreadMultishellpair(&thread_multi_shellpairs[i]);
+        CInt_SIMINT_createThreadMultishellpair(&fe->thread_multi_shellpairs[i]);
     }
 }
 
+static void free_quartet_lists(ThreadQuartetLists_t *listss, int n)
+{
+    if (listss == NULL) return;
+    for (int i = 0; i < n; i++)
+    {
+        if (listss[i] == NULL) continue;
+        free_ThreadQuartetLists(listss[i]);
+        free(listss[i]);
+    }
+    free(listss);
+}
+
+void free_block_buf(PFock_t pfock)
+{
+    FockEngine_t fe = pfock->fock_engine;
+    if (fe == NULL) return;
+    
+    for (int i = 0; i < fe->nthreads; i++)
+        CInt_SIMINT_freeThreadMultishellpair(&fe->thread_multi_shellpairs[i]);
+    free(fe->thread_multi_shellpairs);
+    free_quartet_lists(fe->thread_quartet_listss,    fe->nthreads);
+    free_quartet_lists(fe->thread_quartet_listss_sp, fe->nthreads);
+    free_quartet_lists(fe->bra_quartet_listss, fe->nthreads * MAX(fe->bra_batch - 1, 0));
+    
+    _mm_free(fe->update_F_buf);
+    _mm_free(fe->update_F_simd_buf);
+    _mm_free(fe->update_F_sp_buf);
+    free(fe->bra_J_MN_buf);
+    free(fe->bra_N_band_blocks);
+    free(fe->bra_visited_shells);
+    free(fe->bra_touched_shells);
+    
+    free(fe->shell_bf_num);
+    free(fe->blk_shell_idx);
+    free(fe->blk_shell_fptr);
+    free(fe->blk_shells);
+    free(fe->D_blocks);
+    free(fe->D_scrval);
+    free(fe->F_PQ_blocks);
+    free(fe->F_MNPQ_blocks);
+    free(fe->F_PQ_blocks_to_F2);
+    free(fe->F_MNPQ_blocks_to_F3);
+    free(fe->D_fp);
+    free(fe->D_fp_prev);
+    free(fe->fp_prev_fptr);
+    free(fe->fp_runs);
+    free(fe->D_blockmax);
+    free(fe->F_M_band_blocks);
+    free(fe->F_N_band_blocks);
+    free(fe->visited_shells);
+    free(fe->touched_shells);
+    free(fe->shell_time_buf);
+    free(fe->J_PQ_tile_ptr);
+    free(fe->J_PQ_tiles);
+    free(fe->J_PQ_tile_flags);
+    
+    free(fe->ket_bucket_ptr);
+    free(fe->ket_P);
+    free(fe->ket_Q);
+    free(fe->ket_j);
+    free(fe->ket_iX3P);
+    free(fe->ket_iXQ);
+    free(fe->ket_rank);
+    free(fe->ket_value);
+    free(fe->ket_group_max);
+    
+    omp_destroy_lock(&fe->task_lock);
+    free(fe);
+    pfock->fock_engine = NULL;
+}
+
 static inline void copy_matrix_block(
     double *dst, const int ldd, const double *src, const int lds, 
     const int nrows, const int ncols
@@ -273,37 +768,243 @@ static inline void copy_matrix_block(
         memcpy(dst + irow * ldd, src + irow * lds, sizeof(double) * ncols);
 }
 
-void pack_D_blocks()
+// Get D of the current footprint into D_fp. The footprint is cut into runs
+// of consecutive shells that were all in the previous footprint of this
+// build or all not, a pair of cached runs is copied from D_fp_prev and
+// the other pairs are fetched with one batch of GTM gets per density
+static void fetch_D_footprint(FockEngine_t fe)
+{
+    double *tmp = fe->D_fp_prev;
+    fe->D_fp_prev = fe->D_fp;
+    fe->D_fp = tmp;
+    
+    int *run_start  = fe->fp_runs;
+    int *run_end    = fe->fp_runs + fe->blk_max_nshells;
+    int *run_cached = fe->fp_runs + 2 * fe->blk_max_nshells;
+    int nruns = 0;
+    for (int i = 0; i < fe->blk_nshells; i++)
+    {
+        int M = fe->blk_shells[i];
+        int cached = (fe->fp_prev_fptr[M] >= 0);
+        if (nruns == 0 || M != run_end[nruns - 1] || cached != run_cached[nruns - 1])
+        {
+            run_start[nruns]  = M;
+            run_cached[nruns] = cached;
+            nruns++;
+        }
+        run_end[nruns - 1] = M + 1;
+    }
+    
+    for (int dmat_id = 0; dmat_id < fe->num_dmat; dmat_id++)
+    {
+        GTMatrix_t gtm_Dmat = fe->gtm_Dmats[dmat_id];
+        double *D_dst = fe->D_fp      + (size_t) dmat_id * fe->blk_nbf2;
+        double *D_src = fe->D_fp_prev + (size_t) dmat_id * fe->blk_nbf2;
+        GTM_startBatchGet(gtm_Dmat);
+        for (int ri = 0; ri < nruns; ri++)
+        {
+            int row0  = fe->f_startind[run_start[ri]];
+            int nrows = fe->f_startind[run_end[ri]] - row0;
+            int frow  = fe->blk_shell_fptr[run_start[ri]];
+            for (int rj = 0; rj < nruns; rj++)
+            {
+                int col0  = fe->f_startind[run_start[rj]];
+                int ncols = fe->f_startind[run_end[rj]] - col0;
+                int fcol  = fe->blk_shell_fptr[run_start[rj]];
+                double *dst = D_dst + (size_t) frow * fe->blk_nbf + fcol;
+                if (run_cached[ri] && run_cached[rj])
+                {
+                    double *src = D_src + (size_t) fe->fp_prev_fptr[run_start[ri]] * fe->fp_prev_nbf 
+                                + fe->fp_prev_fptr[run_start[rj]];
+                    copy_matrix_block(dst, fe->blk_nbf, src, fe->fp_prev_nbf, nrows, ncols);
+                } else {
+                    GTM_addGetBlockRequest(gtm_Dmat, row0, nrows, col0, ncols, dst, fe->blk_nbf);
+                }
+            }
+        }
+        GTM_execBatchGet(gtm_Dmat);
+        GTM_stopBatchGet(gtm_Dmat);
+    }
+    
+    for (int M = 0; M < fe->nshells; M++)
+        fe->fp_prev_fptr[M] = (fe->blk_shell_idx[M] >= 0) ? fe->blk_shell_fptr[M] : -1;
+    fe->fp_prev_nbf = fe->blk_nbf;
+}
+
+static void pack_D_blocks(FockEngine_t fe)
 {
     #pragma omp for 
-    for (int M = 0; M < nshells; M++)
-    {
-        for (int N = 0; N < nshells; N++)
-        {
-            int dimM    = shell_bf_num[M];
-            int dimN    = shell_bf_num[N];
-            int MN_id   = M * nshells + N;
-            int f_idx_M = f_startind[M];
-            int f_idx_N = f_startind[N];
-            double *D_src = D_mat    + f_idx_M * nbf + f_idx_N;
-            double *D_dst = D_blocks + mat_block_ptr[MN_id];
-            copy_matrix_block(D_dst, dimN, D_src, nbf, dimM, dimN);
+    for (int iM = 0; iM < fe->blk_nshells; iM++)
+    {
+        for (int iN = 0; iN < fe->blk_nshells; iN++)
+        {
+            int M       = fe->blk_shells[iM];
+            int N       = fe->blk_shells[iN];
+            int dimM    = fe->shell_bf_num[M];
+            int dimN    = fe->shell_bf_num[N];
+            int f_idx_M = fe->f_startind[M];
+            int f_idx_N = fe->f_startind[N];
             
-            double maxval = 0.0;
-            for (int i = 0; i < dimM * dimN; i++)
+            // Screen with the maximum over all densities
+            int scan = !(fe->D_blockmax_valid && !fe->D_partial);
+            double maxval = scan ? 0.0 : fe->D_blockmax[(size_t) M * fe->nshells + N];
+            for (int dmat_id = 0; dmat_id < fe->num_dmat; dmat_id++)
             {
-                double absval = fabs(D_dst[i]);
-                if (absval > maxval) maxval = absval;
+                double *D_src = fe->D_mat    + (size_t) dmat_id * fe->nbf2 + f_idx_M * fe->nbf + f_idx_N;
+                double *D_dst = fe->D_blocks + (size_t) dmat_id * fe->blk_nbf2 + block_ptr(fe, M, N);
+                int ld_src = fe->nbf;
+                if (fe->D_partial)
+                {
+                    D_src  = fe->D_fp + (size_t) dmat_id * fe->blk_nbf2 + 
+                             (size_t) fe->blk_shell_fptr[M] * fe->blk_nbf + fe->blk_shell_fptr[N];
+                    ld_src = fe->blk_nbf;
+                }
+                copy_matrix_block(D_dst, dimN, D_src, ld_src, dimM, dimN);
+                
+                for (int i = 0; scan && i < dimM * dimN; i++)
+                {
+                    double absval = fabs(D_dst[i]);
+                    if (absval > maxval) maxval = absval;
+                }
             }
-            D_scrval[MN_id] = maxval;
+            fe->D_scrval[iM * fe->blk_nshells + iN] = maxval;
+        }
+    }
+}
+
+// Set the footprint of the own tasks and return its shells
+int own_D_footprint(PFock_t pfock, int **shells)
+{
+    FockEngine_t fe = pfock->fock_engine;
+    set_block_footprint(fe, pfock->sshell_row, pfock->eshell_row + 1, 
+                        pfock->sshell_col, pfock->eshell_col + 1);
+    *shells = fe->blk_shells;
+    return fe->blk_nshells;
+}
+
+// Pack the D blocks of the own tasks' footprint
+void update_D_blocks(PFock_t pfock)
+{
+    FockEngine_t fe = pfock->fock_engine;
+    set_block_footprint(fe, pfock->sshell_row, pfock->eshell_row + 1, 
+                        pfock->sshell_col, pfock->eshell_col + 1);
+    
+    // D has changed, nothing of the previous build can be reused
+    if (fe->D_partial)
+    {
+        for (int M = 0; M < fe->nshells; M++) fe->fp_prev_fptr[M] = -1;
+        fetch_D_footprint(fe);
+    }
+    
+    #pragma omp parallel
+    pack_D_blocks(fe);
+}
+
+// Max |D| of each shell row from the local blocks of D, without D_mat
+static void local_Dshellmax(PFock_t pfock)
+{
+    FockEngine_t fe = pfock->fock_engine;
+    for (int M = 0; M < fe->nshells; M++) fe->Dshellmax[M] = 0.0;
+    for (int dmat_id = 0; dmat_id < pfock->num_dmat; dmat_id++)
+    {
+        GTMatrix_t gtm_Dmat = pfock->gtm_Dmats[dmat_id];
+        int row0  = gtm_Dmat->r_displs[gtm_Dmat->my_rowblk];
+        int ncols = gtm_Dmat->c_blklens[gtm_Dmat->my_colblk];
+        int ld    = gtm_Dmat->ld_local;
+        int sh0   = pfock->rowptr_sh[gtm_Dmat->my_rowblk];
+        int sh1   = pfock->rowptr_sh[gtm_Dmat->my_rowblk + 1];
+        #pragma omp parallel for
+        for (int M = sh0; M < sh1; M++)
+        {
+            double Dmax = fe->Dshellmax[M];
+            double *D_M = gtm_Dmat->mat_block + (size_t) (fe->f_startind[M] - row0) * ld;
+            for (int i = 0; i < fe->shell_bf_num[M]; i++)
+                for (int j = 0; j < ncols; j++)
+                    Dmax = MAX(Dmax, fabs(D_M[i * ld + j]));
+            fe->Dshellmax[M] = Dmax;
+        }
+    }
+    MPI_Allreduce(MPI_IN_PLACE, fe->Dshellmax, fe->nshells, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+}
+
+// Update the task screening bounds. Task screening covers all tasks, so
+// it needs the whole D, with D_complete == 0 the bounds are set so that
+// nothing is screened until the rest of D has arrived.
+void update_D_bounds(PFock_t pfock, int D_complete)
+{
+    FockEngine_t fe = pfock->fock_engine;
+    if (fe->D_partial)
+    {
+        local_Dshellmax(pfock);
+        update_task_screening(pfock);
+        return;
+    }
+    
+    fe->D_blockmax_valid = 0;
+    if (D_complete && fe->D_blockmax != NULL)
+    {
+        // One pass over D for the block maxima, Dshellmax is their row max.
+        // Rounded up so that the float values never screen more than D
+        #pragma omp parallel for schedule(dynamic)
+        for (int M = 0; M < fe->nshells; M++)
+        {
+            float *blockmax_M = fe->D_blockmax + (size_t) M * fe->nshells;
+            for (int N = 0; N < fe->nshells; N++) blockmax_M[N] = 0.0f;
+            for (int dmat_id = 0; dmat_id < fe->num_dmat; dmat_id++)
+            {
+                double *D_M = fe->D_mat + (size_t) dmat_id * fe->nbf2 + (size_t) fe->f_startind[M] * fe->nbf;
+                for (int r = 0; r < fe->shell_bf_num[M]; r++)
+                {
+                    double *D_r = D_M + (size_t) r * fe->nbf;
+                    for (int N = 0; N < fe->nshells; N++)
+                    {
+                        float maxval = blockmax_M[N];
+                        for (int c = fe->f_startind[N]; c < fe->f_startind[N + 1]; c++)
+                            maxval = MAX(maxval, (float) fabs(D_r[c]));
+                        blockmax_M[N] = maxval;
+                    }
+                }
+            }
+            float Dmax = 0.0f;
+            for (int N = 0; N < fe->nshells; N++)
+            {
+                blockmax_M[N] *= 1.0f + 2.0f * FLT_EPSILON;
+                Dmax = MAX(Dmax, blockmax_M[N]);
+            }
+            fe->Dshellmax[M] = Dmax;
+        }
+        fe->D_blockmax_valid = 1;
+        update_task_screening(pfock);
+        return;
+    }
+    
+    #pragma omp parallel for
+    for (int M = 0; M < fe->nshells; M++)
+    {
+        double Dmax = D_complete ? 0.0 : HUGE_VAL;
+        for (int dmat_id = 0; D_complete && dmat_id < fe->num_dmat; dmat_id++)
+        {
+            double *D_M = fe->D_mat + (size_t) dmat_id * fe->nbf2 + (size_t) fe->f_startind[M] * fe->nbf;
+            for (int i = 0; i < fe->shell_bf_num[M] * fe->nbf; i++)
+                Dmax = MAX(Dmax, fabs(D_M[i]));
         }
+        fe->Dshellmax[M] = Dmax;
     }
+    update_task_screening(pfock);
+}
+
+// Update the task screening bounds and pack D, the pack reuses the
+// block maxima computed for the bounds
+void update_D_screening(PFock_t pfock)
+{
+    update_D_bounds(pfock, 1);
+    update_D_blocks(pfock);
 }
 
 void mark_JK_with_KetShellPairList(
-    int M, int N, int npairs, KetShellPairList_s *target_shellpair_list,
+    FockEngine_t fe, int M, int N, int npairs, KetShellPairList_s *target_shellpair_list,
     double *D_mat, int *f_startind, int nbf, 
-    int *thread_visited_Mpairs, int *thread_visited_Npairs
+    int *thread_visited_shells, int *thread_touched_shells, int *num_touched
 )
 {
     int prev_P = -1;
@@ -324,275 +1025,841 @@ void mark_JK_with_KetShellPairList(
         
         if (prev_P != P_list[ipair]) 
         {
-            F_MNPQ_blocks_to_F3[M * nshells + P] = iMP;
-            F_MNPQ_blocks_to_F3[N * nshells + P] = iNP;
+            fe->F_MNPQ_blocks_to_F3[block_id(fe, M, P)] = iMP;
+            fe->F_MNPQ_blocks_to_F3[block_id(fe, N, P)] = iNP;
             
-            thread_visited_Mpairs[P] = 1;
-            thread_visited_Npairs[P] = 1;
+            if (!thread_visited_shells[P])
+            {
+                thread_visited_shells[P] = 1;
+                thread_touched_shells[(*num_touched)++] = P;
+            }
         }
         
-          F_PQ_blocks_to_F2[P * nshells + Q] = iPQ;
-        F_MNPQ_blocks_to_F3[M * nshells + Q] = iMQ;
-        F_MNPQ_blocks_to_F3[N * nshells + Q] = iNQ;
+          fe->F_PQ_blocks_to_F2[block_id(fe, P, Q)] = iPQ;
+        fe->F_MNPQ_blocks_to_F3[block_id(fe, M, Q)] = iMQ;
+        fe->F_MNPQ_blocks_to_F3[block_id(fe, N, Q)] = iNQ;
         
-        thread_visited_Mpairs[Q] = 1;
-        thread_visited_Npairs[Q] = 1;
+        if (!thread_visited_shells[Q])
+        {
+            thread_visited_shells[Q] = 1;
+            thread_touched_shells[(*num_touched)++] = Q;
+        }
         
         prev_P = P_list[ipair];
     }
 }
 
-// for SCF, J = K
-// Batched ERI version
-void fock_task(
-    int nblks_col, int sblk_row, int sblk_col, 
-    int task, int startrow, int startcol, int repack_D
+// Compute the integrals of a ket shellpair list, or replay them from the
+// ERI cache, update F with them and reset the list. Return the number of
+// ket pairs computed by Simint, 0 if the batch was replayed
+static int process_KetShellPairList(
+    FockEngine_t fe, int tid, int MN, int M, int N, int startPQ, int eri_task,
+    ThreadQuartetLists_t thread_quartet_lists, KetShellPairList_s *target_shellpair_list,
+    void **thread_multi_shellpair,
+    int *thread_visited_shells, int *thread_touched_shells, int *num_touched,
+    double *thread_F_M_band_blocks, double *thread_F_N_band_blocks, int sp_tier
+)
+{
+    int npairs = target_shellpair_list->num_shellpairs;
+    int *fock_info_list = target_shellpair_list->fock_quartet_info;
+    int nints = fock_info_list[0] * fock_info_list[1] * fock_info_list[2] * fock_info_list[3];
+    double *thread_batch_integrals;
+    int thread_batch_nints, simint_npairs = 0;
+    double st, et;
+    
+    mark_JK_with_KetShellPairList(
+        fe, M, N, npairs, target_shellpair_list,
+        fe->D_mat, fe->f_startind, fe->nbf, 
+        thread_visited_shells, thread_touched_shells, num_touched
+    );
+    
+    if (load_ERICache_batch(
+        fe->eri_cache, tid, MN, target_shellpair_list->PQ_list, 
+        npairs, nints, &thread_batch_integrals
+    ))
+    {
+        thread_batch_nints = nints;
+    } else {
+        st = CInt_get_walltime_sec();
+        CInt_computeShellQuartetBatch_SIMINT(
+            fe->simint, tid,
+            thread_quartet_lists->M, 
+            thread_quartet_lists->N, 
+            target_shellpair_list->P_list,
+            target_shellpair_list->Q_list,
+            npairs, &thread_batch_integrals, &thread_batch_nints,
+            thread_multi_shellpair
+        );
+        et = CInt_get_walltime_sec();
+        simint_npairs = npairs;
+        if (fe->eri_cache != NULL && fe->eri_cache->state == ERI_CACHE_SURVEY)
+            time_ERICache_batch(fe->eri_cache, tid, nints, et - st);
+        if (thread_batch_nints == nints)
+        {
+            store_ERICache_batch(
+                fe->eri_cache, eri_task, MN, target_shellpair_list->PQ_list, 
+                npairs, nints, thread_batch_integrals
+            );
+        }
+    }
+    
+    if (thread_batch_nints > 0)
+    {
+        st = CInt_get_walltime_sec();
+        update_F_with_KetShellPairList(
+            fe, tid, thread_batch_integrals, thread_batch_nints,
+            npairs, M, N, startPQ, target_shellpair_list,
+            thread_F_M_band_blocks, thread_F_N_band_blocks, sp_tier
+        );
+        et = CInt_get_walltime_sec();
+        if (tid == 0) CInt_SIMINT_addupdateFtimer(fe->simint, et - st);
+    }
+    
+    // Ket shellpair list is processed, reset it
+    reset_KetShellPairList(target_shellpair_list);
+    return simint_npairs;
+}
+
+// Add all threads' tile blocks of ket pair j to F_PQ_blocks and reset them
+static void merge_J_PQ_tiles(FockEngine_t fe, int j, int startPQ)
+{
+    int tile_idx    = j - startPQ;
+    int tile_offset = fe->J_PQ_tile_ptr[j] - fe->J_PQ_tile_ptr[startPQ];
+    int dimPQ       = fe->J_PQ_tile_ptr[j + 1] - fe->J_PQ_tile_ptr[j];
+    int J_PQ_offset = block_ptr(fe, fe->shellrid[j], fe->shellid[j]) - fe->F_PQ_offset;
+    for (int t = 0; t < fe->nthreads; t++)
+    {
+        char *flag = fe->J_PQ_tile_flags + (size_t) t * fe->J_PQ_tile_npairs + tile_idx;
+        if (*flag == 0) continue;
+        for (int dmat_id = 0; dmat_id < fe->num_dmat; dmat_id++)
+        {
+            double *J_PQ = fe->F_PQ_blocks + (size_t) dmat_id * fe->num_dup_F * fe->F_PQ_block_size + J_PQ_offset;
+            double *tile_block = fe->J_PQ_tiles + (size_t) (t * fe->max_numdmat2 + dmat_id) * fe->J_PQ_tile_size + tile_offset;
+            direct_add_vector(J_PQ, tile_block, dimPQ);
+            memset(tile_block, 0, sizeof(double) * dimPQ);
+        }
+        *flag = 0;
+    }
+}
+
+// Bounds of one task, shared by all of its (M, N) work items
+typedef struct
+{
+    int    startrow, startcol;  // First row and column shell of the task owner
+    int    colblk;              // Task column block, for the ket pair lists
+    int    startMN, endMN;
+    int    startPQ, endPQ;
+    double PQ_scrmax, PQ_Dmax;  // Bound of the ket side for screening whole MN pairs
+    int    eri_task;            // Global task index for the ERI cache disk extents
+} FockTaskInfo_s;
+
+// Per-thread buffers and counters of the task loop
+typedef struct
+{
+    int    tid;
+    double *F_M_band_blocks;
+    double *F_N_band_blocks;
+    int    *visited_shells;
+    int    *touched_shells;
+    double *shell_time;
+    ThreadQuartetLists_t quartet_lists;
+    ThreadQuartetLists_t quartet_lists_sp;
+    void   *multi_shellpair;
+    double nsq, nitl, sp_nsq, sp_err;
+    double simint_calls, simint_pairs;
+} FockThreadState_s;
+
+// One bra pair in flight: its F_N band, the shells its F_{MP, NP, MQ, NQ}
+// blocks touched, and its quartet lists. J_MN is only used by a bra batch,
+// a single bra pair accumulates J_MN in update_F_buf
+typedef struct
+{
+    int    i, M, N, iMN;
+    double *J_MN;
+    double *F_N_band_blocks;
+    int    *visited_shells;
+    int    *touched_shells;
+    int    num_touched;
+    ThreadQuartetLists_t quartet_lists;
+} FockBraSlot_s;
+
+static void set_FockTaskInfo(
+    FockEngine_t fe, FockTaskInfo_s *ti, int nblks_col, int sblk_row, int sblk_col, 
+    int task, int startrow, int startcol
 )
 {
-    int rowid   = task / nblks_col;
-    int colid   = task % nblks_col;
-    int startM  = blkrowptr_sh[sblk_row + rowid];
-    int endM    = blkrowptr_sh[sblk_row + rowid + 1] - 1;
-    int startP  = blkcolptr_sh[sblk_col + colid];
-    int endP    = blkcolptr_sh[sblk_col + colid + 1] - 1;
-    int startMN = shellptr[startM];
-    int endMN   = shellptr[endM + 1];
-    int startPQ = shellptr[startP];
-    int endPQ   = shellptr[endP + 1];
+    int rowid  = task / nblks_col;
+    int colid  = task % nblks_col;
+    int startM = fe->blkrowptr_sh[sblk_row + rowid];
+    int endM   = fe->blkrowptr_sh[sblk_row + rowid + 1] - 1;
+    int startP = fe->blkcolptr_sh[sblk_col + colid];
+    int endP   = fe->blkcolptr_sh[sblk_col + colid + 1] - 1;
+    ti->startrow  = startrow;
+    ti->startcol  = startcol;
+    ti->colblk    = sblk_col + colid;
+    ti->startMN   = fe->shellptr[startM];
+    ti->endMN     = fe->shellptr[endM + 1];
+    ti->startPQ   = fe->shellptr[startP];
+    ti->endPQ     = fe->shellptr[endP + 1];
+    ti->PQ_scrmax = fe->blkcol_scrmax[sblk_col + colid];
+    ti->PQ_Dmax   = fe->blkcol_Dmax[sblk_col + colid];
+    
+    ti->eri_task  = (sblk_row + rowid) * fe->ntask_cols + sblk_col + colid;
+    prefetch_ERICache_task(fe->eri_cache, ti->eri_task);
+}
+
+static void init_FockThreadState(FockEngine_t fe, FockThreadState_s *ts, int tid)
+{
+    ts->tid              = tid;
+    ts->F_M_band_blocks  = fe->F_M_band_blocks + (size_t) tid * fe->max_numdmat2 * fe->band_size;
+    ts->F_N_band_blocks  = fe->F_N_band_blocks + (size_t) tid * fe->max_numdmat2 * fe->band_size;
+    ts->visited_shells   = fe->visited_shells  + tid * fe->nshells;
+    ts->touched_shells   = fe->touched_shells  + tid * fe->nshells;
+    ts->shell_time       = fe->shell_time_buf  + (size_t) tid * fe->nshells;
+    ts->quartet_lists    = fe->thread_quartet_listss[tid];
+    ts->quartet_lists_sp = fe->thread_quartet_listss_sp[tid];
+    ts->multi_shellpair  = fe->thread_multi_shellpairs[tid];
+    ts->nsq    = 0.0;
+    ts->nitl   = 0.0;
+    ts->sp_nsq = 0.0;
+    ts->sp_err = 0.0;
+    ts->simint_calls = 0.0;
+    ts->simint_pairs = 0.0;
+}
+
+// Slot k of the thread's bra batch, slot 0 is the ordinary thread buffers
+static void init_FockBraSlot(FockEngine_t fe, FockThreadState_s *ts, int k, FockBraSlot_s *bs)
+{
+    int tid = ts->tid;
+    bs->J_MN = NULL;
+    if (fe->bra_batch > 1) 
+        bs->J_MN = fe->bra_J_MN_buf + (size_t) (tid * fe->bra_batch + k) * fe->max_numdmat2 * fe->update_F_buf_size;
+    if (k == 0)
+    {
+        bs->F_N_band_blocks = ts->F_N_band_blocks;
+        bs->visited_shells  = ts->visited_shells;
+        bs->touched_shells  = ts->touched_shells;
+        bs->quartet_lists   = ts->quartet_lists;
+    } else {
+        int slot = tid * (fe->bra_batch - 1) + k - 1;
+        bs->F_N_band_blocks = fe->bra_N_band_blocks  + (size_t) slot * fe->max_numdmat2 * fe->band_size;
+        bs->visited_shells  = fe->bra_visited_shells + (size_t) (tid * fe->bra_batch + k) * fe->nshells;
+        bs->touched_shells  = fe->bra_touched_shells + (size_t) (tid * fe->bra_batch + k) * fe->nshells;
+        bs->quartet_lists   = fe->bra_quartet_listss[slot];
+    }
+    bs->num_touched = 0;
+}
+
+static inline void count_simint_batch(FockThreadState_s *ts, int npairs)
+{
+    if (npairs == 0) return;
+    ts->simint_calls += 1.0;
+    ts->simint_pairs += npairs;
+}
+
+static void flush_FockThreadState(FockEngine_t fe, FockThreadState_s *ts)
+{
+    omp_set_lock(&fe->task_lock);
+    *fe->nitl   += ts->nitl;
+    *fe->nsq    += ts->nsq;
+    *fe->sp_usq += ts->sp_nsq;
+    *fe->sp_err += ts->sp_err;
+    *fe->simint_calls += ts->simint_calls;
+    *fe->simint_pairs += ts->simint_pairs;
+    omp_unset_lock(&fe->task_lock);
+}
+
+// Screen and collect the quartets of bra pair i against the ket pairs of a
+// task, compute and digest every full ket list and the low-precision tier.
+// With defer the partial lists of the main tier are left in bs for a bra 
+// batch. Return 0 if the whole bra pair is screened out.
+static int fock_task_MN_kets(
+    FockEngine_t fe, FockThreadState_s *ts, FockTaskInfo_s *ti, int i, FockBraSlot_s *bs, int defer
+)
+{
+    int tid = ts->tid;
+    int startrow = ti->startrow;
+    int startcol = ti->startcol;
+    int startPQ  = ti->startPQ;
+    
+    double *thread_F_M_band_blocks = ts->F_M_band_blocks;
+    double *thread_F_N_band_blocks = bs->F_N_band_blocks;
+    int    *thread_visited_shells  = bs->visited_shells;
+    int    *thread_touched_shells  = bs->touched_shells;
+    ThreadQuartetLists_t thread_quartet_lists    = bs->quartet_lists;
+    ThreadQuartetLists_t thread_quartet_lists_sp = ts->quartet_lists_sp;
     
     // For mapping the write position of F4, F5, F6 to F3
-    int _iX3M = rowpos[startrow];
-    int _iX3P = colpos[startcol];
+    int _iX3M = fe->rowpos[startrow];
+    int _iX3P = fe->colpos[startcol];
     
-    // startcol is the column start position of shells
-    // This value should remains unchanged when consuming tasks from the same MPI proc
-    F_PQ_offset = mat_block_ptr[startcol * nshells];
+    int M = fe->shellrid[i];
+    int N = fe->shellid[i];
+    double value1 = fe->shellvalue[i];
+
+    double MN_Dmax = MAX(MAX(fe->Dshellmax[M], fe->Dshellmax[N]), ti->PQ_Dmax);
+    if (fe->task_screening && fabs(value1) * ti->PQ_scrmax * MN_Dmax < fe->tolscr2) return 0;
     
-    #pragma omp parallel
+    reset_ThreadQuartetLists(thread_quartet_lists, M, N);
+    if (fe->sp_tol > 0.0) reset_ThreadQuartetLists(thread_quartet_lists_sp, M, N);
+    
+    int num_touched = bs->num_touched;
+    
+    int dimM = fe->shell_bf_num[M];
+    int dimN = fe->shell_bf_num[N];
+    int iX1M = fe->f_startind[M] - fe->f_startind[startrow];
+    int iX3M = fe->rowpos[M]; 
+    int iXN  = fe->rowptr[i];
+    int iMN  = iX1M * fe->ldX1 + iXN;
+    int flag1 = (value1 < 0.0) ? 1 : 0;
+    bs->i   = i;
+    bs->M   = M;
+    bs->N   = N;
+    bs->iMN = iMN;
+    
+    double *thread_MN_buf = fe->update_F_buf + tid * fe->max_numdmat2 * fe->update_F_buf_size;
+    for (int dmat_id = 0; dmat_id < fe->num_dmat; dmat_id++)
+        memset(thread_MN_buf + dmat_id * fe->update_F_buf_size, 0, sizeof(double) * dimM * dimN);
+    
+    // MN_Dmax bounds all six D blocks of a quartet, so once value1 * value2 
+    // * MN_Dmax is below the threshold for the largest value2 of a P group
+    // the rest of the bucket is screened
+    double MN_bound = fabs(value1) * MN_Dmax;
+    int *bucket_ptr = fe->ket_bucket_ptr + ti->colblk * (_SIMINT_AM_PAIRS + 1);
+    for (int am_pair_index = 0; am_pair_index < _SIMINT_AM_PAIRS; am_pair_index++)
+    for (int k = bucket_ptr[am_pair_index]; k < bucket_ptr[am_pair_index + 1]; k++)
     {
-        int tid = omp_get_thread_num();
-        double mynsq  = 0.0;
-        double mynitl = 0.0;
-        double st, et;
+        double value2 = fe->ket_value[k];
+        if (fe->task_screening && MN_bound * fe->ket_group_max[k] < fe->tolscr2) break;
+        if (fe->task_screening && MN_bound * fabs(value2) < fe->tolscr2) continue;
         
-        double *thread_F_M_band_blocks = F_M_band_blocks + tid * nbf * max_dim;
-        double *thread_F_N_band_blocks = F_N_band_blocks + tid * nbf * max_dim;
-        int    *thread_visited_Mpairs  = visited_Mpairs  + tid * nshells;
-        int    *thread_visited_Npairs  = visited_Npairs  + tid * nshells;
+        int j = fe->ket_j[k];
+        int P = fe->ket_P[k];
+        int Q = fe->ket_Q[k];
+        if ((M > P && (M + P) % 2 == 1) || 
+            (M < P && (M + P) % 2 == 0)) continue;                
+        if ((M == P) &&
+            ((N > Q && (N + Q) % 2 == 1) ||
+            (N < Q && (N + Q) % 2 == 0))) continue;
         
-        if (repack_D) pack_D_blocks();
+        int dimP = fe->shell_bf_num[P];
+        int dimQ = fe->shell_bf_num[Q];
+        int iX2P = fe->f_startind[P] - fe->f_startind[startcol];
+        int iX3P = fe->ket_iX3P[k];
+        int iXQ  = fe->ket_iXQ[k];               
+        int iPQ  = iX2P * fe->ldX2 + iXQ;                             
+        int iNQ  = iXN  * fe->ldX3 + iXQ;                
+        int iMP0 = iX3M * fe->ldX3 + iX3P;
+        int iMQ0 = iX3M * fe->ldX3 + iXQ;
+        int iNP0 = iXN  * fe->ldX3 + iX3P;  
+
+        int iMP_F3 = (iX1M * fe->ldX3 + iX2P) + (_iX3M * fe->ldX3 + _iX3P);
+        int iNP_F3 = (iXN  * fe->ldX3 + iX2P) + _iX3P;
+        int iMQ_F3 = (iX1M * fe->ldX3 + iXQ)  + (_iX3M * fe->ldX3);
         
-        // Pending quartets that need to be computed
-        ThreadQuartetLists_t thread_quartet_lists = thread_quartet_listss[tid];
+        int flag3 = (M == P && Q == N) ? 0 : 1;                    
+        int flag2 = (value2 < 0.0) ? 1 : 0;
         
-        // Simint multi_shellpair buffer for batch computation
-        void *thread_multi_shellpair = thread_multi_shellpairs[tid];
+        double D_scrvals[6], Dval;
+        D_scrvals[0] = fabs(fe->D_scrval[block_id(fe, M, N)]);
+        D_scrvals[1] = fabs(fe->D_scrval[block_id(fe, M, P)]);
+        D_scrvals[2] = fabs(fe->D_scrval[block_id(fe, M, Q)]);
+        D_scrvals[3] = fabs(fe->D_scrval[block_id(fe, N, P)]);
+        D_scrvals[4] = fabs(fe->D_scrval[block_id(fe, N, Q)]);
+        D_scrvals[5] = fabs(fe->D_scrval[block_id(fe, P, Q)]);
+        Dval = D_scrvals[0];
+        for (int Dval_i = 1; Dval_i < 6; Dval_i++)
+            if (D_scrvals[Dval_i] > Dval) Dval = D_scrvals[Dval_i];
         
-        #pragma omp for schedule(dynamic) 
-        for (int i = startMN; i < endMN; i++) 
+        double bound = fabs(value1 * value2 * Dval);
+        if (bound >= fe->tolscr2) 
         {
-            int M = shellrid[i];
-            int N = shellid[i];
+            ts->nsq  += 1.0;
+            ts->nitl += dimM * dimN * dimP * dimQ;
             
-            reset_ThreadQuartetLists(thread_quartet_lists, M, N);
+            // Quartets close to the threshold go to the low-precision tier
+            int sp_tier = (bound < fe->sp_tol);
+            ThreadQuartetLists_t tier_lists = thread_quartet_lists;
+            if (sp_tier)
+            {
+                tier_lists = thread_quartet_lists_sp;
+                ts->sp_nsq += 1.0;
+                ts->sp_err += bound * FLT_EPSILON;
+            }
+
+            // Save this shell pair to the target ket shellpair list
+            KetShellPairList_s *target_shellpair_list = &tier_lists->ket_shellpair_lists[am_pair_index];
+            int add_KetShellPair_ret = add_KetShellPair(
+                target_shellpair_list, P, Q, j,
+                dimM, dimN, dimP, dimQ, 
+                flag1, flag2, flag3,
+                iMN, iPQ, iMP_F3, iNP_F3, iMQ_F3, iNQ,
+                iMP0, iMQ0, iNP0
+            );
+            assert(add_KetShellPair_ret == 1);
             
-            memset(thread_F_M_band_blocks, 0, sizeof(double) * nbf * max_dim);
-            memset(thread_F_N_band_blocks, 0, sizeof(double) * nbf * max_dim);
-            memset(thread_visited_Mpairs,  0, sizeof(int)    * nshells);
-            memset(thread_visited_Npairs,  0, sizeof(int)    * nshells);
+            if (fe->eri_cache != NULL && fe->eri_cache->state == ERI_CACHE_SURVEY)
+                survey_ERICache_quartet(fe->eri_cache, tid, dimM * dimN * dimP * dimQ);
             
-            double value1 = shellvalue[i];
-            int dimM = shell_bf_num[M];
-            int dimN = shell_bf_num[N];
-            int iX1M = f_startind[M] - f_startind[startrow];
-            int iX3M = rowpos[M]; 
-            int iXN  = rowptr[i];
-            int iMN  = iX1M * ldX1 + iXN;
-            int flag1 = (value1 < 0.0) ? 1 : 0;
+            // Target ket shellpair list is full, handles it
+            if (target_shellpair_list->num_shellpairs == _SIMINT_NSHELL_SIMD) 
+            {
+                int simint_npairs = process_KetShellPairList(
+                    fe, tid, i, M, N, startPQ, ti->eri_task,
+                    tier_lists, target_shellpair_list, &ts->multi_shellpair,
+                    thread_visited_shells, thread_touched_shells, &num_touched,
+                    thread_F_M_band_blocks, thread_F_N_band_blocks, sp_tier
+                );
+                count_simint_batch(ts, simint_npairs);
+            }
+        }  // if (fabs(value1 * value2) >= tolscr2) 
+    }  // for (int k = bucket_ptr[am_pair_index]; ...)
+    
+    // Process all the remaining shell pairs in the thread's lists
+    for (int sp_tier = 0; sp_tier <= (fe->sp_tol > 0.0); sp_tier++)
+    {
+        ThreadQuartetLists_t tier_lists = sp_tier ? thread_quartet_lists_sp : thread_quartet_lists;
+        for (int am_pair_index = 0; am_pair_index < _SIMINT_AM_PAIRS; am_pair_index++)
+        {
+            KetShellPairList_s *target_shellpair_list = &tier_lists->ket_shellpair_lists[am_pair_index];
             
-            double *thread_MN_buf = update_F_buf + tid * update_F_buf_size;
-            memset(thread_MN_buf, 0, sizeof(double) * dimM * dimN);
+            if (target_shellpair_list->num_shellpairs == 0) continue;
             
-            for (int j = startPQ; j < endPQ; j++)
+            // Left for the bra batch, only the J and K bookkeeping is done here
+            if (defer && !sp_tier)
             {
-                int P = shellrid[j];
-                int Q = shellid[j];
-                if ((M > P && (M + P) % 2 == 1) || 
-                    (M < P && (M + P) % 2 == 0)) continue;                
-                if ((M == P) &&
-                    ((N > Q && (N + Q) % 2 == 1) ||
-                    (N < Q && (N + Q) % 2 == 0))) continue;
-                
-                double value2 = shellvalue[j];
-                int dimP = shell_bf_num[P];
-                int dimQ = shell_bf_num[Q];
-                int iX2P = f_startind[P] - f_startind[startcol];
-                int iX3P = colpos[P];
-                int iXQ  = colptr[j];               
-                int iPQ  = iX2P * ldX2 + iXQ;                             
-                int iNQ  = iXN  * ldX3 + iXQ;                
-                int iMP0 = iX3M * ldX3 + iX3P;
-                int iMQ0 = iX3M * ldX3 + iXQ;
-                int iNP0 = iXN  * ldX3 + iX3P;  
-
-                int iMP_F3 = (iX1M * ldX3 + iX2P) + (_iX3M * ldX3 + _iX3P);
-                int iNP_F3 = (iXN  * ldX3 + iX2P) + _iX3P;
-                int iMQ_F3 = (iX1M * ldX3 + iXQ)  + (_iX3M * ldX3);
-                
-                int flag3 = (M == P && Q == N) ? 0 : 1;                    
-                int flag2 = (value2 < 0.0) ? 1 : 0;
-                
-                double D_scrvals[6], Dval;
-                D_scrvals[0] = fabs(D_scrval[M * nshells + N]);
-                D_scrvals[1] = fabs(D_scrval[M * nshells + P]);
-                D_scrvals[2] = fabs(D_scrval[M * nshells + Q]);
-                D_scrvals[3] = fabs(D_scrval[N * nshells + P]);
-                D_scrvals[4] = fabs(D_scrval[N * nshells + Q]);
-                D_scrvals[5] = fabs(D_scrval[P * nshells + Q]);
-                Dval = D_scrvals[0];
-                for (int Dval_i = 1; Dval_i < 6; Dval_i++)
-                    if (D_scrvals[Dval_i] > Dval) Dval = D_scrvals[Dval_i];
+                mark_JK_with_KetShellPairList(
+                    fe, M, N, target_shellpair_list->num_shellpairs, target_shellpair_list,
+                    fe->D_mat, fe->f_startind, fe->nbf, 
+                    thread_visited_shells, thread_touched_shells, &num_touched
+                );
+                continue;
+            }
+            
+            int simint_npairs = process_KetShellPairList(
+                fe, tid, i, M, N, startPQ, ti->eri_task,
+                tier_lists, target_shellpair_list, &ts->multi_shellpair,
+                thread_visited_shells, thread_touched_shells, &num_touched,
+                thread_F_M_band_blocks, thread_F_N_band_blocks, sp_tier
+            );
+            count_simint_batch(ts, simint_npairs);
+        }
+    }
+    
+    bs->num_touched = num_touched;
+    return 1;
+}
+
+// Add the F_MN block to F1, and the band blocks of the touched shells to
+// F_MNPQ_blocks and reset them. J_MN holds F_MN of each density with 
+// stride update_F_buf_size. The F_M band is flushed if flush_M is set.
+static void flush_FockBraSlot(
+    FockEngine_t fe, FockThreadState_s *ts, FockBraSlot_s *bs, double *J_MN, int flush_M, int atomic_F1
+)
+{
+    int M = bs->M;
+    int N = bs->N;
+    int dimM = fe->shell_bf_num[M];
+    int dimN = fe->shell_bf_num[N];
+    int thread_M_bank_offset = row_block_ptr(fe, M);
+    int thread_N_bank_offset = row_block_ptr(fe, N);
+    for (int dmat_id = 0; dmat_id < fe->num_dmat; dmat_id++)
+    {
+        double *F1_dmat            = fe->F1 + dmat_id * fe->sizeX1;
+        double *F_MNPQ_blocks_dmat = fe->F_MNPQ_blocks + (size_t) dmat_id * fe->blk_nbf2;
+        double *thread_MN_buf_dmat = J_MN + dmat_id * fe->update_F_buf_size;
+        double *thread_F_M_band_blocks_dmat = ts->F_M_band_blocks + (size_t) dmat_id * fe->band_size;
+        double *thread_F_N_band_blocks_dmat = bs->F_N_band_blocks + (size_t) dmat_id * fe->band_size;
+        if (atomic_F1)
+        {
+            for (int iM = 0; iM < dimM; iM++)
+                atomic_add_vector(F1_dmat + bs->iMN + iM * fe->ldX1, thread_MN_buf_dmat + iM * dimN, dimN);
+        } else {
+            direct_add_block(F1_dmat + bs->iMN, fe->ldX1, thread_MN_buf_dmat, dimN, dimM, dimN);
+        }
+        // Flush the touched blocks and reset them for the next (M, N)
+        for (int k = 0; k < bs->num_touched; k++)
+        {
+            int iPQ = bs->touched_shells[k];
+            int dim_iPQ = fe->shell_bf_num[iPQ];
+            
+            if (flush_M)
+            {
+                int MPQ_block_ptr = block_ptr(fe, M, iPQ);
+                double *global_F_M_block_ptr      = F_MNPQ_blocks_dmat + MPQ_block_ptr;
+                double *thread_F_M_band_block_ptr = thread_F_M_band_blocks_dmat + MPQ_block_ptr - thread_M_bank_offset;
+                atomic_add_vector(global_F_M_block_ptr, thread_F_M_band_block_ptr, dimM * dim_iPQ);
+                memset(thread_F_M_band_block_ptr, 0, sizeof(double) * dimM * dim_iPQ);
+            }
+            
+            int NPQ_block_ptr = block_ptr(fe, N, iPQ);
+            double *global_F_N_block_ptr      = F_MNPQ_blocks_dmat + NPQ_block_ptr;
+            double *thread_F_N_band_block_ptr = thread_F_N_band_blocks_dmat + NPQ_block_ptr - thread_N_bank_offset;
+            atomic_add_vector(global_F_N_block_ptr, thread_F_N_band_block_ptr, dimN * dim_iPQ);
+            memset(thread_F_N_band_block_ptr, 0, sizeof(double) * dimN * dim_iPQ);
+        }
+    }
+    for (int k = 0; k < bs->num_touched; k++)
+        bs->visited_shells[bs->touched_shells[k]] = 0;
+    bs->num_touched = 0;
+}
+
+// Compute all quartets of bra pair i against the ket pairs of a task.
+// With atomic_F1 the F_MN block is added atomically, in the persistent
+// team two tasks of the same row block can update it at the same time.
+static void fock_task_MN(FockEngine_t fe, FockThreadState_s *ts, FockTaskInfo_s *ti, int i, int atomic_F1)
+{
+    FockBraSlot_s bs;
+    init_FockBraSlot(fe, ts, 0, &bs);
+    
+    double MN_st = CInt_get_walltime_sec();
+    if (!fock_task_MN_kets(fe, ts, ti, i, &bs, 0)) return;
+    
+    // Update F_MN block to F1 and F_{MP, NP, MQ, NQ} blocks to F_MNPQ_blocks
+    double st = CInt_get_walltime_sec();
+    double *thread_MN_buf = fe->update_F_buf + ts->tid * fe->max_numdmat2 * fe->update_F_buf_size;
+    flush_FockBraSlot(fe, ts, &bs, thread_MN_buf, 1, atomic_F1);
+    double et = CInt_get_walltime_sec();
+    if (ts->tid == 0) CInt_SIMINT_addupdateFtimer(fe->simint, et - st);
+    ts->shell_time[bs.M] += et - MN_st;
+}
+
+// Compute the deferred ket lists of a bra batch. For each ket pair, all bras
+// that kept it go into one Simint call as (PQ|MN_1), (PQ|MN_2), ..., the
+// bras have the same M and AM class so they form a valid ket batch
+static void compute_bra_batch(
+    FockEngine_t fe, FockThreadState_s *ts, FockTaskInfo_s *ti, FockBraSlot_s *bras, int nbras
+)
+{
+    int tid = ts->tid;
+    int M   = bras[0].M;
+    int thread_M_bank_offset = row_block_ptr(fe, M);
+    int M_list[_SIMINT_NSHELL_SIMD], N_list[_SIMINT_NSHELL_SIMD];
+    int lane_bra[_SIMINT_NSHELL_SIMD], lane_pair[_SIMINT_NSHELL_SIMD];
+    double *batch_integrals;
+    int batch_nints;
+    double st, et;
+    
+    for (int am_pair_index = 0; am_pair_index < _SIMINT_AM_PAIRS; am_pair_index++)
+    {
+        for (int k = 0; k < nbras; k++)
+        {
+            KetShellPairList_s *list_k = &bras[k].quartet_lists->ket_shellpair_lists[am_pair_index];
+            for (int ipair = 0; ipair < list_k->num_shellpairs; ipair++)
+            {
+                int j = list_k->PQ_list[ipair];
+                if (j < 0) continue;  // Already computed with an earlier bra
                 
-                if (fabs(value1 * value2 * Dval) >= tolscr2) 
+                // Gather the bras that kept ket pair j, their lists follow
+                // the order of the column block's ket pair list
+                int nlanes = 0;
+                for (int k2 = k; k2 < nbras; k2++)
                 {
-                    mynsq  += 1.0;
-                    mynitl += dimM * dimN * dimP * dimQ;
-
-                    // Save this shell pair to the target ket shellpair list
-                    int am_pair_index = CInt_SIMINT_getShellpairAMIndex(simint, P, Q);
-                    KetShellPairList_s *target_shellpair_list = &thread_quartet_lists->ket_shellpair_lists[am_pair_index];
-                    int add_KetShellPair_ret = add_KetShellPair(
-                        target_shellpair_list, P, Q,
-                        dimM, dimN, dimP, dimQ, 
-                        flag1, flag2, flag3,
-                        iMN, iPQ, iMP_F3, iNP_F3, iMQ_F3, iNQ,
-                        iMP0, iMQ0, iNP0
-                    );
-                    assert(add_KetShellPair_ret == 1);
-                    
-                    // Target ket shellpair list is full, handles it
-                    if (target_shellpair_list->num_shellpairs == _SIMINT_NSHELL_SIMD) 
+                    KetShellPairList_s *list_k2 = &bras[k2].quartet_lists->ket_shellpair_lists[am_pair_index];
+                    for (int ipair2 = (k2 == k) ? ipair : 0; ipair2 < list_k2->num_shellpairs; ipair2++)
                     {
-                        int npairs = target_shellpair_list->num_shellpairs;
-                        double *thread_batch_integrals;
-                        int thread_batch_nints;
-                        
-                        mark_JK_with_KetShellPairList(
-                            M, N, npairs, target_shellpair_list,
-                            D_mat, f_startind, nbf, 
-                            thread_visited_Mpairs, thread_visited_Npairs
-                        );
-                        
-                        CInt_computeShellQuartetBatch_SIMINT(
-                            simint, tid,
-                            thread_quartet_lists->M, 
-                            thread_quartet_lists->N, 
-                            target_shellpair_list->P_list,
-                            target_shellpair_list->Q_list,
-                            npairs, &thread_batch_integrals, &thread_batch_nints,
-                            &thread_multi_shellpair
-                        );
-                        
-                        if (thread_batch_nints > 0)
+                        int j2 = list_k2->PQ_list[ipair2];
+                        if (j2 < 0 || fe->ket_rank[j2] < fe->ket_rank[j]) continue;
+                        if (j2 == j)
                         {
-                            st = CInt_get_walltime_sec();
-                            update_F_with_KetShellPairList(
-                                tid, num_dmat, thread_batch_integrals, thread_batch_nints,
-                                npairs, M, N, target_shellpair_list,
-                                thread_F_M_band_blocks, thread_F_N_band_blocks
-                            );
-                            et = CInt_get_walltime_sec();
-                            if (tid == 0) CInt_SIMINT_addupdateFtimer(simint, et - st);
+                            M_list[nlanes]    = M;
+                            N_list[nlanes]    = bras[k2].N;
+                            lane_bra[nlanes]  = k2;
+                            lane_pair[nlanes] = ipair2;
+                            nlanes++;
                         }
-                        
-                        // Ket shellpair list is processed, reset it
-                        reset_KetShellPairList(target_shellpair_list);
+                        break;
                     }
-                }  // if (fabs(value1 * value2) >= tolscr2) 
-            }  // for (int j = startPQ; j < endPQ; j++)
-            
-            // Process all the remaining shell pairs in the thread's list
-            for (int am_pair_index = 0; am_pair_index < _SIMINT_AM_PAIRS; am_pair_index++)
-            {
-                KetShellPairList_s *target_shellpair_list = &thread_quartet_lists->ket_shellpair_lists[am_pair_index];
+                }
+                
+                int P = list_k->P_list[ipair];
+                int Q = list_k->Q_list[ipair];
+                CInt_computeShellQuartetBatch_SIMINT(
+                    fe->simint, tid, P, Q, M_list, N_list, nlanes, 
+                    &batch_integrals, &batch_nints, &ts->multi_shellpair
+                );
+                count_simint_batch(ts, nlanes);
                 
-                if (target_shellpair_list->num_shellpairs > 0)  // Ket shellpair list is not empty, handles it
+                st = CInt_get_walltime_sec();
+                for (int l = 0; l < nlanes; l++)
                 {
-                    int npairs = target_shellpair_list->num_shellpairs;
-                    double *thread_batch_integrals;
-                    int thread_batch_nints;
+                    FockBraSlot_s *bs = &bras[lane_bra[l]];
+                    KetShellPairList_s *list_l = &bs->quartet_lists->ket_shellpair_lists[am_pair_index];
+                    int *fock_info_list = list_l->fock_quartet_info + lane_pair[l] * 16;
                     
-                    mark_JK_with_KetShellPairList(
-                        M, N, npairs, target_shellpair_list,
-                        D_mat, f_startind, nbf, 
-                        thread_visited_Mpairs, thread_visited_Npairs
-                    );
+                    // Done even if Simint screened the whole batch
+                    list_l->PQ_list[lane_pair[l]] = -1;
+                    if (batch_nints == 0) continue;
                     
-                    CInt_computeShellQuartetBatch_SIMINT(
-                        simint, tid,
-                        thread_quartet_lists->M, 
-                        thread_quartet_lists->N, 
-                        target_shellpair_list->P_list,
-                        target_shellpair_list->Q_list,
-                        npairs, &thread_batch_integrals, &thread_batch_nints,
-                        &thread_multi_shellpair
-                    );
-                    
-                    if (thread_batch_nints > 0)
+                    if (fe->JPQ_acc_mode == JPQ_ACC_TILE)
+                        fe->J_PQ_tile_flags[(size_t) tid * fe->J_PQ_tile_npairs + j - ti->startPQ] = 1;
+                    for (int dmat_id = 0; dmat_id < fe->num_dmat; dmat_id++)
                     {
-                        st = CInt_get_walltime_sec();
-                        update_F_with_KetShellPairList(
-                            tid, num_dmat, thread_batch_integrals, thread_batch_nints, 
-                            npairs, M, N, target_shellpair_list,
-                            thread_F_M_band_blocks, thread_F_N_band_blocks
+                        update_F_bra_swapped(
+                            fe, dmat_id, batch_integrals + l * batch_nints, fock_info_list, 
+                            M, bs->N, P, Q, bs->J_MN + dmat_id * fe->update_F_buf_size,
+                            J_PQ_block(fe, tid, dmat_id, j, P, Q, ti->startPQ),
+                            ts->F_M_band_blocks + (size_t) dmat_id * fe->band_size, thread_M_bank_offset,
+                            bs->F_N_band_blocks + (size_t) dmat_id * fe->band_size, row_block_ptr(fe, bs->N)
                         );
-                        et = CInt_get_walltime_sec();
-                        if (tid == 0) CInt_SIMINT_addupdateFtimer(simint, et - st);
                     }
-                    
-                    // Ket shellpair list is processed, reset it
-                    reset_KetShellPairList(target_shellpair_list);
                 }
+                et = CInt_get_walltime_sec();
+                if (tid == 0) CInt_SIMINT_addupdateFtimer(fe->simint, et - st);
             }
-            
-            // Update F_MN block to F1 and F_{MP, NP, MQ, NQ} blocks to F_MNPQ_blocks
+        }
+        for (int k = 0; k < nbras; k++)
+            reset_KetShellPairList(&bras[k].quartet_lists->ket_shellpair_lists[am_pair_index]);
+    }
+}
+
+// Compute the bra pairs [i0, i1) of a thread's chunk, which have the same M
+// and AM class, as one bra batch
+static void fock_task_MN_batch(
+    FockEngine_t fe, FockThreadState_s *ts, FockTaskInfo_s *ti, int i0, int i1, int atomic_F1
+)
+{
+    FockBraSlot_s bras[_SIMINT_NSHELL_SIMD];
+    int nbras = 0;
+    int tid = ts->tid;
+    double *thread_MN_buf = fe->update_F_buf + tid * fe->max_numdmat2 * fe->update_F_buf_size;
+    
+    double MN_st = CInt_get_walltime_sec();
+    for (int i = i0; i < i1; i++)
+    {
+        FockBraSlot_s *bs = &bras[nbras];
+        init_FockBraSlot(fe, ts, nbras, bs);
+        if (!fock_task_MN_kets(fe, ts, ti, i, bs, 1)) continue;
+        
+        // update_F_buf is reused by the next bra, keep this J_MN
+        int dimMN = fe->shell_bf_num[bs->M] * fe->shell_bf_num[bs->N];
+        for (int dmat_id = 0; dmat_id < fe->num_dmat; dmat_id++)
+        {
+            memcpy(
+                bs->J_MN + dmat_id * fe->update_F_buf_size, 
+                thread_MN_buf + dmat_id * fe->update_F_buf_size, sizeof(double) * dimMN
+            );
+        }
+        nbras++;
+    }
+    if (nbras == 0) return;
+    
+    compute_bra_batch(fe, ts, ti, bras, nbras);
+    
+    // Flush each bra, then the shared F_M band over the union of the 
+    // shells touched by all bras
+    double st = CInt_get_walltime_sec();
+    int M    = bras[0].M;
+    int dimM = fe->shell_bf_num[M];
+    int thread_M_bank_offset = row_block_ptr(fe, M);
+    int *M_visited = fe->bra_visited_shells + (size_t) tid * fe->bra_batch * fe->nshells;
+    int *M_touched = fe->bra_touched_shells + (size_t) tid * fe->bra_batch * fe->nshells;
+    int num_M_touched = 0;
+    for (int k = 0; k < nbras; k++)
+    {
+        for (int t = 0; t < bras[k].num_touched; t++)
+        {
+            int sh = bras[k].touched_shells[t];
+            if (M_visited[sh]) continue;
+            M_visited[sh] = 1;
+            M_touched[num_M_touched++] = sh;
+        }
+        flush_FockBraSlot(fe, ts, &bras[k], bras[k].J_MN, 0, atomic_F1);
+    }
+    for (int dmat_id = 0; dmat_id < fe->num_dmat; dmat_id++)
+    {
+        double *F_MNPQ_blocks_dmat = fe->F_MNPQ_blocks + (size_t) dmat_id * fe->blk_nbf2;
+        double *thread_F_M_band_blocks_dmat = ts->F_M_band_blocks + (size_t) dmat_id * fe->band_size;
+        for (int t = 0; t < num_M_touched; t++)
+        {
+            int iPQ = M_touched[t];
+            int dim_iPQ = fe->shell_bf_num[iPQ];
+            int MPQ_block_ptr = block_ptr(fe, M, iPQ);
+            double *thread_F_M_band_block_ptr = thread_F_M_band_blocks_dmat + MPQ_block_ptr - thread_M_bank_offset;
+            atomic_add_vector(F_MNPQ_blocks_dmat + MPQ_block_ptr, thread_F_M_band_block_ptr, dimM * dim_iPQ);
+            memset(thread_F_M_band_block_ptr, 0, sizeof(double) * dimM * dim_iPQ);
+        }
+    }
+    for (int t = 0; t < num_M_touched; t++)
+        M_visited[M_touched[t]] = 0;
+    double et = CInt_get_walltime_sec();
+    if (tid == 0) CInt_SIMINT_addupdateFtimer(fe->simint, et - st);
+    ts->shell_time[M] += et - MN_st;
+}
+
+// Compute the bra pairs [i0, i1), runs of more than one bra pair with the 
+// same M and AM class are computed as a bra batch
+static void fock_task_MN_chunk(
+    FockEngine_t fe, FockThreadState_s *ts, FockTaskInfo_s *ti, int i0, int i1, int atomic_F1
+)
+{
+    int i = i0;
+    while (i < i1)
+    {
+        int M  = fe->shellrid[i];
+        int am = CInt_SIMINT_getShellpairAMIndex(fe->simint, M, fe->shellid[i]);
+        int run_end = i + 1;
+        while (run_end < i1 && fe->shellrid[run_end] == M &&
+               CInt_SIMINT_getShellpairAMIndex(fe->simint, M, fe->shellid[run_end]) == am)
+            run_end++;
+        
+        if (run_end - i > 1) fock_task_MN_batch(fe, ts, ti, i, run_end, atomic_F1);
+        else fock_task_MN(fe, ts, ti, i, atomic_F1);
+        i = run_end;
+    }
+}
+
+// Set up a new task owner: its footprint and F_PQ offset
+static void set_task_owner(FockEngine_t fe, int nblks_col, int sblk_row, int sblk_col, int startrow, int startcol)
+{
+    int endrow = fe->blkrowptr_sh[sblk_row + fe->nbp_p];
+    int endcol = fe->blkcolptr_sh[sblk_col + nblks_col];
+    set_block_footprint(fe, startrow, endrow, startcol, endcol);
+    if (fe->D_partial) fetch_D_footprint(fe);
+}
+
+// for SCF, J = K
+// Batched ERI version
+void fock_task(
+    PFock_t pfock, int nblks_col, int sblk_row, int sblk_col, 
+    int task, int startrow, int startcol, int repack_D
+)
+{
+    FockEngine_t fe = pfock->fock_engine;
+    FockTaskInfo_s ti;
+    set_FockTaskInfo(fe, &ti, nblks_col, sblk_row, sblk_col, task, startrow, startcol);
+    
+    // A new task owner, pack the blocks of its footprint
+    if (repack_D) set_task_owner(fe, nblks_col, sblk_row, sblk_col, startrow, startcol);
+    
+    // startcol is the column start position of shells
+    // This value should remains unchanged when consuming tasks from the same MPI proc
+    fe->F_PQ_offset = row_block_ptr(fe, startcol);
+    
+    #pragma omp parallel
+    {
+        double st, et;
+        FockThreadState_s ts;
+        init_FockThreadState(fe, &ts, omp_get_thread_num());
+        
+        if (repack_D) pack_D_blocks(fe);
+        
+        // Chunks of bra_batch bra pairs, bra batches are formed in a chunk
+        int chunk = MAX(fe->bra_batch, 1);
+        #pragma omp for schedule(dynamic) 
+        for (int i = ti.startMN; i < ti.endMN; i += chunk) 
+            fock_task_MN_chunk(fe, &ts, &ti, i, MIN(i + chunk, ti.endMN), 0);
+        
+        // Merge thread-private J_PQ tiles, each ket pair is merged by one thread
+        if (fe->JPQ_acc_mode == JPQ_ACC_TILE)
+        {
             st = CInt_get_walltime_sec();
-            direct_add_block(F1 + iMN, ldX1, thread_MN_buf, dimN, dimM, dimN);
-            int thread_M_bank_offset = mat_block_ptr[M * nshells];
-            int thread_N_bank_offset = mat_block_ptr[N * nshells];
-            for (int iPQ = 0; iPQ < nshells; iPQ++)
+            #pragma omp for schedule(dynamic, 16)
+            for (int j = ti.startPQ; j < ti.endPQ; j++)
+                merge_J_PQ_tiles(fe, j, ti.startPQ);
+            et = CInt_get_walltime_sec();
+            if (ts.tid == 0) CInt_SIMINT_addupdateFtimer(fe->simint, et - st);
+        }
+
+        flush_FockThreadState(fe, &ts);
+    } // #pragma omp parallel
+}
+
+// Add one thread's J_PQ tile of a task to F_PQ_blocks and reset it. The
+// other threads may still work on the same task, so the adds are atomic
+static void flush_thread_J_PQ_tile(FockEngine_t fe, int tid, int startPQ, int endPQ)
+{
+    char *flags = fe->J_PQ_tile_flags + (size_t) tid * fe->J_PQ_tile_npairs;
+    for (int j = startPQ; j < endPQ; j++)
+    {
+        if (flags[j - startPQ] == 0) continue;
+        int tile_offset = fe->J_PQ_tile_ptr[j] - fe->J_PQ_tile_ptr[startPQ];
+        int dimPQ       = fe->J_PQ_tile_ptr[j + 1] - fe->J_PQ_tile_ptr[j];
+        int J_PQ_offset = block_ptr(fe, fe->shellrid[j], fe->shellid[j]) - fe->F_PQ_offset;
+        for (int dmat_id = 0; dmat_id < fe->num_dmat; dmat_id++)
+        {
+            double *J_PQ = fe->F_PQ_blocks + (size_t) dmat_id * fe->num_dup_F * fe->F_PQ_block_size + J_PQ_offset;
+            double *tile_block = fe->J_PQ_tiles + (size_t) (tid * fe->max_numdmat2 + dmat_id) * fe->J_PQ_tile_size + tile_offset;
+            atomic_add_vector(J_PQ, tile_block, dimPQ);
+            memset(tile_block, 0, sizeof(double) * dimPQ);
+        }
+        flags[j - startPQ] = 0;
+    }
+}
+
+int fock_task_queue(
+    PFock_t pfock, int qrow, int qcol, int nblks_col, int sblk_row, int sblk_col, 
+    int first_task, int startrow, int startcol, int repack_D
+)
+{
+    FockEngine_t fe = pfock->fock_engine;
+    // The current task and the next bra pair of it, -1 when the queue is empty
+    FockTaskInfo_s cur;
+    int cur_id = 0, next_MN, ntasks_done = 1;
+    set_FockTaskInfo(fe, &cur, nblks_col, sblk_row, sblk_col, first_task, startrow, startcol);
+    next_MN = cur.startMN;
+    
+    if (repack_D) set_task_owner(fe, nblks_col, sblk_row, sblk_col, startrow, startcol);
+    fe->F_PQ_offset = row_block_ptr(fe, startcol);
+    
+    #pragma omp parallel
+    {
+        FockThreadState_s ts;
+        FockTaskInfo_s my_task;
+        int my_id = -1;
+        init_FockThreadState(fe, &ts, omp_get_thread_num());
+        
+        if (repack_D) pack_D_blocks(fe);
+        
+        while (1)
+        {
+            // Take the next bra pairs, refill from the queue if the current
+            // task has none left. Only one thread calls the task queue.
+            int i = -1, i_end = -1, task_id = -1;
+            FockTaskInfo_s ti;
+            omp_set_lock(&fe->task_lock);
+            while (cur_id >= 0 && next_MN >= cur.endMN)
             {
-                int dim_iPQ = shell_bf_num[iPQ];
-                if (thread_visited_Mpairs[iPQ]) 
-                {
-                    int MPQ_block_ptr = mat_block_ptr[M * nshells + iPQ];
-                    double *global_F_MNPQ_block_ptr   = F_MNPQ_blocks + MPQ_block_ptr;
-                    double *thread_F_M_band_block_ptr = thread_F_M_band_blocks + MPQ_block_ptr - thread_M_bank_offset;
-                    atomic_add_vector(global_F_MNPQ_block_ptr, thread_F_M_band_block_ptr, dimM * dim_iPQ);
-                }
-                if (thread_visited_Npairs[iPQ]) 
+                int task = taskq_next(pfock, qrow, qcol);
+                if (task >= pfock->ntasks)
                 {
-                    int NPQ_block_ptr = mat_block_ptr[N * nshells + iPQ];
-                    double *global_F_MNPQ_block_ptr   = F_MNPQ_blocks + NPQ_block_ptr;
-                    double *thread_F_N_band_block_ptr = thread_F_N_band_blocks + NPQ_block_ptr - thread_N_bank_offset;
-                    atomic_add_vector(global_F_MNPQ_block_ptr, thread_F_N_band_block_ptr, dimN * dim_iPQ);
+                    cur_id = -1;
+                } else {
+                    set_FockTaskInfo(fe, &cur, nblks_col, sblk_row, sblk_col, task, startrow, startcol);
+                    next_MN = cur.startMN;
+                    cur_id++;
+                    ntasks_done++;
                 }
             }
-            et = CInt_get_walltime_sec();
-            if (tid == 0) CInt_SIMINT_addupdateFtimer(simint, et - st);
+            if (cur_id >= 0)
+            {
+                i = next_MN;
+                next_MN = MIN(next_MN + MAX(fe->bra_batch, 1), cur.endMN);
+                i_end = next_MN;
+                ti = cur;
+                task_id = cur_id;
+            }
+            omp_unset_lock(&fe->task_lock);
             
-        }  // for (int i = startMN; i < endMN; i++)
-
-        #pragma omp critical
-        {
-            *nitl += mynitl;
-            *nsq  += mynsq;
+            // Moving to another task, the tile of the last one is complete
+            if (fe->JPQ_acc_mode == JPQ_ACC_TILE && my_id >= 0 && task_id != my_id)
+                flush_thread_J_PQ_tile(fe, ts.tid, my_task.startPQ, my_task.endPQ);
+            if (i < 0) break;
+            my_task = ti;
+            my_id = task_id;
+            
+            fock_task_MN_chunk(fe, &ts, &my_task, i, i_end, 1);
         }
+        
+        flush_FockThreadState(fe, &ts);
     } // #pragma omp parallel
+    
+    return ntasks_done;
 }
 
-void reset_F(int numF, int num_dmat, double *F1, double *F2, double *F3, int sizeX1, int sizeX2, int sizeX3)
+void reset_F(PFock_t pfock, int numF, int num_dmat, double *F1, double *F2, double *F3, int sizeX1, int sizeX2, int sizeX3)
 {
+    FockEngine_t fe = pfock->fock_engine;
     #pragma omp parallel
     {
         #pragma omp for nowait
@@ -606,35 +1873,37 @@ void reset_F(int numF, int num_dmat, double *F1, double *F2, double *F3, int siz
         
         
         #pragma omp for nowait
-        for (int i = 0; i < nsp; i++)
+        for (int i = 0; i < fe->blk_max_nshells * fe->blk_max_nshells; i++)
         {
-            F_PQ_blocks_to_F2[i]   = -1;
-            F_MNPQ_blocks_to_F3[i] = -1;
+            fe->F_PQ_blocks_to_F2[i]   = -1;
+            fe->F_MNPQ_blocks_to_F3[i] = -1;
         }
         
         #pragma omp for nowait
-        for (int i = 0; i < nbf2; i++)
+        for (size_t i = 0; i < (size_t) fe->blk_nbf2 * num_dmat; i++)
         {
-            F_MNPQ_blocks[i] = 0.0;
+            fe->F_MNPQ_blocks[i] = 0.0;
         }
         
         #pragma omp for nowait
-        for (int i = 0; i < F_PQ_block_size * num_dup_F; i++)
-            F_PQ_blocks[i]   = 0.0;
+        for (size_t i = 0; i < (size_t) fe->F_PQ_block_size * fe->num_dup_F * num_dmat; i++)
+            fe->F_PQ_blocks[i]   = 0.0;
     }
 }
 
 static inline void add_Fxx_block_to_Fxx(
-    int *Fxx_blocks_to_Fxx, int bid, 
+    FockEngine_t fe, int *Fxx_blocks_to_Fxx, int bid, 
     double *Fxx_blocks, double *Fxx, int ldFxx, int Fxx_block_offset
 )
 {
     if (Fxx_blocks_to_Fxx[bid] == -1) return;
     
-    int dimM = shell_bf_num[bid / nshells];
-    int dimN = shell_bf_num[bid % nshells];
+    int M    = fe->blk_shells[bid / fe->blk_nshells];
+    int N    = fe->blk_shells[bid % fe->blk_nshells];
+    int dimM = fe->shell_bf_num[M];
+    int dimN = fe->shell_bf_num[N];
     double *Fxx_ptr       = Fxx + Fxx_blocks_to_Fxx[bid];
-    double *Fxx_block_ptr = Fxx_blocks + (mat_block_ptr[bid] - Fxx_block_offset);
+    double *Fxx_block_ptr = Fxx_blocks + (block_ptr(fe, M, N) - Fxx_block_offset);
     
     for (int irow = 0; irow < dimM; irow++)
     {
@@ -656,32 +1925,44 @@ static int block_low(int i, int n, int block_size)
     return res;
 }
 
-void reduce_F(double *F1, double *F2, double *F3, int maxrowsize, int maxcolsize, int ldX3, int ldX4, int ldX5, int ldX6)
+void reduce_F(PFock_t pfock, double *F1, double *F2, double *F3, int maxrowsize, int maxcolsize, int ldX3, int ldX4, int ldX5, int ldX6)
 {
+    FockEngine_t fe = pfock->fock_engine;
     int nthreads = omp_get_max_threads();
     #pragma omp parallel 
     {
         int spos, epos;
         int tid = omp_get_thread_num();
-        spos = block_low(tid,     nthreads, F_PQ_block_size);
-        epos = block_low(tid + 1, nthreads, F_PQ_block_size);
+        spos = block_low(tid,     nthreads, fe->F_PQ_block_size);
+        epos = block_low(tid + 1, nthreads, fe->F_PQ_block_size);
         
-        // Reduce all copies of F_PQ_blocks to the first copy
-        for (int p = 1; p < num_dup_F; p++)
+        // Reduce all copies of F_PQ_blocks to the first copy of each density
+        for (int dmat_id = 0; dmat_id < fe->num_dmat; dmat_id++)
         {
-            int offset = p * F_PQ_block_size;
-            PRAGMA_SIMD
-            for (int k = spos; k < epos; k++)
-                F_PQ_blocks[k] += F_PQ_blocks[offset + k];
+            double *F_PQ_blocks_dmat = fe->F_PQ_blocks + (size_t) dmat_id * fe->num_dup_F * fe->F_PQ_block_size;
+            for (int p = 1; p < fe->num_dup_F; p++)
+            {
+                size_t offset = (size_t) p * fe->F_PQ_block_size;
+                PRAGMA_SIMD
+                for (int k = spos; k < epos; k++)
+                    F_PQ_blocks_dmat[k] += F_PQ_blocks_dmat[offset + k];
+            }
         }
         
         #pragma omp barrier
         
-        #pragma omp for schedule(dynamic, 10)
-        for (int i = 0; i < nsp; i++)
+        for (int dmat_id = 0; dmat_id < fe->num_dmat; dmat_id++)
         {
-            add_Fxx_block_to_Fxx(F_PQ_blocks_to_F2,   i, F_PQ_blocks,   F2, maxcolsize, F_PQ_offset);
-            add_Fxx_block_to_Fxx(F_MNPQ_blocks_to_F3, i, F_MNPQ_blocks, F3, ldX3, 0);
+            double *F_PQ_blocks_dmat   = fe->F_PQ_blocks + (size_t) dmat_id * fe->num_dup_F * fe->F_PQ_block_size;
+            double *F_MNPQ_blocks_dmat = fe->F_MNPQ_blocks + (size_t) dmat_id * fe->blk_nbf2;
+            double *F2_dmat = F2 + dmat_id * fe->sizeX2;
+            double *F3_dmat = F3 + dmat_id * fe->sizeX3;
+            #pragma omp for schedule(dynamic, 10)
+            for (int i = 0; i < fe->blk_nshells * fe->blk_nshells; i++)
+            {
+                add_Fxx_block_to_Fxx(fe, fe->F_PQ_blocks_to_F2,   i, F_PQ_blocks_dmat,   F2_dmat, maxcolsize, fe->F_PQ_offset);
+                add_Fxx_block_to_Fxx(fe, fe->F_MNPQ_blocks_to_F3, i, F_MNPQ_blocks_dmat, F3_dmat, ldX3, 0);
+            }
         }
     }
 }
@@ -4,16 +4,54 @@
 #include "pfock.h"
 #include "CInt.h"
 
+// Create the Fock task engine of pfock on the first call, later calls
+// only update it for the next build
 void init_block_buf(BasisSet_t _basis, PFock_t pfock);
 
+// Free the Fock task engine of pfock
+void free_block_buf(PFock_t pfock);
+
+void update_D_screening(PFock_t pfock);
+
+// Set the footprint of the own tasks, *shells points to its shells
+int own_D_footprint(PFock_t pfock, int **shells);
+
+// The two halves of update_D_screening(): pack the D blocks of the own
+// footprint, and compute the task screening bounds from all of D.
+// D_complete == 0 disables screening until D_mat is complete. With the
+// complete D and env D_BLOCKMAX=1, update_D_bounds() also builds the block
+// maxima of this build, and the later packs of this build take D_scrval
+// from them without a rescan.
+void update_D_blocks(PFock_t pfock);
+
+void update_D_bounds(PFock_t pfock, int D_complete);
+
+// Resize the task buffers after blkrowptr_sh/blkcolptr_sh are changed
+void update_task_blocks(PFock_t pfock);
+
+// Add the measured time of each bra shell row to shell_time and reset it
+void collect_shell_time(PFock_t pfock, double *shell_time);
+
+// Switch the F1 buffer that fock_task() adds F_MN blocks to
+void set_F1_buffer(PFock_t pfock, double *_F1);
+
 void fock_task(
-    int nblks_col, int sblk_row, int sblk_col, 
+    PFock_t pfock, int nblks_col, int sblk_row, int sblk_col, 
     int task, int startrow, int startcol, int repack_D
 );
 
-void reset_F(int numF, int num_dmat, double *F1, double *F2, double *F3, int sizeX1, int sizeX2, int sizeX3);
+// Persistent-team version of the task loop: start with first_task and
+// keep taking tasks from the queue of (qrow, qcol) until it is empty. The
+// threads take (M, N) pairs of the current task and move to the next task
+// without a barrier. Return the number of tasks done.
+int fock_task_queue(
+    PFock_t pfock, int qrow, int qcol, int nblks_col, int sblk_row, int sblk_col, 
+    int first_task, int startrow, int startcol, int repack_D
+);
+
+void reset_F(PFock_t pfock, int numF, int num_dmat, double *F1, double *F2, double *F3, int sizeX1, int sizeX2, int sizeX3);
 
-void reduce_F(double *F1, double *F2, double *F3, int maxrowsize, int maxcolsize, int ldX3, int ldX4, int ldX5, int ldX6);
+void reduce_F(PFock_t pfock, double *F1, double *F2, double *F3, int maxrowsize, int maxcolsize, int ldX3, int ldX4, int ldX5, int ldX6);
 
 
 #endif /* #define __FOCK_TASK_H__ */
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <mpi.h>
+
+#include "config.h"
+#include "gtm_nonblock.h"
+
+GTMNonblock_t create_GTMNonblock(GTMatrix_t gtm)
+{
+    // Check the window layout that the displacements below rely on
+    void *win_base;
+    MPI_Aint *win_size;
+    int *win_disp_unit;
+    int flag1, flag2, flag3;
+    MPI_Win_get_attr(gtm->mpi_win, MPI_WIN_BASE, &win_base, &flag1);
+    MPI_Win_get_attr(gtm->mpi_win, MPI_WIN_SIZE, &win_size, &flag2);
+    MPI_Win_get_attr(gtm->mpi_win, MPI_WIN_DISP_UNIT, &win_disp_unit, &flag3);
+    MPI_Aint my_size = (MPI_Aint) sizeof(double) * gtm->r_blklens[gtm->my_rowblk] * gtm->ld_local;
+    int layout_ok = (flag1 && flag2 && flag3);
+    if (layout_ok)
+    {
+        layout_ok = (win_base == (void *) gtm->mat_block) &&
+                    (*win_disp_unit == (int) sizeof(double)) &&
+                    (*win_size >= my_size) &&
+                    (gtm->ld_local >= gtm->c_blklens[gtm->my_colblk]);
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &layout_ok, 1, MPI_INT, MPI_MIN, gtm->mpi_comm);
+    if (!layout_ok) return NULL;
+
+    GTMNonblock_t nb = (GTMNonblock_t) malloc(sizeof(struct GTMNonblock));
+    assert(nb != NULL);
+    nb->gtm = gtm;
+    nb->ld  = (int *) malloc(sizeof(int) * gtm->comm_size);
+    assert(nb->ld != NULL);
+    MPI_Allgather(&gtm->ld_local, 1, MPI_INT, nb->ld, 1, MPI_INT, gtm->mpi_comm);
+    return nb;
+}
+
+void free_GTMNonblock(GTMNonblock_t nb)
+{
+    if (nb == NULL) return;
+    free(nb->ld);
+    free(nb);
+}
+
+// One MPI_Rget or MPI_Raccumulate per owner block touched by the block
+static int start_GTMNonblock_op(
+    GTMNonblock_t nb, int is_acc, int row0, int nrows, int col0, int ncols,
+    double *buf, int ldb, MPI_Request *req
+)
+{
+    GTMatrix_t gtm = nb->gtm;
+    int nreq = 0;
+    for (int bi = 0; bi < gtm->r_blocks; bi++)
+    {
+        int r0 = MAX(row0, gtm->r_displs[bi]);
+        int r1 = MIN(row0 + nrows, gtm->r_displs[bi] + gtm->r_blklens[bi]);
+        if (r0 >= r1) continue;
+        for (int bj = 0; bj < gtm->c_blocks; bj++)
+        {
+            int c0 = MAX(col0, gtm->c_displs[bj]);
+            int c1 = MIN(col0 + ncols, gtm->c_displs[bj] + gtm->c_blklens[bj]);
+            if (c0 >= c1) continue;
+
+            int owner = bi * gtm->c_blocks + bj;
+            int ld    = nb->ld[owner];
+            MPI_Aint disp = (MPI_Aint) (r0 - gtm->r_displs[bi]) * ld + (c0 - gtm->c_displs[bj]);
+            double *ptr   = buf + (size_t) (r0 - row0) * ldb + (c0 - col0);
+            MPI_Datatype origin_type, target_type;
+            MPI_Type_vector(r1 - r0, c1 - c0, ldb, MPI_DOUBLE, &origin_type);
+            MPI_Type_vector(r1 - r0, c1 - c0, ld,  MPI_DOUBLE, &target_type);
+            MPI_Type_commit(&origin_type);
+            MPI_Type_commit(&target_type);
+            if (is_acc)
+            {
+                MPI_Raccumulate(
+                    ptr, 1, origin_type, owner, disp, 1, target_type,
+                    MPI_SUM, gtm->mpi_win, &req[nreq]
+                );
+            } else {
+                MPI_Rget(
+                    ptr, 1, origin_type, owner, disp, 1, target_type,
+                    gtm->mpi_win, &req[nreq]
+                );
+            }
+            MPI_Type_free(&origin_type);
+            MPI_Type_free(&target_type);
+            nreq++;
+        }
+    }
+    return nreq;
+}
+
+int start_GTMNonblock_get(
+    GTMNonblock_t nb, int row0, int nrows, int col0, int ncols,
+    double *buf, int ldb, MPI_Request *req
+)
+{
+    return start_GTMNonblock_op(nb, 0, row0, nrows, col0, ncols, buf, ldb, req);
+}
+
+int start_GTMNonblock_acc(
+    GTMNonblock_t nb, int row0, int nrows, int col0, int ncols,
+    double *buf, int ldb, MPI_Request *req
+)
+{
+    return start_GTMNonblock_op(nb, 1, row0, nrows, col0, ncols, buf, ldb, req);
+}
+
+void flush_GTMNonblock(GTMNonblock_t nb)
+{
+    MPI_Win_flush_all(nb->gtm->mpi_win);
+}
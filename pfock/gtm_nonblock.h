@@ -0,0 +1,46 @@
+#ifndef __GTM_NONBLOCK_H__
+#define __GTM_NONBLOCK_H__
+
+#include <mpi.h>
+#include "GTMatrix.h"
+
+// Nonblocking block operations on a GTMatrix of doubles. GTMatrix only has
+// blocking and batch operations, these start MPI_Rget / MPI_Raccumulate on
+// its window and must be completed by the caller. create_GTMNonblock()
+// checks once that each process's window holds its mat_block at
+// displacement 0 in units of double, and gathers the ld_local of every
+// owner. If the check fails on any process it returns NULL on all of them,
+// the caller then stays on the blocking GTM_ calls. The window must be in
+// the lock_all epoch that GTMatrix keeps open.
+
+struct GTMNonblock
+{
+    GTMatrix_t gtm;
+    int *ld;        // ld_local of each process of gtm->mpi_comm
+};
+
+typedef struct GTMNonblock *GTMNonblock_t;
+
+// Collective over gtm->mpi_comm
+GTMNonblock_t create_GTMNonblock(GTMatrix_t gtm);
+
+void free_GTMNonblock(GTMNonblock_t nb);
+
+// Start getting the global block [row0, row0 + nrows) x [col0, col0 + ncols)
+// into buf with leading dimension ldb. One request is written to req for
+// each owner block the block touches, return the number of requests
+int start_GTMNonblock_get(
+    GTMNonblock_t nb, int row0, int nrows, int col0, int ncols,
+    double *buf, int ldb, MPI_Request *req
+);
+
+// Start adding buf to the global block, the same as start_GTMNonblock_get()
+int start_GTMNonblock_acc(
+    GTMNonblock_t nb, int row0, int nrows, int col0, int ncols,
+    double *buf, int ldb, MPI_Request *req
+);
+
+// Complete all operations started on the window at their targets
+void flush_GTMNonblock(GTMNonblock_t nb);
+
+#endif /* #define __GTM_NONBLOCK_H__ */
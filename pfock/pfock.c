@@ -18,6 +18,8 @@
 #include "taskq.h"
 #include "screening.h"
 #include "one_electron.h"
+#include "eri_cache.h"
+#include "gtm_nonblock.h"
 
 #include "GTMatrix.h"
 #include "utils.h"
@@ -216,7 +218,117 @@ static int nnz_partition (int m, int nnz, int min_nrows,
 }
 
 
-static PFockStatus_t repartition_fock (PFock_t pfock)
+// Same as recursive_bisection, but balances the prefix sums in costptr
+// and keeps at least min_nrows rows in each partition
+static void cost_bisection (double *costptr, int first, int last, int min_nrows,
+                            int npartitions, int *partition_ptr)
+{
+    if (npartitions == 1)
+    {
+        partition_ptr[0] = first;
+        return;
+    }
+
+    int left = npartitions/2;
+    double ideal = costptr[first] +
+        (costptr[last] - costptr[first]) * left / npartitions;
+    int lo = first + left * min_nrows;
+    int hi = last - (npartitions - left) * min_nrows;
+    int i = lo;
+    while (i < hi && costptr[i + 1] <= ideal) i++;
+    if (i < hi && costptr[i + 1] - ideal < ideal - costptr[i]) i++;
+    cost_bisection(costptr, first, i, min_nrows, left, partition_ptr);
+    cost_bisection(costptr, i, last, min_nrows,
+                   npartitions - left, partition_ptr + left);
+}
+
+
+static int cost_partition (int m, int min_nrows, double *costptr,
+                           int npartitions, int *partition_ptr)
+{
+    if (m < min_nrows * npartitions)
+    {
+        return -1;
+    }
+    cost_bisection(costptr, 0, m, min_nrows, npartitions, partition_ptr);
+    partition_ptr[npartitions] = m;
+    return 0;
+}
+
+
+// Split the shells of each process row (col) into nbp_p task blocks
+static void cost_task_partition (double *costptr, int np, int nbp_p,
+                                 int *ptr_sh, int *blkptr_sh)
+{
+    for (int i = 0; i < np; i++)
+    {
+        cost_bisection(costptr, ptr_sh[i], ptr_sh[i + 1], 1,
+                       nbp_p, blkptr_sh + i * nbp_p);
+    }
+    blkptr_sh[np * nbp_p] = ptr_sh[np];
+}
+
+
+// Ratio of the largest to the average cost of the partitions
+static double cost_imbalance (double *costptr, int np, int *ptr_sh)
+{
+    double maxcost = 0.0;
+    for (int i = 0; i < np; i++)
+    {
+        maxcost = MAX(maxcost, costptr[ptr_sh[i + 1]] - costptr[ptr_sh[i]]);
+    }
+    return maxcost / (costptr[ptr_sh[np]] / np);
+}
+
+
+// Re-split the task blocks of each process row and column from the
+// measured time of the shell rows in the last build. Like the cost model,
+// the bra time of a shell also stands for its ket time.
+static void rebalance_task_blocks (PFock_t pfock)
+{
+    int nshells = pfock->nshells;
+    int nbp_p = pfock->nbp_p;
+    int myrank;
+    MPI_Comm_rank (MPI_COMM_WORLD, &myrank);
+
+    memset(pfock->shell_time, 0, sizeof(double) * nshells);
+    collect_shell_time(pfock, pfock->shell_time);
+    MPI_Allreduce(MPI_IN_PLACE, pfock->shell_time, nshells,
+                  MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+
+    double *costptr = (double *)PFOCK_MALLOC(sizeof(double) * (nshells + 1));
+    if (NULL == costptr)
+    {
+        return;
+    }
+    costptr[0] = 0.0;
+    for (int M = 0; M < nshells; M++)
+    {
+        costptr[M + 1] = costptr[M] + pfock->shell_time[M];
+    }
+    if (costptr[nshells] > 0.0)
+    {
+        double old_imb = cost_imbalance(costptr, pfock->nprow * nbp_p,
+                                        pfock->blkrowptr_sh);
+        cost_task_partition (costptr, pfock->nprow, nbp_p,
+                             pfock->rowptr_sh, pfock->blkrowptr_sh);
+        cost_task_partition (costptr, pfock->npcol, nbp_p,
+                             pfock->colptr_sh, pfock->blkcolptr_sh);
+        update_task_blocks(pfock);
+        if (myrank == 0)
+        {
+            printf("  Task blocks rebalanced, measured row imbalance "
+                   "%.3lf -> %.3lf, process rows %.3lf\n", old_imb,
+                   cost_imbalance(costptr, pfock->nprow * nbp_p, pfock->blkrowptr_sh),
+                   cost_imbalance(costptr, pfock->nprow, pfock->rowptr_sh));
+        }
+    }
+    PFOCK_FREE(costptr);
+    pfock->repartition_builds--;
+}
+
+
+static PFockStatus_t repartition_fock (PFock_t pfock, BasisSet_t basis)
 {
     int nshells = pfock->nshells;
     int nnz = pfock->nnz;
@@ -229,19 +341,55 @@ static PFockStatus_t repartition_fock (PFock_t pfock)
     
     MPI_Comm_rank (MPI_COMM_WORLD, &myrank);
 
+    // Balance the predicted cost of the shell rows instead of the number
+    // of shell pairs, set env COST_PARTITION=0 to use the nnz partition
+    char *cost_partition_str = getenv("COST_PARTITION");
+    int use_cost = (cost_partition_str != NULL) ? atoi(cost_partition_str) : 1;
+    double *costptr = NULL;
+    if (use_cost)
+    {
+        costptr = (double *)PFOCK_MALLOC(sizeof(double) * (nshells + 1));
+        if (NULL == costptr ||
+            shell_cost_model(pfock, basis, costptr) != 0 ||
+            costptr[nshells] <= 0.0)
+        {
+            use_cost = 0;
+        }
+    }
+
     // for row partition
     int *newrowptr = (int *)malloc (sizeof(int) * (nprow + 1));
     int *newcolptr = (int *)malloc (sizeof(int) * (npcol + 1));
-    ret = nnz_partition (nshells, nnz, nbp_p, shellptr, nprow, newrowptr);    
+    if (use_cost)
+    {
+        ret = cost_partition (nshells, nbp_p, costptr, nprow, newrowptr);
+    }
+    else
+    {
+        ret = nnz_partition (nshells, nnz, nbp_p, shellptr, nprow, newrowptr);    
+    }
     if (ret != 0)
     {
         PFOCK_PRINTF (1, "nbp_p is too large\n");
+        if (costptr != NULL) PFOCK_FREE(costptr);
+        free (newrowptr);
+        free (newcolptr);
         return PFOCK_STATUS_EXECUTION_FAILED;
     }
-    ret = nnz_partition (nshells, nnz, nbp_p, shellptr, npcol, newcolptr);
+    if (use_cost)
+    {
+        ret = cost_partition (nshells, nbp_p, costptr, npcol, newcolptr);
+    }
+    else
+    {
+        ret = nnz_partition (nshells, nnz, nbp_p, shellptr, npcol, newcolptr);
+    }
     if (ret != 0)
     {
         PFOCK_PRINTF (1, "nbp_p is too large\n");
+        if (costptr != NULL) PFOCK_FREE(costptr);
+        free (newrowptr);
+        free (newcolptr);
         return PFOCK_STATUS_EXECUTION_FAILED;
     }
     memcpy (pfock->rowptr_sh, newrowptr, sizeof(int) * (nprow + 1));    
@@ -313,6 +461,27 @@ static PFockStatus_t repartition_fock (PFock_t pfock)
     }
     pfock->blkcolptr_sh[npcol * nbp_p] = nshells;
 
+    // cost-balanced task blocks
+    if (use_cost)
+    {
+        cost_task_partition (costptr, nprow, nbp_p,
+                             pfock->rowptr_sh, pfock->blkrowptr_sh);
+        cost_task_partition (costptr, npcol, nbp_p,
+                             pfock->colptr_sh, pfock->blkcolptr_sh);
+        if (myrank == 0)
+        {
+            printf("  Cost model partition, predicted imbalance: "
+                   "rows %.3lf, cols %.3lf, row tasks %.3lf\n",
+                   cost_imbalance(costptr, nprow, pfock->rowptr_sh),
+                   cost_imbalance(costptr, npcol, pfock->colptr_sh),
+                   cost_imbalance(costptr, nprow * nbp_p, pfock->blkrowptr_sh));
+        }
+    }
+    if (costptr != NULL)
+    {
+        PFOCK_FREE(costptr);
+    }
+
     // for correct_F
     pfock->FT_block = (double *)PFOCK_MALLOC(sizeof(double) *
         pfock->nfuncs_row * pfock->nfuncs_col);
@@ -351,12 +520,60 @@ static PFockStatus_t create_GA (PFock_t pfock)
         );
     }
 
+    // Density, Fock and exchange matrices of the other densities.
+    // With nosymm, F and K [max_numdmat, max_numdmat2) hold the raw
+    // exchange of the antisymmetric parts of the densities
+    int max_numdmat = pfock->max_numdmat;
+    int max_numdmat2 = pfock->max_numdmat2;
+    pfock->gtm_Dmats = (GTMatrix_t *) PFOCK_MALLOC(sizeof(GTMatrix_t) * max_numdmat);
+    pfock->gtm_Fmats = (GTMatrix_t *) PFOCK_MALLOC(sizeof(GTMatrix_t) * max_numdmat2);
+    pfock->gtm_Kmats = (GTMatrix_t *) PFOCK_MALLOC(sizeof(GTMatrix_t) * max_numdmat2);
+    if (NULL == pfock->gtm_Dmats ||
+        NULL == pfock->gtm_Fmats ||
+        NULL == pfock->gtm_Kmats)
+    {
+        PFOCK_PRINTF(1, "memory allocation failed\n");
+        return PFOCK_STATUS_ALLOC_FAILED;
+    }
+    pfock->gtm_Dmats[0] = pfock->gtm_Dmat;
+    pfock->gtm_Fmats[0] = pfock->gtm_Fmat;
+    pfock->gtm_Kmats[0] = pfock->gtm_Kmat;
+    for (int i = 1; i < max_numdmat2; i++)
+    {
+        GTMatrix_t *dmat_gtms[3] = {&pfock->gtm_Fmats[i], &pfock->gtm_Kmats[i], &pfock->gtm_Dmats[i]};
+        int ngtms = (i < max_numdmat) ? 3 : 2;
+        for (int j = 0; j < ngtms; j++)
+        {
+            GTM_create(
+                dmat_gtms[j], MPI_COMM_WORLD, MPI_DOUBLE, 8,
+                my_rank, pfock->nbf, pfock->nbf, 
+                pfock->nprow, pfock->npcol,
+                pfock->rowptr_f, pfock->colptr_f
+            );
+        }
+    }
+
     return PFOCK_STATUS_SUCCESS;
 }
 
 
 static void destroy_GA(PFock_t pfock)
 { 
+    if (pfock->gtmnb_Dmats != NULL)
+    {
+        for (int i = 0; i < pfock->max_numdmat; i++)
+            free_GTMNonblock(pfock->gtmnb_Dmats[i]);
+        free(pfock->gtmnb_Dmats);
+    }
+    for (int i = 1; i < pfock->max_numdmat2; i++)
+    {
+        if (i < pfock->max_numdmat) GTM_destroy(pfock->gtm_Dmats[i]);
+        GTM_destroy(pfock->gtm_Fmats[i]);
+        GTM_destroy(pfock->gtm_Kmats[i]);
+    }
+    PFOCK_FREE(pfock->gtm_Dmats);
+    PFOCK_FREE(pfock->gtm_Fmats);
+    PFOCK_FREE(pfock->gtm_Kmats);
     GTM_destroy(pfock->gtm_Dmat);
     GTM_destroy(pfock->gtm_Fmat);
     GTM_destroy(pfock->gtm_Kmat);
@@ -365,9 +582,10 @@ static void destroy_GA(PFock_t pfock)
 
 static PFockStatus_t create_FD_GArrays (PFock_t pfock)
 {
-    int sizeD1 = pfock->sizeX1;
-    int sizeD2 = pfock->sizeX2;
-    int sizeD3 = pfock->sizeX3;  
+    // One F1, F2, F3 buffer per density, stored one after another
+    int sizeD1 = pfock->sizeX1 * pfock->max_numdmat2;
+    int sizeD2 = pfock->sizeX2 * pfock->max_numdmat2;
+    int sizeD3 = pfock->sizeX3 * pfock->max_numdmat2;  
     
     // Create each process's F1, F2, F3 buffer matrix
     int *map = (int*) malloc(sizeof(int) * (3 + pfock->nprocs));
@@ -398,6 +616,38 @@ static PFockStatus_t create_FD_GArrays (PFock_t pfock)
     );
     free(map);
     
+    // The F sets are accumulated asynchronously through checked handles,
+    // if GTMatrix's window layout does not match they stay on GTM_accBlock
+    if (pfock->async_acc)
+    {
+        GTMatrix_t gtm_F[3] = {pfock->gtm_F1, pfock->gtm_F2, pfock->gtm_F3};
+        int nb_ok = 1;
+        for (int i = 0; i < 3; i++)
+        {
+            pfock->gtmnb_F[i] = create_GTMNonblock(gtm_F[i]);
+            if (pfock->gtmnb_F[i] == NULL) nb_ok = 0;
+        }
+        if (!nb_ok)
+        {
+            for (int i = 0; i < 3; i++) free_GTMNonblock(pfock->gtmnb_F[i]);
+            for (int i = 0; i < 3; i++) pfock->gtmnb_F[i] = NULL;
+            PFOCK_FREE(pfock->F1_alt);
+            PFOCK_FREE(pfock->F2_alt);
+            PFOCK_FREE(pfock->F3_alt);
+            pfock->F1_alt = pfock->F1;
+            pfock->F2_alt = pfock->F2;
+            pfock->F3_alt = pfock->F3;
+            pfock->mem_cpu -= 1.0 * sizeof(double) * pfock->max_numdmat2 *
+                (((double)pfock->sizeX1 + pfock->sizeX2) * pfock->numF + pfock->sizeX3);
+            pfock->async_acc = 0;
+            if (my_rank == 0)
+            {
+                printf("  Asynchronous F accumulation disabled, "
+                       "GTMatrix window layout not supported\n");
+            }
+        }
+    }
+    
     pfock->getFockMatBufSize = 0;
     pfock->getFockMatBuf = NULL;
 
@@ -506,14 +756,34 @@ static PFockStatus_t create_buffers (PFock_t pfock)
             maxrowfuncs, maxcolfuncs, maxrowsize, maxcolsize);
     }
     
-    // D buf
-    size_t nbf2 = pfock->nbf * pfock->nbf;
-    pfock->D_mat = (double*) PFOCK_MALLOC(sizeof(double) * nbf2);
-    pfock->mem_cpu += 1.0 * sizeof(double) * nbf2;
-    if (pfock->D_mat == NULL) 
+    // D buf, one full copy per density
+    size_t nbf2 = (size_t) pfock->nbf * pfock->nbf;
+    pfock->D_mat = NULL;
+    if (pfock->D_shared)
     {
-        PFOCK_PRINTF(1, "memory allocation failed\n");
-        return PFOCK_STATUS_ALLOC_FAILED;
+        // only the node leader contributes memory to the window
+        MPI_Aint D_bytes = 0;
+        if (pfock->node_rank == 0)
+        {
+            D_bytes = (MPI_Aint) (sizeof(double) * nbf2 * pfock->max_numdmat2);
+            pfock->mem_cpu += 1.0 * sizeof(double) * nbf2 * pfock->max_numdmat2;
+        }
+        double *base;
+        int disp_unit;
+        MPI_Win_allocate_shared(D_bytes, sizeof(double), MPI_INFO_NULL,
+                                pfock->node_comm, &base, &pfock->D_win);
+        MPI_Win_shared_query(pfock->D_win, 0, &D_bytes, &disp_unit, &pfock->D_mat);
+        MPI_Win_lock_all(MPI_MODE_NOCHECK, pfock->D_win);
+    }
+    else if (!pfock->D_partial)
+    {
+        pfock->D_mat = (double*) PFOCK_MALLOC(sizeof(double) * nbf2 * pfock->max_numdmat2);
+        pfock->mem_cpu += 1.0 * sizeof(double) * nbf2 * pfock->max_numdmat2;
+        if (pfock->D_mat == NULL) 
+        {
+            PFOCK_PRINTF(1, "memory allocation failed\n");
+            return PFOCK_STATUS_ALLOC_FAILED;
+        }
     }
     if (myrank == 0) printf("D1, D2, D3 size = %d, Dmat size = %lu\n", sizeX1 + sizeX2 + sizeX3, nbf2);
 
@@ -559,6 +829,26 @@ static PFockStatus_t create_buffers (PFock_t pfock)
         PFOCK_PRINTF (1, "memory allocation failed\n");
         return PFOCK_STATUS_ALLOC_FAILED;
     } 
+    
+    if (pfock->async_acc)
+    {
+        pfock->F1_alt = (double *)PFOCK_MALLOC(sizeof(double) * sizeX1 * numF * pfock->max_numdmat2);
+        pfock->F2_alt = (double *)PFOCK_MALLOC(sizeof(double) * sizeX2 * numF * pfock->max_numdmat2); 
+        pfock->F3_alt = (double *)PFOCK_MALLOC(sizeof(double) * sizeX3 *    1 * pfock->max_numdmat2);
+        pfock->mem_cpu += 1.0 * sizeof(double) *
+            (((double)sizeX1 + sizeX2) * numF + sizeX3) * pfock->max_numdmat2;
+        if (NULL == pfock->F1_alt ||
+            NULL == pfock->F2_alt ||
+            NULL == pfock->F3_alt) 
+        {
+            PFOCK_PRINTF (1, "memory allocation failed\n");
+            return PFOCK_STATUS_ALLOC_FAILED;
+        }
+    } else {
+        pfock->F1_alt = pfock->F1;
+        pfock->F2_alt = pfock->F2;
+        pfock->F3_alt = pfock->F3;
+    }
 
     pfock->ldX1 = maxrowsize;
     pfock->ldX2 = maxcolsize;
@@ -572,6 +862,7 @@ static PFockStatus_t create_buffers (PFock_t pfock)
 
 static void destroy_buffers (PFock_t pfock)
 {
+    for (int i = 0; i < 3; i++) free_GTMNonblock(pfock->gtmnb_F[i]);
     GTM_destroy(pfock->gtm_F1);
     GTM_destroy(pfock->gtm_F2);
     GTM_destroy(pfock->gtm_F3);
@@ -586,12 +877,122 @@ static void destroy_buffers (PFock_t pfock)
     PFOCK_FREE(pfock->rowsize);
     PFOCK_FREE(pfock->colsize);
 
-    PFOCK_FREE(pfock->D_mat);
+    if (pfock->D_shared)
+    {
+        MPI_Win_unlock_all(pfock->D_win);
+        MPI_Win_free(&pfock->D_win);
+        MPI_Comm_free(&pfock->node_comm);
+    }
+    else if (pfock->D_mat != NULL)
+    {
+        PFOCK_FREE(pfock->D_mat);
+    }
+    PFOCK_FREE(pfock->D_fetch_req);
     PFOCK_FREE(pfock->F1);
     PFOCK_FREE(pfock->F2);
     PFOCK_FREE(pfock->F3);
+    if (pfock->async_acc)
+    {
+        PFOCK_FREE(pfock->F1_alt);
+        PFOCK_FREE(pfock->F2_alt);
+        PFOCK_FREE(pfock->F3_alt);
+    }
 }
 
+// Accumulate one F1, F2, F3 set to the buffers of processes dst1, dst2,
+// dst3, a NULL F1 or F2 is skipped. With req != NULL the accumulates are
+// started through the gtmnb_F handles and req[0..2] must be completed by
+// wait_F_acc() before the set is reused. Process p's buffer is row p of
+// gtm_F1, gtm_F2, gtm_F3.
+static void start_F_acc (PFock_t pfock, int dst1, int dst2, int dst3,
+                         double *F1, double *F2, double *F3,
+                         int sizeF1, int sizeF2, int sizeF3, MPI_Request *req)
+{
+    if (req == NULL)
+    {
+        if (F1 != NULL) GTM_accBlock(pfock->gtm_F1, dst1, 1, 0, sizeF1, F1, sizeF1);
+        if (F2 != NULL) GTM_accBlock(pfock->gtm_F2, dst2, 1, 0, sizeF2, F2, sizeF2);
+        GTM_accBlock(pfock->gtm_F3, dst3, 1, 0, sizeF3, F3, sizeF3);
+        return;
+    }
+    req[0] = MPI_REQUEST_NULL;
+    req[1] = MPI_REQUEST_NULL;
+    if (F1 != NULL) start_GTMNonblock_acc(pfock->gtmnb_F[0], dst1, 1, 0, sizeF1, F1, sizeF1, &req[0]);
+    if (F2 != NULL) start_GTMNonblock_acc(pfock->gtmnb_F[1], dst2, 1, 0, sizeF2, F2, sizeF2, &req[1]);
+    start_GTMNonblock_acc(pfock->gtmnb_F[2], dst3, 1, 0, sizeF3, F3, sizeF3, &req[2]);
+}
+
+// Accumulate a held F1 or F2 to the own buffer of gtm
+static void flush_F_hold (GTMatrix_t gtm, int myrank, double **hold, int size)
+{
+    if (*hold == NULL) return;
+    GTM_accBlock(gtm, myrank, 1, 0, size, *hold, size);
+    *hold = NULL;
+}
+
+// Wait until a set started by start_F_acc() can be overwritten
+static void wait_F_acc (MPI_Request *req, int *pending)
+{
+    if (*pending)
+    {
+        MPI_Waitall(3, req, MPI_STATUSES_IGNORE);
+        *pending = 0;
+    }
+}
+
+static PFockStatus_t init_incr_fock(PFock_t pfock)
+{
+    if (pfock->F_prev != NULL) return PFOCK_STATUS_SUCCESS;
+
+    // D_prev, F_prev and K_prev hold all densities. D_prev is only used by
+    // the writer of D_mat, the other ranks of a node-shared D have none
+    size_t nbf2 = (size_t)pfock->nbf * pfock->nbf * pfock->max_numdmat;
+    if (pfock->D_shared && pfock->node_rank != 0) nbf2 = 0;
+
+    // delta D is formed on the full D, leave partial D replication
+    if (pfock->D_partial)
+    {
+        size_t D_size = (size_t)pfock->nbf * pfock->nbf * pfock->max_numdmat2;
+        pfock->D_mat = (double *)PFOCK_MALLOC(sizeof(double) * D_size);
+        if (NULL == pfock->D_mat)
+        {
+            PFOCK_PRINTF(1, "memory allocation failed\n");
+            return PFOCK_STATUS_ALLOC_FAILED;
+        }
+        pfock->mem_cpu += 1.0 * sizeof(double) * D_size;
+        pfock->D_partial = 0;
+    }
+    GTMatrix_t gtm = pfock->gtm_Fmat;
+    size_t blksize = (size_t)gtm->r_blklens[gtm->my_rowblk] *
+                     gtm->c_blklens[gtm->my_colblk] * pfock->max_numdmat;
+    pfock->D_prev = NULL;
+    if (nbf2 > 0) pfock->D_prev = (double *)PFOCK_MALLOC(sizeof(double) * nbf2);
+    pfock->F_prev = (double *)PFOCK_MALLOC(sizeof(double) * blksize);
+    pfock->K_prev = (double *)PFOCK_MALLOC(sizeof(double) * blksize);
+    if ((nbf2 > 0 && NULL == pfock->D_prev) ||
+        NULL == pfock->F_prev ||
+        NULL == pfock->K_prev)
+    {
+        PFOCK_PRINTF(1, "memory allocation failed\n");
+        return PFOCK_STATUS_ALLOC_FAILED;
+    }
+    pfock->mem_cpu += 1.0 * sizeof(double) * (nbf2 + 2.0 * blksize);
+    return PFOCK_STATUS_SUCCESS;
+}
+
+
+static void destroy_incr_fock(PFock_t pfock)
+{
+    if (pfock->F_prev == NULL) return;
+    if (pfock->D_prev != NULL) PFOCK_FREE(pfock->D_prev);
+    PFOCK_FREE(pfock->F_prev);
+    PFOCK_FREE(pfock->K_prev);
+    pfock->D_prev = NULL;
+    pfock->F_prev = NULL;
+    pfock->K_prev = NULL;
+}
+
+
 static void init_mallopt()
 {
     // Disable memory mapped malloc, previously done in MA_init() 
@@ -614,7 +1015,7 @@ PFockStatus_t PFock_create(BasisSet_t basis, int nprow, int npcol, int ntasks,
             sizeof(struct PFock));
         return PFOCK_STATUS_ALLOC_FAILED;
     }
-    memset(pfock, 0, sizeof(PFock_t));
+    memset(pfock, 0, sizeof(struct PFock));
     
     // check if MPI is initialized
     int flag;    
@@ -663,6 +1064,8 @@ PFockStatus_t PFock_create(BasisSet_t basis, int nprow, int npcol, int ntasks,
     } else {
         pfock->max_numdmat = max_numdmat;
         pfock->max_numdmat2 = (pfock->nosymm + 1) * max_numdmat;
+        pfock->num_dmat = 1;
+        pfock->num_dmat2 = pfock->nosymm + 1;
     }
 
     // set tasks
@@ -731,15 +1134,142 @@ PFockStatus_t PFock_create(BasisSet_t basis, int nprow, int npcol, int ntasks,
     }
 
     // repartition
-    if ((ret = repartition_fock(pfock)) != PFOCK_STATUS_SUCCESS) {
+    if ((ret = repartition_fock(pfock, basis)) != PFOCK_STATUS_SUCCESS) {
         return ret;
     }
 
+    // task screening bounds
+    if (init_task_screening(pfock) != 0) {
+        PFOCK_PRINTF(1, "memory allocation failed\n");
+        return PFOCK_STATUS_ALLOC_FAILED;
+    }
+    if (myrank == 0) {
+        printf("  Task screening %s\n",
+               pfock->task_screening ? "enabled" : "disabled");
+    }
+
+    // re-split the task blocks from measured times after the first
+    // REPARTITION_BUILDS builds, 0 keeps them fixed
+    char *repart_str = getenv("REPARTITION_BUILDS");
+    pfock->repartition_builds = (repart_str != NULL) ? atoi(repart_str) : 3;
+    pfock->shell_time = (double *)PFOCK_MALLOC(sizeof(double) * pfock->nshells);
+    pfock->mem_cpu += 1.0 * sizeof(double) * pfock->nshells;
+    if (NULL == pfock->shell_time) {
+        PFOCK_PRINTF(1, "memory allocation failed\n");
+        return PFOCK_STATUS_ALLOC_FAILED;
+    }
+
     // init global arrays
     if ((ret = create_GA(pfock)) != PFOCK_STATUS_SUCCESS) {
         return ret;
     }
 
+    // persistent thread team over the tasks of a queue, the task queue is
+    // then called from any thread of the team
+    char *team_str = getenv("PERSISTENT_TEAM");
+    int mpi_thread_level;
+    MPI_Query_thread(&mpi_thread_level);
+    pfock->persistent_team = (team_str != NULL) ? atoi(team_str) : 0;
+    if (mpi_thread_level < MPI_THREAD_SERIALIZED) pfock->persistent_team = 0;
+    if (myrank == 0) {
+        printf("  Persistent thread team %s\n",
+               pfock->persistent_team ? "enabled" : "disabled");
+    }
+
+    // double-buffered F1, F2, F3 with nonblocking accumulates, 0 accumulates
+    // each victim's buffers before stealing from the next one. Without
+    // work stealing there is no next set to compute into, so it is off
+    char *async_acc_str = getenv("ASYNC_F_ACC");
+    pfock->async_acc = (async_acc_str != NULL) ? atoi(async_acc_str) : 1;
+#ifndef __DYNAMIC__
+    pfock->async_acc = 0;
+#endif
+    if (myrank == 0) {
+        printf("  Asynchronous F accumulation %s\n",
+               pfock->async_acc ? "enabled" : "disabled");
+    }
+
+    // D replication: 0 gets all of D from its owners, 1 uses one
+    // MPI_Allgatherv per block row of the process grid
+    char *D_coll_str = getenv("D_COLLECTIVE");
+    pfock->D_collective = (D_coll_str != NULL) ? atoi(D_coll_str) : 0;
+    if (myrank == 0) {
+        printf("  D replication with %s\n",
+               pfock->D_collective ? "collectives" : "one-sided gets");
+    }
+
+    // fetch only the D blocks of the task footprints instead of all of D,
+    // the non-symmetric split needs D^T and stays on the full copy
+    char *D_partial_str = getenv("D_PARTIAL");
+    pfock->D_partial = (D_partial_str != NULL) ? atoi(D_partial_str) : 0;
+    if (pfock->nosymm) pfock->D_partial = 0;
+    if (myrank == 0) {
+        printf("  Partial D replication %s\n",
+               pfock->D_partial ? "enabled" : "disabled");
+    }
+
+    // one D_mat per node in a shared window instead of one per rank
+    char *D_shared_str = getenv("D_SHARED");
+    pfock->D_shared = (D_shared_str != NULL) ? atoi(D_shared_str) : 1;
+    if (pfock->D_partial) pfock->D_shared = 0;
+    if (pfock->D_shared)
+    {
+        int node_size;
+        MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, myrank,
+                            MPI_INFO_NULL, &pfock->node_comm);
+        MPI_Comm_rank(pfock->node_comm, &pfock->node_rank);
+        MPI_Comm_size(pfock->node_comm, &node_size);
+        if (node_size == 1)
+        {
+            MPI_Comm_free(&pfock->node_comm);
+            pfock->D_shared = 0;
+        }
+    }
+    if (myrank == 0) {
+        printf("  Node-shared D %s\n",
+               pfock->D_shared ? "enabled" : "disabled");
+    }
+
+    // fetch D with nonblocking gets and start the own tasks once the D
+    // rows of their footprint have arrived, 0 loads all of D first
+    char *D_overlap_str = getenv("D_FETCH_OVERLAP");
+    pfock->D_overlap = (D_overlap_str != NULL) ? atoi(D_overlap_str) : 1;
+    int D_overlap_req = pfock->D_overlap;
+    // the node leader writes the shared D_mat, the fetch is not overlapped
+    if (pfock->D_shared) pfock->D_overlap = 0;
+    pfock->D_fetch_req = NULL;
+    pfock->D_fetch_maxreq = 0;
+    pfock->D_fetch_nreq = 0;
+    pfock->D_fetch_nfirst = 0;
+    // the rows are fetched through checked handles, if GTMatrix's window
+    // layout does not match D is loaded with GTM_ calls first
+    int D_layout_ok = 1;
+    if (pfock->D_overlap)
+    {
+        pfock->gtmnb_Dmats = (struct GTMNonblock **)
+            malloc(sizeof(struct GTMNonblock *) * pfock->max_numdmat);
+        assert(pfock->gtmnb_Dmats != NULL);
+        for (int i = 0; i < pfock->max_numdmat; i++)
+        {
+            pfock->gtmnb_Dmats[i] = create_GTMNonblock(pfock->gtm_Dmats[i]);
+            if (pfock->gtmnb_Dmats[i] == NULL) D_layout_ok = 0;
+        }
+        if (!D_layout_ok)
+        {
+            for (int i = 0; i < pfock->max_numdmat; i++)
+                free_GTMNonblock(pfock->gtmnb_Dmats[i]);
+            free(pfock->gtmnb_Dmats);
+            pfock->gtmnb_Dmats = NULL;
+            pfock->D_overlap = 0;
+        }
+    }
+    if (myrank == 0) {
+        printf("  Overlapped D fetch %s%s%s\n",
+               pfock->D_overlap ? "enabled" : "disabled",
+               D_overlap_req && pfock->D_shared ? " (not used with node-shared D)" : "",
+               !D_layout_ok ? " (GTMatrix window layout not supported)" : "");
+    }
+
     // create local buffers
     if ((ret = create_buffers(pfock)) != PFOCK_STATUS_SUCCESS) {
         return ret;
@@ -752,6 +1282,67 @@ PFockStatus_t PFock_create(BasisSet_t basis, int nprow, int npcol, int ntasks,
     //CInt_createERD(basis, &(pfock->erd), pfock->nthreads);
     CInt_createSIMINT(basis, &(pfock->simint), pfock->nthreads);
 
+    // incremental Fock build
+    char *incr_str = getenv("INCR_FOCK");
+    char *rebuild_str = getenv("INCR_FOCK_REBUILD");
+    int incr_fock = (incr_str != NULL) ? atoi(incr_str) : 0;
+    int incr_rebuild = (rebuild_str != NULL) ? atoi(rebuild_str) : 8;
+    if (incr_fock)
+    {
+        ret = PFock_setIncrementalFock(pfock, 1, incr_rebuild);
+        if (ret != PFOCK_STATUS_SUCCESS) return ret;
+        if (myrank == 0)
+        {
+            printf("  Incremental Fock build, full rebuild every %d builds\n",
+                   pfock->incr_rebuild);
+        }
+    }
+
+    // semi-direct ERI cache with a per-rank budget in MB, and an optional
+    // disk tier in ERI_DISK_DIR on node-local scratch
+    char *eri_cache_str = getenv("ERI_CACHE_MB");
+    char *eri_disk_dir  = getenv("ERI_DISK_DIR");
+    char *eri_disk_str  = getenv("ERI_DISK_MB");
+    char *eri_bw_str    = getenv("ERI_DISK_BW_MBS");
+    double eri_cache_MB = (eri_cache_str != NULL) ? atof(eri_cache_str) : 0.0;
+    double eri_disk_MB  = (eri_disk_str  != NULL) ? atof(eri_disk_str)  : 16384.0;
+    double eri_bw_MBs   = (eri_bw_str    != NULL) ? atof(eri_bw_str)    : 500.0;
+    if (eri_bw_MBs <= 0.0) eri_bw_MBs = 500.0;
+    int ntasks_all = pfock->nprow * pfock->npcol * pfock->nbp_p * pfock->nbp_p;
+    pfock->eri_cache = create_ERICache(pfock->nnz, pfock->nthreads,
+                                       pfock->maxnfuncs, ntasks_all, myrank,
+                                       eri_cache_MB, eri_disk_dir,
+                                       eri_disk_MB, eri_bw_MBs);
+    if (pfock->eri_cache != NULL)
+    {
+        pfock->mem_cpu += eri_cache_MB * 1048576.0;
+        if (myrank == 0)
+        {
+            printf("  Semi-direct ERI cache, %.2lf MB per process", eri_cache_MB);
+            if (eri_disk_dir != NULL)
+            {
+                printf(", disk tier in %s (%.2lf MB, %.0lf MB/s)",
+                       eri_disk_dir, eri_disk_MB, eri_bw_MBs);
+            }
+            printf("\n");
+        }
+    }
+
+    // low-precision tier, quartets whose screening bound is within
+    // SP_TIER_DIGITS orders of magnitude of tolscr2 are digested in float
+    char *sp_tier_str = getenv("SP_TIER_DIGITS");
+    double sp_tier_digits = (sp_tier_str != NULL) ? atof(sp_tier_str) : 0.0;
+    pfock->sp_tol = 0.0;
+    if (sp_tier_digits > 0.0)
+    {
+        pfock->sp_tol = pfock->tolscr2 * pow(10.0, sp_tier_digits);
+        if (myrank == 0)
+        {
+            printf("  Single precision digestion for quartets below %.3e\n",
+                   pfock->sp_tol);
+        }
+    }
+
     // statistics
     pfock->mpi_timepass
         = (double *)PFOCK_MALLOC(sizeof(double) * pfock->nprocs);
@@ -779,6 +1370,8 @@ PFockStatus_t PFock_create(BasisSet_t basis, int nprow, int npcol, int ntasks,
         = (double *)PFOCK_MALLOC(sizeof(double) * pfock->nprocs);
     pfock->mpi_timenexttask
         = (double *)PFOCK_MALLOC(sizeof(double) * pfock->nprocs);
+    pfock->mpi_skiptasks
+        = (double *)PFOCK_MALLOC(sizeof(double) * pfock->nprocs);
     if (pfock->mpi_timepass == NULL ||
         pfock->mpi_timereduce == NULL ||
         pfock->mpi_timeinit == NULL ||
@@ -791,7 +1384,8 @@ PFockStatus_t PFock_create(BasisSet_t basis, int nprow, int npcol, int ntasks,
         pfock->mpi_volumega == NULL ||
         pfock->mpi_timegather == NULL ||
         pfock->mpi_timescatter == NULL  ||
-        pfock->mpi_timenexttask == NULL) {
+        pfock->mpi_timenexttask == NULL ||
+        pfock->mpi_skiptasks == NULL) {
         PFOCK_PRINTF(1, "Mmemory allocation for statistic info failed\n");
         return PFOCK_STATUS_ALLOC_FAILED;
     }
@@ -807,6 +1401,7 @@ PFockStatus_t PFock_destroy(PFock_t pfock)
 {
     PFOCK_FREE(pfock->blkrowptr_sh);
     PFOCK_FREE(pfock->blkcolptr_sh);
+    PFOCK_FREE(pfock->shell_time);
     PFOCK_FREE(pfock->rowptr_sh);
     PFOCK_FREE(pfock->colptr_sh);
     PFOCK_FREE(pfock->rowptr_f);
@@ -818,11 +1413,14 @@ PFockStatus_t PFock_destroy(PFock_t pfock)
     PFOCK_FREE(pfock->s_startind);
 
     //CInt_destroyERD(pfock->erd);    
+    free_block_buf(pfock);
     CInt_destroySIMINT(pfock->simint, 1);    
     clean_taskq(pfock);
     clean_screening(pfock);
     destroy_GA(pfock);
     destroy_buffers(pfock);
+    destroy_incr_fock(pfock);
+    free_ERICache(pfock->eri_cache);
 
     PFOCK_FREE(pfock->mpi_timepass);
     PFOCK_FREE(pfock->mpi_timereduce);
@@ -837,6 +1435,7 @@ PFockStatus_t PFock_destroy(PFock_t pfock)
     PFOCK_FREE(pfock->mpi_ngacalls);
     PFOCK_FREE(pfock->mpi_volumega);
     PFOCK_FREE(pfock->mpi_timenexttask);
+    PFOCK_FREE(pfock->mpi_skiptasks);
     
     PFOCK_FREE(pfock);
   
@@ -849,42 +1448,54 @@ void PFock_GTM_getFockMat(
     int colstart, int colend,
     int stride,   double *mat
 )
+{
+    PFock_GTM_getFockMatIdx(pfock, 0, rowstart, rowend, colstart, colend, stride, mat);
+}
+
+void PFock_GTM_getFockMatIdx(
+    PFock_t pfock, int index,
+    int rowstart, int rowend,
+    int colstart, int colend,
+    int stride,   double *mat
+)
 {
     int nrows = rowend - rowstart + 1;
     int ncols = colend - colstart + 1;
+    GTMatrix_t gtm_Fmat = pfock->gtm_Fmats[index];
     
-    GTM_startBatchGet(pfock->gtm_Fmat);
+    GTM_startBatchGet(gtm_Fmat);
     GTM_addGetBlockRequest(
-        pfock->gtm_Fmat,
+        gtm_Fmat,
         rowstart, nrows,
         colstart, ncols,
         mat, stride
     );
-    GTM_execBatchGet(pfock->gtm_Fmat);
-    GTM_stopBatchGet(pfock->gtm_Fmat);
+    GTM_execBatchGet(gtm_Fmat);
+    GTM_stopBatchGet(gtm_Fmat);
     // Not all processes call this function, don't sync here
-    //GTM_sync(pfock->gtm_Fmat);
+    //GTM_sync(gtm_Fmat);
     
     #ifndef __SCF__
+    GTMatrix_t gtm_Kmat = pfock->gtm_Kmats[index];
     if (nrows * ncols > pfock->getFockMatBufSize)
     {
         if (pfock->getFockMatBuf != NULL) PFOCK_FREE(pfock->getFockMatBuf);
-        pfock->getFockMatBufSize = pfock->getFockMatBufSize;
+        pfock->getFockMatBufSize = nrows * ncols;
         pfock->getFockMatBuf     = (double*) PFOCK_MALLOC(nrows * ncols * sizeof(double));
         assert(pfock->getFockMatBuf != NULL);
     }
     double *K = pfock->getFockMatBuf;
-    GTM_startBatchGet(pfock->gtm_Kmat);
+    GTM_startBatchGet(gtm_Kmat);
     GTM_addGetBlockRequest(
-        pfock->gtm_Kmat, 
+        gtm_Kmat, 
         rowstart, nrows,
         colstart, ncols,
         K, ncols
     );
-    GTM_execBatchGet(pfock->gtm_Kmat);
-    GTM_stopBatchGet(pfock->gtm_Kmat);
+    GTM_execBatchGet(gtm_Kmat);
+    GTM_stopBatchGet(gtm_Kmat);
     // Not all processes call this function, don't sync here
-    //GTM_sync(pfock->gtm_Kmat);
+    //GTM_sync(gtm_Kmat);
     for (int i = 0; i < nrows; i++)
         #pragma vector
         for (int j = 0; j < ncols; j++)
@@ -914,6 +1525,11 @@ PFockStatus_t PFock_computeFock(BasisSet_t basis, PFock_t pfock)
     pfock->ngacalls = 0.0;
     pfock->volumega = 0.0;
     pfock->timenexttask = 0.0;
+    pfock->skiptasks = 0.0;
+    pfock->sp_usq = 0.0;
+    pfock->sp_err = 0.0;
+    pfock->simint_calls = 0.0;
+    pfock->simint_pairs = 0.0;
     int my_sshellrow = pfock->sshell_row;
     int my_sshellcol = pfock->sshell_col;
     int myrow = myrank/pfock->npcol;
@@ -921,9 +1537,31 @@ PFockStatus_t PFock_computeFock(BasisSet_t basis, PFock_t pfock)
     int sizeX1 = pfock->sizeX1;
     int sizeX2 = pfock->sizeX2;
     int sizeX3 = pfock->sizeX3;
+    int num_dmat = pfock->num_dmat;
+    int num_dmat2 = pfock->num_dmat2;
+    // F1, F2, F3 of all densities are accumulated as one block
+    int sizeF1 = sizeX1 * num_dmat2;
+    int sizeF2 = sizeX2 * num_dmat2;
+    int sizeF3 = sizeX3 * num_dmat2;
     double *F1 = pfock->F1;
     double *F2 = pfock->F2;
     double *F3 = pfock->F3;
+#ifdef __DYNAMIC__
+    // F1, F2, F3 sets, the accumulate of one set runs while the next
+    // victim's tasks are computed into the other set
+    double *F1_set[2] = {pfock->F1, pfock->F1_alt};
+    double *F2_set[2] = {pfock->F2, pfock->F2_alt};
+    double *F3_set[2] = {pfock->F3, pfock->F3_alt};
+#endif
+    MPI_Request acc_req[2][3];
+    int acc_pending[2] = {0, 0};
+    int async_acc = pfock->async_acc ? 1 : 0;
+    int cur_F = 0;
+    // F1 (F2) of the own tasks and of the victims in my row (column) all go
+    // to my own buffer. It is held and the next such victim adds to it, it
+    // is only accumulated before a victim that needs a new one, or at the end
+    double *F1_hold = NULL;
+    double *F2_hold = NULL;
     int maxrowsize = pfock->maxrowsize;
     int maxcolfuncs = pfock->maxcolfuncs;
     int maxcolsize = pfock->maxcolsize;
@@ -934,56 +1572,137 @@ PFockStatus_t PFock_computeFock(BasisSet_t basis, PFock_t pfock)
     double dzero = 0.0;
     
     init_block_buf(basis, pfock);
+    set_F1_buffer(pfock, F1);
     
     gettimeofday (&tv1, NULL);    
     gettimeofday (&tv3, NULL);
     
-    GTM_fill(pfock->gtm_Fmat, &dzero);
-    GTM_fill(pfock->gtm_Kmat, &dzero);
+    for (int i = 0; i < num_dmat2; i++)
+    {
+        GTM_fill(pfock->gtm_Fmats[i], &dzero);
+        GTM_fill(pfock->gtm_Kmats[i], &dzero);
+    }
     GTM_fill(pfock->gtm_F1, &dzero);
     GTM_fill(pfock->gtm_F2, &dzero);
     GTM_fill(pfock->gtm_F3, &dzero);
     GTM_sync(pfock->gtm_F3);
     
-    // local my D
-    load_full_DenMat(pfock);
+    // local my D, the incremental and non-symmetric updates need all of D.
+    // With partial D replication the footprint is fetched when it is packed
+    int D_pending = pfock->D_overlap && !pfock->D_partial && !pfock->D_shared &&
+                    !pfock->D_collective && !pfock->incr_fock && !pfock->nosymm &&
+                    !pfock->persistent_team;
+    if (D_pending)
+    {
+        int *fp_shells;
+        int nfp = own_D_footprint(pfock, &fp_shells);
+        start_DenMat_fetch(pfock, nfp, fp_shells);
+        wait_DenMat_fetch(pfock, 0);
+    } else if (!pfock->D_partial) {
+        load_full_DenMat(pfock);
+    }
+
+    // incremental build: replace D with delta D
+    if (pfock->incr_fock)
+    {
+        int full_build = (pfock->incr_count == 0 ||
+                          pfock->incr_count >= pfock->incr_rebuild);
+        pfock->incr_active = !full_build;
+        pfock->incr_count = full_build ? 1 : pfock->incr_count + 1;
+        update_incr_DenMat(pfock);
+        if (myrank == 0)
+        {
+            PFOCK_INFO("%s build\n",
+                       pfock->incr_active ? "incremental" : "full");
+        }
+    }
+
+    // non-symmetric D: split into symmetric and antisymmetric parts
+    if (pfock->nosymm)
+    {
+        split_nonsymm_DenMat(pfock);
+    }
+
+    // pack D and compute the task screening bounds, no screening
+    // until the rest of D has arrived
+    if (D_pending)
+    {
+        update_D_blocks(pfock);
+        update_D_bounds(pfock, 0);
+    } else {
+        update_D_screening(pfock);
+    }
 
     gettimeofday(&tv4, NULL);
     pfock->timegather += (tv4.tv_sec - tv3.tv_sec) +
         (tv4.tv_usec - tv3.tv_usec) / 1000.0 / 1000.0;
     pfock->ngacalls += 3;
-    pfock->volumega += (sizeX1 + sizeX2 + sizeX3) * sizeof(double);
+    pfock->volumega += (double) (sizeF1 + sizeF2 + sizeF3) * sizeof(double);
     
     gettimeofday (&tv3, NULL);   
-    reset_F(pfock->numF, pfock->num_dmat2, F1, F2, F3, sizeX1, sizeX2, sizeX3);
+    reset_F(pfock, pfock->numF, num_dmat2, F1, F2, F3, sizeX1, sizeX2, sizeX3);
     gettimeofday (&tv4, NULL);
     pfock->timeinit += (tv4.tv_sec - tv3.tv_sec) +
         (tv4.tv_usec - tv3.tv_usec) / 1000.0 / 1000.0;
     
     /* own part */
+    begin_ERICache_build(pfock->eri_cache);
     reset_taskq(pfock);
     int task;
-    int repack_D = 1;
-    while ((task = taskq_next (pfock, myrow, mycol, 1)) < pfock->ntasks) 
+    int repack_D = 0;
+    while ((task = taskq_next (pfock, myrow, mycol)) < pfock->ntasks) 
     {
         gettimeofday (&tv3, NULL);       
-        fock_task(
-            pfock->nblks_col, pfock->sblk_row, pfock->sblk_col,
-            task, my_sshellrow, my_sshellcol, repack_D
-        );
+        if (pfock->persistent_team)
+        {
+            // the team takes the rest of the queue
+            fock_task_queue(
+                pfock, myrow, mycol, pfock->nblks_col, pfock->sblk_row, pfock->sblk_col,
+                task, my_sshellrow, my_sshellcol, repack_D
+            );
+        } else {
+            fock_task(
+                pfock, pfock->nblks_col, pfock->sblk_row, pfock->sblk_col,
+                task, my_sshellrow, my_sshellcol, repack_D
+            );
+        }
         gettimeofday (&tv4, NULL);
         repack_D = 0;
         pfock->timecomp += (tv4.tv_sec - tv3.tv_sec) +
                     (tv4.tv_usec - tv3.tv_usec) / 1000.0 / 1000.0;
+        
+        // the rest of D has arrived, screen the remaining tasks
+        if (D_pending && test_DenMat_fetch(pfock))
+        {
+            update_D_bounds(pfock, 1);
+            D_pending = 0;
+            gettimeofday (&tv3, NULL);
+            pfock->timegather += (tv3.tv_sec - tv4.tv_sec) +
+                (tv3.tv_usec - tv4.tv_usec) / 1000.0 / 1000.0;
+        }
     } /* own part */
 
+    // stolen tasks need all of D
+    if (D_pending)
+    {
+        gettimeofday (&tv3, NULL);
+        wait_DenMat_fetch(pfock, 1);
+        update_D_bounds(pfock, 1);
+        gettimeofday (&tv4, NULL);
+        pfock->timegather += (tv4.tv_sec - tv3.tv_sec) +
+            (tv4.tv_usec - tv3.tv_usec) / 1000.0 / 1000.0;
+    }
+
     gettimeofday (&tv3, NULL);     
     
-    reduce_F(F1, F2, F3, maxrowsize, maxcolsize, ldX3, ldX4, ldX5, ldX6);
+    reduce_F(pfock, F1, F2, F3, maxrowsize, maxcolsize, ldX3, ldX4, ldX5, ldX6);
     
-    GTM_accBlock(pfock->gtm_F1, myrank, 1, 0, sizeX1, F1, sizeX1);
-    GTM_accBlock(pfock->gtm_F2, myrank, 1, 0, sizeX2, F2, sizeX2);
-    GTM_accBlock(pfock->gtm_F3, myrank, 1, 0, sizeX3, F3, sizeX3);
+    F1_hold = F1;
+    F2_hold = F2;
+    start_F_acc(pfock, myrank, myrank, myrank, NULL, NULL, F3,
+                sizeF1, sizeF2, sizeF3, async_acc ? acc_req[cur_F] : NULL);
+    acc_pending[cur_F] = async_acc;
+    cur_F ^= async_acc;
     
     gettimeofday (&tv4, NULL);
     pfock->timereduce += (tv4.tv_sec - tv3.tv_sec) +
@@ -994,12 +1713,15 @@ PFockStatus_t PFock_computeFock(BasisSet_t basis, PFock_t pfock)
     pfock->stealfrom = 0;
     
 #ifdef __DYNAMIC__
-    int prevrow = myrow;
-    int prevcol = mycol;   
-    /* steal tasks */
-    for (int idx = 0; idx < pfock->nprocs - 1; idx++) 
+    /* steal tasks, nearest tier first and the fullest probed victim */
+    int tier_end[3];
+    for (int t = 0; t < 3; t++)
+    {
+        tier_end[t] = pfock->steal_tier_ptr[t + 1];
+    }
+    int vpid;
+    while ((vpid = taskq_next_victim(pfock, tier_end)) >= 0) 
     {
-        int vpid = (myrank + idx + 1)%pfock->nprocs;
         int vrow = vpid/pfock->npcol;
         int vcol = vpid%pfock->npcol;
         int vsblk_row  = pfock->rowptr_blk[vrow];
@@ -1009,12 +1731,30 @@ PFockStatus_t PFock_computeFock(BasisSet_t basis, PFock_t pfock)
         int vsshellcol = pfock->colptr_sh[vcol];
         int stealed = 0;
         int task;
-        while ((task = taskq_next(pfock, vrow, vcol, 1)) < pfock->ntasks) 
+        while ((task = taskq_next(pfock, vrow, vcol)) < pfock->ntasks) 
         {
+            if (0 == stealed && acc_pending[cur_F])
+            {
+                gettimeofday (&tv3, NULL);
+                wait_F_acc(acc_req[cur_F], &acc_pending[cur_F]);
+                gettimeofday (&tv4, NULL);
+                pfock->timereduce += (tv4.tv_sec - tv3.tv_sec) +
+                    (tv4.tv_usec - tv3.tv_usec) / 1000.0 / 1000.0;
+            }
             gettimeofday (&tv3, NULL);
             if (0 == stealed) 
             {
-                reset_F(pfock->numF, pfock->num_dmat2, F1, F2, F3, sizeX1, sizeX2, sizeX3);
+                // a held F1 (F2) is kept for a victim in my row (column)
+                int keep_F1 = (vrow == myrow && F1_hold != NULL);
+                int keep_F2 = (vcol == mycol && F2_hold != NULL);
+                if (!keep_F1) flush_F_hold(pfock->gtm_F1, myrank, &F1_hold, sizeF1);
+                if (!keep_F2) flush_F_hold(pfock->gtm_F2, myrank, &F2_hold, sizeF2);
+                F1 = keep_F1 ? F1_hold : F1_set[cur_F];
+                F2 = keep_F2 ? F2_hold : F2_set[cur_F];
+                F3 = F3_set[cur_F];
+                set_F1_buffer(pfock, F1);
+                reset_F(pfock, pfock->numF, num_dmat2, F1, F2, F3,
+                        keep_F1 ? 0 : sizeX1, keep_F2 ? 0 : sizeX2, sizeX3);
   
                 pfock->stealfrom++;
             }
@@ -1023,38 +1763,37 @@ PFockStatus_t PFock_computeFock(BasisSet_t basis, PFock_t pfock)
                    (tv4.tv_usec - tv3.tv_usec) / 1000.0 / 1000.0;
 
             gettimeofday (&tv3, NULL);
-            fock_task(
-                vnblks_col, vsblk_row, vsblk_col,
-                task, vsshellrow, vsshellcol, 1 - stealed
-            );
+            if (pfock->persistent_team)
+            {
+                pfock->steals += fock_task_queue(
+                    pfock, vrow, vcol, vnblks_col, vsblk_row, vsblk_col,
+                    task, vsshellrow, vsshellcol, 1 - stealed
+                );
+            } else {
+                fock_task(
+                    pfock, vnblks_col, vsblk_row, vsblk_col,
+                    task, vsshellrow, vsshellcol, 1 - stealed
+                );
+                pfock->steals++;
+            }
             gettimeofday (&tv4, NULL);
             pfock->timecomp += (tv4.tv_sec - tv3.tv_sec) +
                         (tv4.tv_usec - tv3.tv_usec) / 1000.0 / 1000.0;
-            pfock->steals++;
             stealed = 1;
         }
         gettimeofday (&tv3, NULL);
         if (1 == stealed) 
         {
-            reduce_F(F1, F2, F3, maxrowsize, maxcolsize, ldX3, ldX4, ldX5, ldX6);
-
-            if (vrow != myrow) 
-            {
-                GTM_accBlock(pfock->gtm_F1, vpid, 1, 0, sizeX1, F1, sizeX1);
-            } else {
-                GTM_accBlock(pfock->gtm_F1, myrank, 1, 0, sizeX1, F1, sizeX1);
-            }
-            
-            if (vcol != mycol) 
-            {
-                GTM_accBlock(pfock->gtm_F2, vpid, 1, 0, sizeX2, F2, sizeX2);
-            } else {
-                GTM_accBlock(pfock->gtm_F2, myrank, 1, 0, sizeX2, F2, sizeX2);
-            }
-            
-            GTM_accBlock(pfock->gtm_F3, vpid, 1, 0, sizeX3, F3, sizeX3);
-            prevrow = vrow;
-            prevcol = vcol;
+            reduce_F(pfock, F1, F2, F3, maxrowsize, maxcolsize, ldX3, ldX4, ldX5, ldX6);
+
+            // F1 (F2) of a victim in my row (column) is held
+            if (vrow == myrow) F1_hold = F1;
+            if (vcol == mycol) F2_hold = F2;
+            start_F_acc(pfock, vpid, vpid, vpid,
+                        vrow != myrow ? F1 : NULL, vcol != mycol ? F2 : NULL, F3,
+                        sizeF1, sizeF2, sizeF3, async_acc ? acc_req[cur_F] : NULL);
+            acc_pending[cur_F] = async_acc;
+            cur_F ^= async_acc;
         }
         gettimeofday (&tv4, NULL);
         pfock->timereduce += (tv4.tv_sec - tv3.tv_sec) +
@@ -1062,7 +1801,41 @@ PFockStatus_t PFock_computeFock(BasisSet_t basis, PFock_t pfock)
     } /* steal tasks */    
 #endif /* #ifdef __DYNAMIC__ */
 
+    // complete the last accumulates before the barrier in GTM_sync
+    gettimeofday (&tv3, NULL);
+    flush_F_hold(pfock->gtm_F1, myrank, &F1_hold, sizeF1);
+    flush_F_hold(pfock->gtm_F2, myrank, &F2_hold, sizeF2);
+    wait_F_acc(acc_req[0], &acc_pending[0]);
+    wait_F_acc(acc_req[1], &acc_pending[1]);
+    if (async_acc)
+    {
+        for (int i = 0; i < 3; i++) flush_GTMNonblock(pfock->gtmnb_F[i]);
+    }
+    gettimeofday (&tv4, NULL);
+    pfock->timereduce += (tv4.tv_sec - tv3.tv_sec) +
+        (tv4.tv_usec - tv3.tv_usec) / 1000.0 / 1000.0;
+
     GTM_sync(pfock->gtm_F3);
+    end_ERICache_build(pfock->eri_cache, myrank);
+    
+    // measured-cost feedback for the next builds
+    if (pfock->repartition_builds > 0)
+    {
+        rebalance_task_blocks(pfock);
+    }
+    
+    // error accounting of the low-precision tier
+    if (pfock->sp_tol > 0.0)
+    {
+        double sp_stats[3] = {pfock->usq, pfock->sp_usq, pfock->sp_err};
+        double sp_total[3];
+        MPI_Reduce(sp_stats, sp_total, 3, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+        if (myrank == 0)
+        {
+            printf("  Single precision quartets = %.4g (%.2lf%%), error bound = %.3e\n",
+                   sp_total[1], 100.0 * sp_total[1] / MAX(sp_total[0], 1.0), sp_total[2]);
+        }
+    }
     
     gettimeofday (&tv2, NULL);
     pfock->timepass = (tv2.tv_sec - tv1.tv_sec) +
@@ -1078,36 +1851,75 @@ PFockStatus_t PFock_computeFock(BasisSet_t basis, PFock_t pfock)
         PFOCK_INFO ("correct F ...\n");
     }
   
-    if (pfock->nosymm) 
-    {
-        // GTMatrix cannot handle this yet...
-        /*
-        double dhalf = 0.5;
-        for (int i = 0; i < pfock->num_dmat; i++) {
-            GA_Transpose(pfock->ga_F[i + pfock->num_dmat],
-                         pfock->ga_D[0]);
-            GA_Add(&dhalf, pfock->ga_F[i],
-                   &dhalf, pfock->ga_D[0], pfock->ga_F[i]);
-        #ifndef __SCF__
-            GA_Transpose(pfock->ga_K[i + pfock->num_dmat],
-                         pfock->ga_D[0]);
-            GA_Add(&dhalf, pfock->ga_K[i],
-                   &dhalf, pfock->ga_D[0], pfock->ga_K[i]);
-        #endif
-        }
-        */
-    } else {
-        // correct F
-        GTM_symmetrize(pfock->gtm_Fmat);
+    // correct F
+    for (int i = 0; i < num_dmat; i++)
+    {
+        GTM_symmetrize(pfock->gtm_Fmats[i]);
         #ifndef __SCF__
-        GTM_symmetrize(pfock->gtm_Kmat);
+        GTM_symmetrize(pfock->gtm_Kmats[i]);
         #endif
     }
+    if (pfock->nosymm)
+    {
+        // add the antisymmetric part of K
+        correct_nonsymm_FockMat(pfock);
+    }
+
+    // incremental build: add the previous F and save the new one
+    if (pfock->incr_fock)
+    {
+        update_incr_FockMat(pfock);
+    }
     
     return PFOCK_STATUS_SUCCESS;
 }
 
 
+PFockStatus_t PFock_setNumDenMat(PFock_t pfock, int numdmat)
+{
+    if (numdmat <= 0 || numdmat > pfock->max_numdmat)
+    {
+        PFOCK_PRINTF(1, "Invalid number of density matrices\n");
+        return PFOCK_STATUS_INVALID_VALUE;
+    }
+    // Saved D and F of an incremental build do not match any more
+    if (numdmat != pfock->num_dmat) pfock->incr_count = 0;
+    pfock->num_dmat = numdmat;
+    pfock->num_dmat2 = numdmat * (pfock->nosymm + 1);
+
+    return PFOCK_STATUS_SUCCESS;
+}
+
+
+PFockStatus_t PFock_setIncrementalFock(PFock_t pfock, int enable,
+                                       int rebuild_freq)
+{
+    if (rebuild_freq <= 0)
+    {
+        PFOCK_PRINTF(1, "Invalid rebuild frequency\n");
+        return PFOCK_STATUS_INVALID_VALUE;
+    }
+    if (enable)
+    {
+        PFockStatus_t ret = init_incr_fock(pfock);
+        if (ret != PFOCK_STATUS_SUCCESS) return ret;
+    }
+    pfock->incr_fock = (enable ? 1 : 0);
+    pfock->incr_rebuild = rebuild_freq;
+    pfock->incr_count = 0;
+    pfock->incr_active = 0;
+
+    return PFOCK_STATUS_SUCCESS;
+}
+
+
+PFockStatus_t PFock_resetIncrementalFock(PFock_t pfock)
+{
+    pfock->incr_count = 0;
+    return PFOCK_STATUS_SUCCESS;
+}
+
+
 PFockStatus_t PFock_createCoreHMat(PFock_t pfock, BasisSet_t basis)
 {   
     int stride;
@@ -1345,6 +2157,12 @@ PFockStatus_t PFock_getStatistics(PFock_t pfock)
         pfock->mpi_ngacalls, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
     MPI_Gather (&pfock->timenexttask, 1, MPI_DOUBLE, 
         pfock->mpi_timenexttask, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    MPI_Gather (&pfock->skiptasks, 1, MPI_DOUBLE, 
+        pfock->mpi_skiptasks, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    double simint_stats[2] = {pfock->simint_calls, pfock->simint_pairs};
+    double total_simint[2];
+    MPI_Reduce (simint_stats, total_simint, 2, MPI_DOUBLE, 
+        MPI_SUM, 0, MPI_COMM_WORLD);
     if (myrank == 0) {
         double total_timepass;
         double max_timepass;
@@ -1362,6 +2180,7 @@ PFockStatus_t PFock_getStatistics(PFock_t pfock)
         double total_ngacalls;
         double total_volumega;
         double total_timenexttask;
+        double total_skiptasks = 0.0;
         for (int i = 0; i < pfock->nprocs; i++) {
             total_timepass += pfock->mpi_timepass[i];
             max_timepass =
@@ -1383,6 +2202,7 @@ PFockStatus_t PFock_getStatistics(PFock_t pfock)
             total_ngacalls += pfock->mpi_ngacalls[i];
             total_volumega += pfock->mpi_volumega[i];
             total_timenexttask += pfock->mpi_timenexttask[i];
+            total_skiptasks += pfock->mpi_skiptasks[i];
         }
         double tsq = pfock->nshells;
         tsq = ((tsq + 1) * tsq/2.0 + 1) * tsq * (tsq + 1)/4.0;
@@ -1419,6 +2239,12 @@ PFockStatus_t PFock_getStatistics(PFock_t pfock)
                total_stealfrom, total_stealfrom/pfock->nprocs,
                total_ngacalls/pfock->nprocs,
                total_volumega/pfock->nprocs/1024.0/1024.0);
+        printf("      skipped tasks = %.3g (%.3g%%)\n",
+               total_skiptasks,
+               100.0 * total_skiptasks/((double)pfock->nprocs * pfock->ntasks));
+        printf("      Simint batches = %.3g (fill rate = %.3g%%)\n",
+               total_simint[0],
+               100.0 * total_simint[1]/MAX(total_simint[0] * _SIMINT_NSHELL_SIMD, 1.0));
     }
     
     return PFOCK_STATUS_SUCCESS;
@@ -35,6 +35,21 @@ struct PFock {
     double maxvalue;
     double tolscr;
     double tolscr2;
+    double sp_tol;          // quartets bounded below it are digested in float, 0 = off
+
+    // task screening
+    int task_screening;
+    double *shellrowmax;    // max Schwarz value of each shell row
+    double *Dshellmax;      // max |D| block of each shell row
+    double *Dpairmax;       // max Dshellmax of a shell and its partners
+    double *blkrow_scrmax;  // max Schwarz value of each task row block
+    double *blkrow_Dmax;    // max Dpairmax of each task row block
+    double *blkcol_scrmax;  // max Schwarz value of each task col block
+    double *blkcol_Dmax;    // max Dshellmax of each task col block
+
+    // measured-cost task repartitioning
+    int repartition_builds; // builds left that re-split the task blocks
+    double *shell_time;     // measured time of each shell row
 
     // problem parameters
     int nbf;
@@ -109,6 +124,29 @@ struct PFock {
     double *D_mat;
     double *FT_block;
 
+    // replicate D with collectives instead of one-sided gets of all of D
+    int D_collective;
+
+    // node-shared D_mat in an MPI-3 shared window, written only by the
+    // node leader (node_rank 0)
+    int D_shared;
+    MPI_Comm node_comm;
+    int node_rank;
+    MPI_Win D_win;
+
+    // partial D replication: D_mat is not allocated, each process gets
+    // only the D blocks of its own and its victims' task footprints
+    int D_partial;
+
+    // nonblocking D fetch, requests [0, D_fetch_nfirst) get the D rows
+    // of the own tasks' footprint, the others the rest of D
+    int D_overlap;
+    struct GTMNonblock **gtmnb_Dmats;  // nonblocking get handles of gtm_Dmats
+    MPI_Request *D_fetch_req;
+    int D_fetch_maxreq;
+    int D_fetch_nreq;
+    int D_fetch_nfirst;
+
     // buf D and F
     int maxrowfuncs;
     int maxcolfuncs;
@@ -129,11 +167,35 @@ struct PFock {
     double *F1;
     double *F2;
     double *F3;
+    // Second F1, F2, F3 set, with async_acc the accumulate of one set
+    // runs while tasks are computed into the other
+    int async_acc;
+    double *F1_alt;
+    double *F2_alt;
+    double *F3_alt;
+    // nonblocking accumulate handles of gtm_F1, gtm_F2, gtm_F3
+    struct GTMNonblock *gtmnb_F[3];
     int numF;
     int ncpu_f;
+    int persistent_team;   // one thread team per task queue instead of per task
 
     // Task queue
     GTM_Task_Queue_t task_queue;
+    // Steal victims ordered by tier: same node, same process row or
+    // column, others. Tier t is steal_order[steal_tier_ptr[t] ..
+    // steal_tier_ptr[t + 1]), steal_victims is a scratch copy per build
+    int *steal_order;
+    int *steal_victims;
+    int steal_tier_ptr[4];
+    int steal_probes;       // victims probed for remaining tasks per pick
+    int steal_remain;       // remaining tasks of the last picked victim
+    // Chunk of tasks [chunk_next, chunk_end) taken from the queue of
+    // chunk_rank. Own chunks are 1/task_chunk_div of the remaining tasks,
+    // thieves take half of the victim's remaining tasks, 0 = one task
+    int chunk_rank;
+    int chunk_next;
+    int chunk_end;
+    int task_chunk_div;
 
     // GTMatrix
     GTMatrix_t gtm_Hmat;   // Global core Hamilton matrix
@@ -148,9 +210,28 @@ struct PFock {
     GTMatrix_t gtm_F2;     // Each process's buffer for its J_{PQ}
     GTMatrix_t gtm_F3;     // Each process's buffer for its K_{MP, NP, MQ, NQ}
     GTMatrix_t gtm_scrval; // Screening values
+    GTMatrix_t *gtm_Dmats; // All density matrices, gtm_Dmats[0] == gtm_Dmat
+    GTMatrix_t *gtm_Fmats; // All Coulomb/Fock matrices, gtm_Fmats[0] == gtm_Fmat
+    GTMatrix_t *gtm_Kmats; // All exchange matrices, gtm_Kmats[0] == gtm_Kmat
+                           // (max_numdmat2 entries, the last ones are scratch for nosymm)
     
     int getFockMatBufSize;
     double *getFockMatBuf;
+
+    // incremental Fock build
+    int incr_fock;         // build J/K from delta D = D_k - D_{k-1}
+    int incr_rebuild;      // do a full rebuild every incr_rebuild builds
+    int incr_count;        // number of builds since the last full rebuild
+    int incr_active;       // current build is an incremental one
+    double *D_prev;        // density matrix of the previous build
+    double *F_prev;        // local block of the previous gtm_Fmat
+    double *K_prev;        // local block of the previous gtm_Kmat
+
+    // semi-direct ERI cache, NULL if disabled
+    struct ERICache *eri_cache;
+
+    // state of the Fock tasks, created by init_block_buf()
+    struct FockEngine *fock_engine;
     
     // statistics
     double mem_cpu;
@@ -180,6 +261,12 @@ struct PFock {
     double volumega;
     double *mpi_timenexttask;
     double timenexttask;
+    double *mpi_skiptasks;
+    double skiptasks;
+    double sp_usq;          // quartets digested in float
+    double sp_err;          // sum of their bounds times FLT_EPSILON
+    double simint_calls;    // Simint batches computed
+    double simint_pairs;    // ket pairs in them, for the batch fill rate
 };
 
 
@@ -278,6 +365,75 @@ void PFock_GTM_getFockMat(
     int stride,   double *mat
 );
 
+/**
+ * @brief  Get a block from the index-th global Fock (Coulomb, exchange) matrix.
+ *
+ * Same as PFock_GTM_getFockMat(), for the Fock matrix built from
+ * the index-th density matrix gtm_Dmats[index].
+ *
+ * @param[in] pfock     the pointer to the PFock_t compute engine
+ * @param[in] index     the index of the density matrix, 0 <= index < num_dmat
+ * @param[in] rowstart  the starting row index of the section
+ * @param[in] rowend    the ending row index of the section
+ * @param[in] colstart  the starting column index of the section
+ * @param[in] colend    the ending column index of the section
+ * @param[in] stride    the leading dimension of the local data
+ * @param[out] mat      the pointer to the local data
+ */
+void PFock_GTM_getFockMatIdx(
+    PFock_t pfock, int index,
+    int rowstart, int rowend,
+    int colstart, int colend,
+    int stride,   double *mat
+);
+
+/**
+ * @brief  Sets the number of density matrices of the next Fock builds
+ *
+ * Densities are put into pfock->gtm_Dmats[0 .. numdmat-1] and the
+ * results are in pfock->gtm_Fmats[] (and pfock->gtm_Kmats[]). All
+ * densities are contracted with each integral batch, so the integral
+ * cost is shared by all of them.
+ *
+ * @param[in] pfock    the pointer to the PFock_t compute engine
+ * @param[in] numdmat  the number of density matrices, 
+ *                     1 <= numdmat <= max_numdmat
+ *
+ * @return    the function return status
+ */
+PFockStatus_t PFock_setNumDenMat(PFock_t pfock, int numdmat);
+
+/**
+ * @brief  Enables or disables incremental Fock builds
+ *
+ * In incremental mode, J and K are built from the density change
+ * D_k - D_{k-1} (screened with its block maxima) and added to the
+ * previous J and K. A full build is done on the first call and then
+ * every rebuild_freq builds to limit the accumulated error. Incremental
+ * builds can also be set with the environment variables INCR_FOCK
+ * and INCR_FOCK_REBUILD.
+ *
+ * @param[in] pfock         the pointer to the PFock_t compute engine
+ * @param[in] enable        1 to enable incremental builds, 0 to disable
+ * @param[in] rebuild_freq  the number of builds between two full builds
+ *
+ * @return    the function return status
+ */
+PFockStatus_t PFock_setIncrementalFock(PFock_t pfock, int enable,
+                                       int rebuild_freq);
+
+/**
+ * @brief  Forces the next Fock build to be a full build
+ *
+ * Should be called when the density changes discontinuously, e.g.
+ * after a restart or a large DIIS extrapolation.
+ *
+ * @param[in] pfock  the pointer to the PFock_t compute engine
+ *
+ * @return    the function return status
+ */
+PFockStatus_t PFock_resetIncrementalFock(PFock_t pfock);
+
 /**
  * @brief  Computes all J and K matrices
  *
@@ -291,6 +291,18 @@ int schwartz_screening(PFock_t pfock, BasisSet_t basis)
         }
     }
     
+    // max Schwarz value of each shell row, for task screening
+    pfock->shellrowmax = (double *) PFOCK_MALLOC(sizeof(double) * nshells);
+    pfock->mem_cpu += 1.0 * sizeof(double) * nshells;
+    if (pfock->shellrowmax == NULL) return -1;
+    for (int M = 0; M < nshells; M++)
+    {
+        double rowmax = 0.0;
+        for (int i = pfock->shellptr[M]; i < pfock->shellptr[M + 1]; i++)
+            rowmax = MAX(rowmax, fabs(pfock->shellvalue[i]));
+        pfock->shellrowmax[M] = rowmax;
+    }
+    
     PFOCK_FREE(sq_values);
     CInt_destroySIMINT(simint, 0);
     GTM_destroy(pfock->gtm_scrval);
@@ -299,10 +311,181 @@ int schwartz_screening(PFock_t pfock, BasisSet_t basis)
 }
 
 
+int init_task_screening(PFock_t pfock)
+{
+    int nshells = pfock->nshells;
+    int nblks_row = pfock->nprow * pfock->nbp_p;
+    int nblks_col = pfock->npcol * pfock->nbp_p;
+
+    char *task_scr_str = getenv("TASK_SCREENING");
+    pfock->task_screening = (task_scr_str != NULL) ? atoi(task_scr_str) : 1;
+
+    pfock->Dshellmax = (double *) PFOCK_MALLOC(sizeof(double) * nshells);
+    pfock->Dpairmax  = (double *) PFOCK_MALLOC(sizeof(double) * nshells);
+    pfock->blkrow_scrmax = (double *) PFOCK_MALLOC(sizeof(double) * nblks_row);
+    pfock->blkrow_Dmax   = (double *) PFOCK_MALLOC(sizeof(double) * nblks_row);
+    pfock->blkcol_scrmax = (double *) PFOCK_MALLOC(sizeof(double) * nblks_col);
+    pfock->blkcol_Dmax   = (double *) PFOCK_MALLOC(sizeof(double) * nblks_col);
+    pfock->mem_cpu += 2.0 * sizeof(double) * (nshells + nblks_row + nblks_col);
+    if (pfock->Dshellmax == NULL ||
+        pfock->Dpairmax == NULL ||
+        pfock->blkrow_scrmax == NULL ||
+        pfock->blkrow_Dmax == NULL ||
+        pfock->blkcol_scrmax == NULL ||
+        pfock->blkcol_Dmax == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+
+// Bound of a task (row block, col block): every quartet (MN|PQ) of the
+// task has value1 * value2 <= blkrow_scrmax * blkcol_scrmax, and its 6
+// D blocks are in the rows of M, N and P, so they are bounded by
+// MAX(blkrow_Dmax, blkcol_Dmax). Dshellmax must be updated before.
+void update_task_screening(PFock_t pfock)
+{
+    int nshells = pfock->nshells;
+    int nblks_row = pfock->nprow * pfock->nbp_p;
+    int nblks_col = pfock->npcol * pfock->nbp_p;
+    double *Dshellmax = pfock->Dshellmax;
+    double *Dpairmax  = pfock->Dpairmax;
+
+    // D bound of the rows of M and all its partners N
+    for (int M = 0; M < nshells; M++)
+    {
+        double Dmax = Dshellmax[M];
+        for (int i = pfock->shellptr[M]; i < pfock->shellptr[M + 1]; i++)
+            Dmax = MAX(Dmax, Dshellmax[pfock->shellid[i]]);
+        Dpairmax[M] = Dmax;
+    }
+
+    for (int b = 0; b < nblks_row; b++)
+    {
+        double scrmax = 0.0, Dmax = 0.0;
+        for (int M = pfock->blkrowptr_sh[b]; M < pfock->blkrowptr_sh[b + 1]; M++)
+        {
+            scrmax = MAX(scrmax, pfock->shellrowmax[M]);
+            Dmax   = MAX(Dmax, Dpairmax[M]);
+        }
+        pfock->blkrow_scrmax[b] = scrmax;
+        pfock->blkrow_Dmax[b]   = Dmax;
+    }
+
+    for (int b = 0; b < nblks_col; b++)
+    {
+        double scrmax = 0.0, Dmax = 0.0;
+        for (int P = pfock->blkcolptr_sh[b]; P < pfock->blkcolptr_sh[b + 1]; P++)
+        {
+            scrmax = MAX(scrmax, pfock->shellrowmax[P]);
+            Dmax   = MAX(Dmax, Dshellmax[P]);
+        }
+        pfock->blkcol_scrmax[b] = scrmax;
+        pfock->blkcol_Dmax[b]   = Dmax;
+    }
+}
+
+
+int task_screened(PFock_t pfock, int row, int col, int task)
+{
+    if (!pfock->task_screening) return 0;
+
+    int nblks_col = pfock->colptr_blk[col + 1] - pfock->colptr_blk[col];
+    int blkrow = pfock->rowptr_blk[row] + task / nblks_col;
+    int blkcol = pfock->colptr_blk[col] + task % nblks_col;
+    double Dmax = MAX(pfock->blkrow_Dmax[blkrow], pfock->blkcol_Dmax[blkcol]);
+    double bound = pfock->blkrow_scrmax[blkrow] * pfock->blkcol_scrmax[blkcol] * Dmax;
+
+    return (bound < pfock->tolscr2);
+}
+
+
 void clean_screening(PFock_t pfock)
 {
     PFOCK_FREE(pfock->shellid);
     PFOCK_FREE(pfock->shellrid);
     PFOCK_FREE(pfock->shellptr);
     PFOCK_FREE(pfock->shellvalue);
+    PFOCK_FREE(pfock->shellrowmax);
+    PFOCK_FREE(pfock->Dshellmax);
+    PFOCK_FREE(pfock->Dpairmax);
+    PFOCK_FREE(pfock->blkrow_scrmax);
+    PFOCK_FREE(pfock->blkrow_Dmax);
+    PFOCK_FREE(pfock->blkcol_scrmax);
+    PFOCK_FREE(pfock->blkcol_Dmax);
+}
+
+
+static int cmp_desc_double(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x < y) - (x > y);
+}
+
+// Predicted cost of each shell row for partitioning. The work of a shell
+// pair (MN) is dim(M) * dim(N) * nprim(M) * nprim(N), and the cost of a
+// quartet (MN|PQ) is the product of the two pair works. The cost of pair
+// (MN) sums over all (PQ) that survive value(MN) * value(PQ) >= tolscr2,
+// found by a binary search in the pairs sorted by Schwarz value. On exit
+// costptr[M] is the prefix sum of the costs of shell rows 0 .. M - 1.
+int shell_cost_model(PFock_t pfock, BasisSet_t basis, double *costptr)
+{
+    int nshells = pfock->nshells;
+    int nnz = pfock->nnz;
+    int *shellptr = pfock->shellptr;
+    int *shellid = pfock->shellid;
+    int *shellrid = pfock->shellrid;
+
+    double *shell_work = (double *) PFOCK_MALLOC(sizeof(double) * nshells);
+    double *sorted     = (double *) PFOCK_MALLOC(sizeof(double) * 2 * nnz);
+    double *workptr    = (double *) PFOCK_MALLOC(sizeof(double) * (nnz + 1));
+    if (shell_work == NULL || sorted == NULL || workptr == NULL)
+    {
+        PFOCK_FREE(shell_work);
+        PFOCK_FREE(sorted);
+        PFOCK_FREE(workptr);
+        return -1;
+    }
+
+    for (int M = 0; M < nshells; M++)
+        shell_work[M] = (double) CInt_getShellDim(basis, M) * basis->nexp[M];
+
+    // (value, work) pairs sorted by value in descending order
+    for (int j = 0; j < nnz; j++)
+    {
+        sorted[2 * j]     = fabs(pfock->shellvalue[j]);
+        sorted[2 * j + 1] = shell_work[shellrid[j]] * shell_work[shellid[j]];
+    }
+    qsort(sorted, nnz, 2 * sizeof(double), cmp_desc_double);
+    workptr[0] = 0.0;
+    for (int j = 0; j < nnz; j++)
+        workptr[j + 1] = workptr[j] + sorted[2 * j + 1];
+
+    costptr[0] = 0.0;
+    for (int M = 0; M < nshells; M++)
+    {
+        double rowcost = 0.0;
+        for (int j = shellptr[M]; j < shellptr[M + 1]; j++)
+        {
+            double value = fabs(pfock->shellvalue[j]);
+            if (value == 0.0) continue;
+            double eta = pfock->tolscr2 / value;
+            // Number of pairs with value >= eta
+            int lo = 0, hi = nnz;
+            while (lo < hi)
+            {
+                int mid = (lo + hi) / 2;
+                if (sorted[2 * mid] >= eta) lo = mid + 1;
+                else hi = mid;
+            }
+            rowcost += shell_work[shellrid[j]] * shell_work[shellid[j]] * workptr[lo];
+        }
+        costptr[M + 1] = costptr[M] + rowcost;
+    }
+
+    PFOCK_FREE(shell_work);
+    PFOCK_FREE(sorted);
+    PFOCK_FREE(workptr);
+    return 0;
 }
@@ -10,5 +10,13 @@ int schwartz_screening(PFock_t pfock, BasisSet_t basis);
 
 void clean_screening(PFock_t pfock);
 
+int init_task_screening(PFock_t pfock);
+
+void update_task_screening(PFock_t pfock);
+
+int task_screened(PFock_t pfock, int row, int col, int task);
+
+int shell_cost_model(PFock_t pfock, BasisSet_t basis, double *costptr);
+
 
 #endif /* __SCREENING_H__ */
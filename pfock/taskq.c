@@ -1,40 +1,251 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 //#include <ga.h>
 
 #include "config.h"
 #include "taskq.h"
+#include "screening.h"
 
 #include "GTM_Task_Queue.h"
 
+#define STEAL_TIER_NODE   0
+#define STEAL_TIER_ROWCOL 1
+#define STEAL_TIER_OTHER  2
+
+// Sort the steal victims of this rank into tiers. Within a tier the
+// victims start after myrank, as in the old round-robin order, so that
+// thieves spread over the victims.
+static int init_steal_order(PFock_t pfock)
+{
+    int myrank;
+    int nprocs = pfock->nprocs;
+    MPI_Comm_rank(MPI_COMM_WORLD, &myrank);
+    int myrow = myrank / pfock->npcol;
+    int mycol = myrank % pfock->npcol;
+
+    // Node of each rank, identified by the world rank of its first process
+    MPI_Comm node_comm;
+    int node_id = myrank;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, myrank,
+                        MPI_INFO_NULL, &node_comm);
+    MPI_Bcast(&node_id, 1, MPI_INT, 0, node_comm);
+    MPI_Comm_free(&node_comm);
+    int *node_of = (int *)malloc(sizeof(int) * nprocs);
+    pfock->steal_order   = (int *)malloc(sizeof(int) * nprocs);
+    pfock->steal_victims = (int *)malloc(sizeof(int) * nprocs);
+    if (NULL == node_of || NULL == pfock->steal_order ||
+        NULL == pfock->steal_victims)
+    {
+        return -1;
+    }
+    MPI_Allgather(&node_id, 1, MPI_INT, node_of, 1, MPI_INT, MPI_COMM_WORLD);
+
+    int count = 0;
+    for (int tier = STEAL_TIER_NODE; tier <= STEAL_TIER_OTHER; tier++)
+    {
+        pfock->steal_tier_ptr[tier] = count;
+        for (int idx = 0; idx < nprocs - 1; idx++)
+        {
+            int vpid = (myrank + idx + 1) % nprocs;
+            int vrow = vpid / pfock->npcol;
+            int vcol = vpid % pfock->npcol;
+            int vtier = STEAL_TIER_OTHER;
+            if (node_of[vpid] == node_id)
+            {
+                vtier = STEAL_TIER_NODE;
+            }
+            else if (vrow == myrow || vcol == mycol)
+            {
+                vtier = STEAL_TIER_ROWCOL;
+            }
+            if (vtier == tier)
+            {
+                pfock->steal_order[count++] = vpid;
+            }
+        }
+    }
+    pfock->steal_tier_ptr[STEAL_TIER_OTHER + 1] = count;
+    free(node_of);
+
+    char *probes_str = getenv("STEAL_PROBES");
+    pfock->steal_probes = (probes_str != NULL) ? atoi(probes_str) : 2;
+    if (pfock->steal_probes < 1)
+    {
+        pfock->steal_probes = 1;
+    }
+    char *chunk_str = getenv("TASK_CHUNK_DIV");
+    pfock->task_chunk_div = (chunk_str != NULL) ? atoi(chunk_str) : 8;
+    if (pfock->task_chunk_div < 0)
+    {
+        pfock->task_chunk_div = 0;
+    }
+    if (myrank == 0)
+    {
+        printf("  Hierarchical stealing: %d node, %d row/col, %d other victims, "
+               "%d probes\n",
+               pfock->steal_tier_ptr[1] - pfock->steal_tier_ptr[0],
+               pfock->steal_tier_ptr[2] - pfock->steal_tier_ptr[1],
+               pfock->steal_tier_ptr[3] - pfock->steal_tier_ptr[2],
+               pfock->steal_probes);
+        if (pfock->task_chunk_div > 0)
+        {
+            printf("  Task chunks: 1/%d of the remaining own tasks, "
+                   "half of a victim's\n", pfock->task_chunk_div);
+        }
+    }
+    return 0;
+}
+
+
 int init_taskq(PFock_t pfock)
 {
     GTM_createTaskQueue(&pfock->task_queue, MPI_COMM_WORLD);
-    return 0;
+    return init_steal_order(pfock);
 }
 
 
 void clean_taskq(PFock_t pfock)
 {
     GTM_destroyTaskQueue(pfock->task_queue);
+    free(pfock->steal_order);
+    free(pfock->steal_victims);
 }
 
 
 void reset_taskq(PFock_t pfock)
 {
     GTM_resetTaskQueue(pfock->task_queue);
+    pfock->chunk_rank = -1;
+    pfock->chunk_next = 0;
+    pfock->chunk_end  = 0;
+    memcpy(pfock->steal_victims, pfock->steal_order,
+           sizeof(int) * (pfock->nprocs - 1));
+}
+
+
+// Number of tasks to take from the queue of dst_rank in one call
+static int taskq_chunk_size(PFock_t pfock, int dst_rank)
+{
+    if (pfock->task_chunk_div == 0)
+    {
+        return 1;
+    }
+
+    int myrank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &myrank);
+    int own = (dst_rank == myrank);
+    // Estimated remaining tasks, the head seen by the last fetch from
+    // this queue or the probe of a newly picked victim
+    int remain;
+    if (pfock->chunk_rank == dst_rank)
+    {
+        remain = pfock->ntasks - pfock->chunk_end;
+    }
+    else
+    {
+        remain = own ? pfock->ntasks : pfock->steal_remain;
+    }
+    int div = own ? pfock->task_chunk_div : 2;
+    return MAX(1, (remain + div - 1) / div);
 }
 
 
-int taskq_next(PFock_t pfock, int myrow, int mycol, int ntasks)
+int taskq_next(PFock_t pfock, int myrow, int mycol)
 {
     int dst_rank  = myrow * pfock->npcol + mycol;
 
     struct timeval tv1, tv2;
     gettimeofday(&tv1, NULL);
-    int next_task = GTM_getNextTasks(pfock->task_queue, dst_rank, ntasks);
+    int next_task = pfock->ntasks;
+    if (pfock->chunk_rank != dst_rank)
+    {
+        pfock->chunk_next = pfock->chunk_end = 0;
+    }
+    while (1)
+    {
+        // tasks with a screened out bound are consumed but not handed out
+        while (pfock->chunk_next < pfock->chunk_end &&
+               task_screened(pfock, myrow, mycol, pfock->chunk_next))
+        {
+            pfock->skiptasks += 1.0;
+            pfock->chunk_next++;
+        }
+        if (pfock->chunk_next < pfock->chunk_end)
+        {
+            next_task = pfock->chunk_next++;
+            break;
+        }
+
+        // Take a new chunk, the queue is empty if its head is at the end
+        int nchunk = taskq_chunk_size(pfock, dst_rank);
+        int head = GTM_getNextTasks(pfock->task_queue, dst_rank, nchunk);
+        pfock->chunk_rank = dst_rank;
+        pfock->chunk_next = MIN(head, pfock->ntasks);
+        pfock->chunk_end  = MIN(head + nchunk, pfock->ntasks);
+        if (head >= pfock->ntasks)
+        {
+            break;
+        }
+    }
     gettimeofday(&tv2, NULL);
     pfock->timenexttask += (tv2.tv_sec - tv1.tv_sec) + (tv2.tv_usec - tv1.tv_usec) / 1000000.0;
 
     return next_task;
 }
+
+
+int taskq_remaining(PFock_t pfock, int vpid)
+{
+    // Fetching 0 tasks reads the queue head without taking anything
+    int head = GTM_getNextTasks(pfock->task_queue, vpid, 0);
+    return (head < pfock->ntasks) ? pfock->ntasks - head : 0;
+}
+
+
+int taskq_next_victim(PFock_t pfock, int *tier_end)
+{
+    int *victims = pfock->steal_victims;
+
+    struct timeval tv1, tv2;
+    gettimeofday(&tv1, NULL);
+    int vpid = -1;
+    for (int tier = STEAL_TIER_NODE; tier <= STEAL_TIER_OTHER && vpid < 0; tier++)
+    {
+        int start = pfock->steal_tier_ptr[tier];
+        while (tier_end[tier] > start && vpid < 0)
+        {
+            // Probe a few victims of this tier and take the one with
+            // the most remaining tasks, drop the empty ones
+            int best = -1;
+            int best_remain = 0;
+            int nprobes = MIN(pfock->steal_probes, tier_end[tier] - start);
+            for (int k = 0; k < nprobes; k++)
+            {
+                int pos = start + k;
+                int remain = taskq_remaining(pfock, victims[pos]);
+                if (remain == 0)
+                {
+                    victims[pos] = victims[--tier_end[tier]];
+                    nprobes = MIN(nprobes, tier_end[tier] - start);
+                    k--;
+                }
+                else if (remain > best_remain)
+                {
+                    best = pos;
+                    best_remain = remain;
+                }
+            }
+            if (best >= 0)
+            {
+                vpid = victims[best];
+                pfock->steal_remain = best_remain;
+                victims[best] = victims[--tier_end[tier]];
+            }
+        }
+    }
+    gettimeofday(&tv2, NULL);
+    pfock->timenexttask += (tv2.tv_sec - tv1.tv_sec) + (tv2.tv_usec - tv1.tv_usec) / 1000000.0;
+
+    return vpid;
+}
@@ -11,7 +11,16 @@ void clean_taskq(PFock_t pfock);
 
 void reset_taskq(PFock_t pfock);
 
-int taskq_next(PFock_t pfock, int myrow, int mycol, int ntasks);
+// Next task of the queue of (myrow, mycol), taken in chunks, 
+// pfock->ntasks if the queue is empty
+int taskq_next(PFock_t pfock, int myrow, int mycol);
+
+// Number of tasks left in the queue of rank vpid
+int taskq_remaining(PFock_t pfock, int vpid);
+
+// Pick and remove the next steal victim, -1 if there is none left.
+// tier_end holds the current end of each tier in steal_victims.
+int taskq_next_victim(PFock_t pfock, int *tier_end);
 
 
 #endif /* __GATASK_H__ */
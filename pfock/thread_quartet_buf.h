@@ -13,8 +13,9 @@ typedef struct
     
     // (P_list[i], Q_list[i]) are the shellpair ids for ket side
     // AM(P_list[]) are the same, AM(Q_list[]) are the same
+    // PQ_list[i] is the index of (P_list[i], Q_list[i]) in shellid/shellrid
     // fock_quartet_info are for calling update_F
-    int *P_list, *Q_list, *fock_quartet_info;
+    int *P_list, *Q_list, *PQ_list, *fock_quartet_info;
     
     int *ptr;
 } KetShellPairList_s;
@@ -43,12 +44,13 @@ void init_KetShellPairList(KetShellPairList_s *ket_shellpair_list)
     
     ket_shellpair_list->num_shellpairs = 0;
     
-    ket_shellpair_list->ptr = (int*) malloc(sizeof(int) * _SIMINT_NSHELL_SIMD * (2 + 16));
+    ket_shellpair_list->ptr = (int*) malloc(sizeof(int) * _SIMINT_NSHELL_SIMD * (3 + 16));
     assert(ket_shellpair_list->ptr != NULL);
     
     ket_shellpair_list->P_list = ket_shellpair_list->ptr;
     ket_shellpair_list->Q_list = ket_shellpair_list->ptr + _SIMINT_NSHELL_SIMD;
-    ket_shellpair_list->fock_quartet_info = ket_shellpair_list->ptr + _SIMINT_NSHELL_SIMD * 2;
+    ket_shellpair_list->PQ_list = ket_shellpair_list->ptr + _SIMINT_NSHELL_SIMD * 2;
+    ket_shellpair_list->fock_quartet_info = ket_shellpair_list->ptr + _SIMINT_NSHELL_SIMD * 3;
 }
 
 void init_KetShellPairListwithBuffer(KetShellPairList_s *ket_shellpair_list, int *buffer)
@@ -62,7 +64,8 @@ void init_KetShellPairListwithBuffer(KetShellPairList_s *ket_shellpair_list, int
     
     ket_shellpair_list->P_list = ket_shellpair_list->ptr;
     ket_shellpair_list->Q_list = ket_shellpair_list->ptr + _SIMINT_NSHELL_SIMD;
-    ket_shellpair_list->fock_quartet_info = ket_shellpair_list->ptr + _SIMINT_NSHELL_SIMD * 2;
+    ket_shellpair_list->PQ_list = ket_shellpair_list->ptr + _SIMINT_NSHELL_SIMD * 2;
+    ket_shellpair_list->fock_quartet_info = ket_shellpair_list->ptr + _SIMINT_NSHELL_SIMD * 3;
 }
 
 void free_KetShellPairList(KetShellPairList_s *ket_shellpair_list)
@@ -81,7 +84,7 @@ void reset_KetShellPairList(KetShellPairList_s *ket_shellpair_list)
 }
 
 int add_KetShellPair(
-    KetShellPairList_s *ket_shellpair_list, int _P, int _Q, 
+    KetShellPairList_s *ket_shellpair_list, int _P, int _Q, int _PQ,
     int _dimM, int _dimN, int _dimP, int _dimQ,
     int _flag1, int _flag2, int _flag3, 
     int _iMN, int _iPQ, int _iMP, int _iNP, int _iMQ, int _iNQ, 
@@ -93,6 +96,7 @@ int add_KetShellPair(
     
     ket_shellpair_list->P_list[idx] = _P;
     ket_shellpair_list->Q_list[idx] = _Q;
+    ket_shellpair_list->PQ_list[idx] = _PQ;
     
     int *fock_info_list = ket_shellpair_list->fock_quartet_info + idx * 16;
     
@@ -124,7 +128,7 @@ void init_ThreadQuartetLists(ThreadQuartetLists_s *thread_quartet_lists)
     thread_quartet_lists->ket_shellpair_lists = (KetShellPairList_s *) malloc(sizeof(KetShellPairList_s) * _SIMINT_AM_PAIRS);  
     assert(thread_quartet_lists->ket_shellpair_lists != NULL);
     
-    int spl_work_size = _SIMINT_NSHELL_SIMD * (2 + 16);
+    int spl_work_size = _SIMINT_NSHELL_SIMD * (3 + 16);
     int tql_work_size = spl_work_size * _SIMINT_AM_PAIRS;
     thread_quartet_lists->ptr = (int*) malloc(sizeof(int) * tql_work_size);
     assert(thread_quartet_lists->ptr != NULL);
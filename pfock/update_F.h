@@ -36,7 +36,7 @@ static inline void direct_add_vector(double *dst, double *src, int length)
 }
 
 static inline void update_global_vectors(
-    int write_P, int dimM, int dimN, int dimP, int dimQ,
+    FockEngine_t fe, int write_P, int dimM, int dimN, int dimP, int dimQ,
     double *K_MP, double *K_MP_buf, double *K_NP, double *K_NP_buf, double *J_PQ, double *J_PQ_buf,
     double *K_MQ, double *K_MQ_buf, double *K_NQ, double *K_NQ_buf
 )
@@ -47,28 +47,31 @@ static inline void update_global_vectors(
         direct_add_vector(K_NP, K_NP_buf, dimN * dimP);
     }
     
-    #ifdef DUP_F_PQ_BUF
-    direct_add_vector(J_PQ, J_PQ_buf, dimP * dimQ);
-    #else
-    atomic_add_vector(J_PQ, J_PQ_buf, dimP * dimQ);
-    #endif
+    // Only the shared F_PQ_blocks needs atomic add, duplicated copies 
+    // and thread-private tiles are written by one thread 
+    if (fe->JPQ_acc_mode == JPQ_ACC_ATOMIC) atomic_add_vector(J_PQ, J_PQ_buf, dimP * dimQ);
+    else direct_add_vector(J_PQ, J_PQ_buf, dimP * dimQ);
     
     direct_add_vector(K_MQ, K_MQ_buf, dimM * dimQ);
     direct_add_vector(K_NQ, K_NQ_buf, dimN * dimQ);
 }
 
 #define UPDATE_F_OPT_BUFFER_IN_ARGS \
-    int tid, int num_dmat, double *integrals, \
+    FockEngine_t fe, int tid, int dmat_id, double *integrals, \
     int dimM, int dimN, int dimP, int _dimQ, \
     int flag1, int flag2, int flag3, int load_P, int write_P, \
     int M, int N, int P, int Q,  \
     double *thread_F_M_band_blocks, int thread_M_bank_offset, \
     double *thread_F_N_band_blocks, int thread_N_bank_offset, \
-    double *thread_F_PQ_blocks
+    double *J_PQ
 
 // Use thread-local buffer to reduce atomic add 
 static inline void update_F_opt_buffer(UPDATE_F_OPT_BUFFER_IN_ARGS)
 {
+    // D blocks and J_MN buffer of density dmat_id
+    double *D_dmat = fe->D_blocks + (size_t) dmat_id * fe->blk_nbf2;
+    double *thread_buf = fe->update_F_buf + (tid * fe->max_numdmat2 + dmat_id) * fe->update_F_buf_size;
+    
     int dimQ = _dimQ;
 
     int flag4 = (flag1 == 1 && flag2 == 1) ? 1 : 0;
@@ -76,9 +79,8 @@ static inline void update_F_opt_buffer(UPDATE_F_OPT_BUFFER_IN_ARGS)
     int flag6 = (flag2 == 1 && flag3 == 1) ? 1 : 0;
     int flag7 = (flag4 == 1 && flag3 == 1) ? 1 : 0;
     
-    double *thread_buf = update_F_buf + tid * update_F_buf_size;
     int required_buf_size = (dimP + dimN + dimM) * dimQ + (dimN + dimM) * dimP + dimM * dimN;
-    assert(required_buf_size <= update_F_buf_size); 
+    assert(required_buf_size <= fe->update_F_buf_size); 
     
     double *write_buf = thread_buf;
     
@@ -90,18 +92,17 @@ static inline void update_F_opt_buffer(UPDATE_F_OPT_BUFFER_IN_ARGS)
     double *K_NQ_buf = write_buf;  write_buf += dimN * dimQ;
     double *K_MQ_buf = write_buf;  write_buf += dimM * dimQ;
     
-    double *J_PQ = thread_F_PQ_blocks + (mat_block_ptr[P * nshells + Q] - F_PQ_offset);
-    double *K_MP = thread_F_M_band_blocks + mat_block_ptr[M * nshells + P] - thread_M_bank_offset; 
-    double *K_NP = thread_F_N_band_blocks + mat_block_ptr[N * nshells + P] - thread_N_bank_offset;
-    double *K_MQ = thread_F_M_band_blocks + mat_block_ptr[M * nshells + Q] - thread_M_bank_offset;
-    double *K_NQ = thread_F_N_band_blocks + mat_block_ptr[N * nshells + Q] - thread_N_bank_offset;
+    double *K_MP = thread_F_M_band_blocks + block_ptr(fe, M, P) - thread_M_bank_offset; 
+    double *K_NP = thread_F_N_band_blocks + block_ptr(fe, N, P) - thread_N_bank_offset;
+    double *K_MQ = thread_F_M_band_blocks + block_ptr(fe, M, Q) - thread_M_bank_offset;
+    double *K_NQ = thread_F_N_band_blocks + block_ptr(fe, N, Q) - thread_N_bank_offset;
     
-    double *D_MN_buf = D_blocks + mat_block_ptr[M * nshells + N];
-    double *D_PQ_buf = D_blocks + mat_block_ptr[P * nshells + Q];
-    double *D_MP_buf = D_blocks + mat_block_ptr[M * nshells + P];
-    double *D_NP_buf = D_blocks + mat_block_ptr[N * nshells + P];
-    double *D_MQ_buf = D_blocks + mat_block_ptr[M * nshells + Q];
-    double *D_NQ_buf = D_blocks + mat_block_ptr[N * nshells + Q];
+    double *D_MN_buf = D_dmat + block_ptr(fe, M, N);
+    double *D_PQ_buf = D_dmat + block_ptr(fe, P, Q);
+    double *D_MP_buf = D_dmat + block_ptr(fe, M, P);
+    double *D_NP_buf = D_dmat + block_ptr(fe, N, P);
+    double *D_MQ_buf = D_dmat + block_ptr(fe, M, Q);
+    double *D_NQ_buf = D_dmat + block_ptr(fe, N, Q);
 
     // Reset result buffer
     if (load_P) memset(K_MP_buf, 0, sizeof(double) * dimP * (dimM + dimN));
@@ -158,7 +159,7 @@ static inline void update_F_opt_buffer(UPDATE_F_OPT_BUFFER_IN_ARGS)
     
     // Update to the global array using atomic_add_f64()
     update_global_vectors(
-        write_P, dimM, dimN, dimP, dimQ, 
+        fe, write_P, dimM, dimN, dimP, dimQ, 
         K_MP, K_MP_buf, K_NP, K_NP_buf, J_PQ, J_PQ_buf,
         K_MQ, K_MQ_buf, K_NQ, K_NQ_buf
     );
@@ -166,6 +167,10 @@ static inline void update_F_opt_buffer(UPDATE_F_OPT_BUFFER_IN_ARGS)
 
 static inline void update_F_opt_buffer_Q1(UPDATE_F_OPT_BUFFER_IN_ARGS)
 {
+    // D blocks and J_MN buffer of density dmat_id
+    double *D_dmat = fe->D_blocks + (size_t) dmat_id * fe->blk_nbf2;
+    double *thread_buf = fe->update_F_buf + (tid * fe->max_numdmat2 + dmat_id) * fe->update_F_buf_size;
+    
     const int dimQ = 1;
 
     int flag4 = (flag1 == 1 && flag2 == 1) ? 1 : 0;
@@ -173,9 +178,8 @@ static inline void update_F_opt_buffer_Q1(UPDATE_F_OPT_BUFFER_IN_ARGS)
     int flag6 = (flag2 == 1 && flag3 == 1) ? 1 : 0;
     int flag7 = (flag4 == 1 && flag3 == 1) ? 1 : 0;
     
-    double *thread_buf = update_F_buf + tid * update_F_buf_size;
     int required_buf_size = (dimP + dimN + dimM) * dimQ + (dimN + dimM) * dimP + dimM * dimN;
-    assert(required_buf_size <= update_F_buf_size); 
+    assert(required_buf_size <= fe->update_F_buf_size); 
     
     double *write_buf = thread_buf;
     
@@ -187,18 +191,17 @@ static inline void update_F_opt_buffer_Q1(UPDATE_F_OPT_BUFFER_IN_ARGS)
     double *K_NQ_buf = write_buf;  write_buf += dimN * dimQ;
     double *K_MQ_buf = write_buf;  write_buf += dimM * dimQ;
     
-    double *J_PQ = thread_F_PQ_blocks + (mat_block_ptr[P * nshells + Q] - F_PQ_offset);
-    double *K_MP = thread_F_M_band_blocks + mat_block_ptr[M * nshells + P] - thread_M_bank_offset; 
-    double *K_NP = thread_F_N_band_blocks + mat_block_ptr[N * nshells + P] - thread_N_bank_offset;
-    double *K_MQ = thread_F_M_band_blocks + mat_block_ptr[M * nshells + Q] - thread_M_bank_offset;
-    double *K_NQ = thread_F_N_band_blocks + mat_block_ptr[N * nshells + Q] - thread_N_bank_offset;
+    double *K_MP = thread_F_M_band_blocks + block_ptr(fe, M, P) - thread_M_bank_offset; 
+    double *K_NP = thread_F_N_band_blocks + block_ptr(fe, N, P) - thread_N_bank_offset;
+    double *K_MQ = thread_F_M_band_blocks + block_ptr(fe, M, Q) - thread_M_bank_offset;
+    double *K_NQ = thread_F_N_band_blocks + block_ptr(fe, N, Q) - thread_N_bank_offset;
     
-    double *D_MN_buf = D_blocks + mat_block_ptr[M * nshells + N];
-    double *D_PQ_buf = D_blocks + mat_block_ptr[P * nshells + Q];
-    double *D_MP_buf = D_blocks + mat_block_ptr[M * nshells + P];
-    double *D_NP_buf = D_blocks + mat_block_ptr[N * nshells + P];
-    double *D_MQ_buf = D_blocks + mat_block_ptr[M * nshells + Q];
-    double *D_NQ_buf = D_blocks + mat_block_ptr[N * nshells + Q];
+    double *D_MN_buf = D_dmat + block_ptr(fe, M, N);
+    double *D_PQ_buf = D_dmat + block_ptr(fe, P, Q);
+    double *D_MP_buf = D_dmat + block_ptr(fe, M, P);
+    double *D_NP_buf = D_dmat + block_ptr(fe, N, P);
+    double *D_MQ_buf = D_dmat + block_ptr(fe, M, Q);
+    double *D_NQ_buf = D_dmat + block_ptr(fe, N, Q);
 
     // Reset result buffer
     if (load_P) memset(K_MP_buf, 0, sizeof(double) * dimP * (dimM + dimN));
@@ -245,7 +248,7 @@ static inline void update_F_opt_buffer_Q1(UPDATE_F_OPT_BUFFER_IN_ARGS)
     
     // Update to the global array using atomic_add_f64()
     update_global_vectors(
-        write_P, dimM, dimN, dimP, dimQ, 
+        fe, write_P, dimM, dimN, dimP, dimQ, 
         K_MP, K_MP_buf, K_NP, K_NP_buf, J_PQ, J_PQ_buf,
         K_MQ, K_MQ_buf, K_NQ, K_NQ_buf
     );
@@ -253,6 +256,10 @@ static inline void update_F_opt_buffer_Q1(UPDATE_F_OPT_BUFFER_IN_ARGS)
 
 static inline void update_F_opt_buffer_Q3(UPDATE_F_OPT_BUFFER_IN_ARGS)
 {
+    // D blocks and J_MN buffer of density dmat_id
+    double *D_dmat = fe->D_blocks + (size_t) dmat_id * fe->blk_nbf2;
+    double *thread_buf = fe->update_F_buf + (tid * fe->max_numdmat2 + dmat_id) * fe->update_F_buf_size;
+    
     const int dimQ = 3;
     
     int flag4 = (flag1 == 1 && flag2 == 1) ? 1 : 0;
@@ -260,9 +267,8 @@ static inline void update_F_opt_buffer_Q3(UPDATE_F_OPT_BUFFER_IN_ARGS)
     int flag6 = (flag2 == 1 && flag3 == 1) ? 1 : 0;
     int flag7 = (flag4 == 1 && flag3 == 1) ? 1 : 0;
     
-    double *thread_buf = update_F_buf + tid * update_F_buf_size;
     int required_buf_size = (dimP + dimN + dimM) * dimQ + (dimN + dimM) * dimP + dimM * dimN;
-    assert(required_buf_size <= update_F_buf_size); 
+    assert(required_buf_size <= fe->update_F_buf_size); 
     
     double *write_buf = thread_buf;
     
@@ -274,18 +280,17 @@ static inline void update_F_opt_buffer_Q3(UPDATE_F_OPT_BUFFER_IN_ARGS)
     double *K_NQ_buf = write_buf;  write_buf += dimN * dimQ;
     double *K_MQ_buf = write_buf;  write_buf += dimM * dimQ;
     
-    double *J_PQ = thread_F_PQ_blocks + (mat_block_ptr[P * nshells + Q] - F_PQ_offset);
-    double *K_MP = thread_F_M_band_blocks + mat_block_ptr[M * nshells + P] - thread_M_bank_offset; 
-    double *K_NP = thread_F_N_band_blocks + mat_block_ptr[N * nshells + P] - thread_N_bank_offset;
-    double *K_MQ = thread_F_M_band_blocks + mat_block_ptr[M * nshells + Q] - thread_M_bank_offset;
-    double *K_NQ = thread_F_N_band_blocks + mat_block_ptr[N * nshells + Q] - thread_N_bank_offset;
+    double *K_MP = thread_F_M_band_blocks + block_ptr(fe, M, P) - thread_M_bank_offset; 
+    double *K_NP = thread_F_N_band_blocks + block_ptr(fe, N, P) - thread_N_bank_offset;
+    double *K_MQ = thread_F_M_band_blocks + block_ptr(fe, M, Q) - thread_M_bank_offset;
+    double *K_NQ = thread_F_N_band_blocks + block_ptr(fe, N, Q) - thread_N_bank_offset;
     
-    double *D_MN_buf = D_blocks + mat_block_ptr[M * nshells + N];
-    double *D_PQ_buf = D_blocks + mat_block_ptr[P * nshells + Q];
-    double *D_MP_buf = D_blocks + mat_block_ptr[M * nshells + P];
-    double *D_NP_buf = D_blocks + mat_block_ptr[N * nshells + P];
-    double *D_MQ_buf = D_blocks + mat_block_ptr[M * nshells + Q];
-    double *D_NQ_buf = D_blocks + mat_block_ptr[N * nshells + Q];
+    double *D_MN_buf = D_dmat + block_ptr(fe, M, N);
+    double *D_PQ_buf = D_dmat + block_ptr(fe, P, Q);
+    double *D_MP_buf = D_dmat + block_ptr(fe, M, P);
+    double *D_NP_buf = D_dmat + block_ptr(fe, N, P);
+    double *D_MQ_buf = D_dmat + block_ptr(fe, M, Q);
+    double *D_NQ_buf = D_dmat + block_ptr(fe, N, Q);
 
     // Reset result buffer
     if (load_P)  memset(K_MP_buf, 0, sizeof(double) * dimP * (dimM + dimN));
@@ -340,7 +345,7 @@ static inline void update_F_opt_buffer_Q3(UPDATE_F_OPT_BUFFER_IN_ARGS)
     
     // Update to the global array using atomic_add_f64()
     update_global_vectors(
-        write_P, dimM, dimN, dimP, dimQ, 
+        fe, write_P, dimM, dimN, dimP, dimQ, 
         K_MP, K_MP_buf, K_NP, K_NP_buf, J_PQ, J_PQ_buf,
         K_MQ, K_MQ_buf, K_NQ, K_NQ_buf
     );
@@ -348,6 +353,10 @@ static inline void update_F_opt_buffer_Q3(UPDATE_F_OPT_BUFFER_IN_ARGS)
 
 static inline void update_F_opt_buffer_Q6(UPDATE_F_OPT_BUFFER_IN_ARGS)
 {
+    // D blocks and J_MN buffer of density dmat_id
+    double *D_dmat = fe->D_blocks + (size_t) dmat_id * fe->blk_nbf2;
+    double *thread_buf = fe->update_F_buf + (tid * fe->max_numdmat2 + dmat_id) * fe->update_F_buf_size;
+    
     const int dimQ = 6;
     
     int flag4 = (flag1 == 1 && flag2 == 1) ? 1 : 0;
@@ -355,9 +364,8 @@ static inline void update_F_opt_buffer_Q6(UPDATE_F_OPT_BUFFER_IN_ARGS)
     int flag6 = (flag2 == 1 && flag3 == 1) ? 1 : 0;
     int flag7 = (flag4 == 1 && flag3 == 1) ? 1 : 0;
     
-    double *thread_buf = update_F_buf + tid * update_F_buf_size;
     int required_buf_size = (dimP + dimN + dimM) * dimQ + (dimN + dimM) * dimP + dimM * dimN;
-    assert(required_buf_size <= update_F_buf_size); 
+    assert(required_buf_size <= fe->update_F_buf_size); 
     
     double *write_buf = thread_buf;
     
@@ -369,18 +377,17 @@ static inline void update_F_opt_buffer_Q6(UPDATE_F_OPT_BUFFER_IN_ARGS)
     double *K_NQ_buf = write_buf;  write_buf += dimN * dimQ;
     double *K_MQ_buf = write_buf;  write_buf += dimM * dimQ;
     
-    double *J_PQ = thread_F_PQ_blocks + (mat_block_ptr[P * nshells + Q] - F_PQ_offset);
-    double *K_MP = thread_F_M_band_blocks + mat_block_ptr[M * nshells + P] - thread_M_bank_offset; 
-    double *K_NP = thread_F_N_band_blocks + mat_block_ptr[N * nshells + P] - thread_N_bank_offset;
-    double *K_MQ = thread_F_M_band_blocks + mat_block_ptr[M * nshells + Q] - thread_M_bank_offset;
-    double *K_NQ = thread_F_N_band_blocks + mat_block_ptr[N * nshells + Q] - thread_N_bank_offset;
+    double *K_MP = thread_F_M_band_blocks + block_ptr(fe, M, P) - thread_M_bank_offset; 
+    double *K_NP = thread_F_N_band_blocks + block_ptr(fe, N, P) - thread_N_bank_offset;
+    double *K_MQ = thread_F_M_band_blocks + block_ptr(fe, M, Q) - thread_M_bank_offset;
+    double *K_NQ = thread_F_N_band_blocks + block_ptr(fe, N, Q) - thread_N_bank_offset;
     
-    double *D_MN_buf = D_blocks + mat_block_ptr[M * nshells + N];
-    double *D_PQ_buf = D_blocks + mat_block_ptr[P * nshells + Q];
-    double *D_MP_buf = D_blocks + mat_block_ptr[M * nshells + P];
-    double *D_NP_buf = D_blocks + mat_block_ptr[N * nshells + P];
-    double *D_MQ_buf = D_blocks + mat_block_ptr[M * nshells + Q];
-    double *D_NQ_buf = D_blocks + mat_block_ptr[N * nshells + Q];
+    double *D_MN_buf = D_dmat + block_ptr(fe, M, N);
+    double *D_PQ_buf = D_dmat + block_ptr(fe, P, Q);
+    double *D_MP_buf = D_dmat + block_ptr(fe, M, P);
+    double *D_NP_buf = D_dmat + block_ptr(fe, N, P);
+    double *D_MQ_buf = D_dmat + block_ptr(fe, M, Q);
+    double *D_NQ_buf = D_dmat + block_ptr(fe, N, Q);
 
     // Reset result buffer
     if (load_P)  memset(K_MP_buf, 0, sizeof(double) * dimP * (dimM + dimN));
@@ -435,7 +442,7 @@ static inline void update_F_opt_buffer_Q6(UPDATE_F_OPT_BUFFER_IN_ARGS)
     
     // Update to the global array using atomic_add_f64()
     update_global_vectors(
-        write_P, dimM, dimN, dimP, dimQ, 
+        fe, write_P, dimM, dimN, dimP, dimQ, 
         K_MP, K_MP_buf, K_NP, K_NP_buf, J_PQ, J_PQ_buf,
         K_MQ, K_MQ_buf, K_NQ, K_NQ_buf
     );
@@ -443,6 +450,10 @@ static inline void update_F_opt_buffer_Q6(UPDATE_F_OPT_BUFFER_IN_ARGS)
 
 static inline void update_F_opt_buffer_Q10(UPDATE_F_OPT_BUFFER_IN_ARGS)
 {
+    // D blocks and J_MN buffer of density dmat_id
+    double *D_dmat = fe->D_blocks + (size_t) dmat_id * fe->blk_nbf2;
+    double *thread_buf = fe->update_F_buf + (tid * fe->max_numdmat2 + dmat_id) * fe->update_F_buf_size;
+    
     const int dimQ = 10;
     
     int flag4 = (flag1 == 1 && flag2 == 1) ? 1 : 0;
@@ -450,9 +461,8 @@ static inline void update_F_opt_buffer_Q10(UPDATE_F_OPT_BUFFER_IN_ARGS)
     int flag6 = (flag2 == 1 && flag3 == 1) ? 1 : 0;
     int flag7 = (flag4 == 1 && flag3 == 1) ? 1 : 0;
     
-    double *thread_buf = update_F_buf + tid * update_F_buf_size;
     int required_buf_size = (dimP + dimN + dimM) * dimQ + (dimN + dimM) * dimP + dimM * dimN;
-    assert(required_buf_size <= update_F_buf_size); 
+    assert(required_buf_size <= fe->update_F_buf_size); 
     
     double *write_buf = thread_buf;
     
@@ -464,18 +474,17 @@ static inline void update_F_opt_buffer_Q10(UPDATE_F_OPT_BUFFER_IN_ARGS)
     double *K_NQ_buf = write_buf;  write_buf += dimN * dimQ;
     double *K_MQ_buf = write_buf;  write_buf += dimM * dimQ;
 
-    double *J_PQ = thread_F_PQ_blocks + (mat_block_ptr[P * nshells + Q] - F_PQ_offset);
-    double *K_MP = thread_F_M_band_blocks + mat_block_ptr[M * nshells + P] - thread_M_bank_offset; 
-    double *K_NP = thread_F_N_band_blocks + mat_block_ptr[N * nshells + P] - thread_N_bank_offset;
-    double *K_MQ = thread_F_M_band_blocks + mat_block_ptr[M * nshells + Q] - thread_M_bank_offset;
-    double *K_NQ = thread_F_N_band_blocks + mat_block_ptr[N * nshells + Q] - thread_N_bank_offset;
+    double *K_MP = thread_F_M_band_blocks + block_ptr(fe, M, P) - thread_M_bank_offset; 
+    double *K_NP = thread_F_N_band_blocks + block_ptr(fe, N, P) - thread_N_bank_offset;
+    double *K_MQ = thread_F_M_band_blocks + block_ptr(fe, M, Q) - thread_M_bank_offset;
+    double *K_NQ = thread_F_N_band_blocks + block_ptr(fe, N, Q) - thread_N_bank_offset;
     
-    double *D_MN_buf = D_blocks + mat_block_ptr[M * nshells + N];
-    double *D_PQ_buf = D_blocks + mat_block_ptr[P * nshells + Q];
-    double *D_MP_buf = D_blocks + mat_block_ptr[M * nshells + P];
-    double *D_NP_buf = D_blocks + mat_block_ptr[N * nshells + P];
-    double *D_MQ_buf = D_blocks + mat_block_ptr[M * nshells + Q];
-    double *D_NQ_buf = D_blocks + mat_block_ptr[N * nshells + Q];
+    double *D_MN_buf = D_dmat + block_ptr(fe, M, N);
+    double *D_PQ_buf = D_dmat + block_ptr(fe, P, Q);
+    double *D_MP_buf = D_dmat + block_ptr(fe, M, P);
+    double *D_NP_buf = D_dmat + block_ptr(fe, N, P);
+    double *D_MQ_buf = D_dmat + block_ptr(fe, M, Q);
+    double *D_NQ_buf = D_dmat + block_ptr(fe, N, Q);
 
     // Reset result buffer
     if (load_P)  memset(K_MP_buf, 0, sizeof(double) * dimP * (dimM + dimN));
@@ -530,7 +539,7 @@ static inline void update_F_opt_buffer_Q10(UPDATE_F_OPT_BUFFER_IN_ARGS)
     
     // Update to the global array using atomic_add_f64()
     update_global_vectors(
-        write_P, dimM, dimN, dimP, dimQ, 
+        fe, write_P, dimM, dimN, dimP, dimQ, 
         K_MP, K_MP_buf, K_NP, K_NP_buf, J_PQ, J_PQ_buf,
         K_MQ, K_MQ_buf, K_NQ, K_NQ_buf
     );
@@ -538,6 +547,10 @@ static inline void update_F_opt_buffer_Q10(UPDATE_F_OPT_BUFFER_IN_ARGS)
 
 static inline void update_F_opt_buffer_Q15(UPDATE_F_OPT_BUFFER_IN_ARGS)
 {
+    // D blocks and J_MN buffer of density dmat_id
+    double *D_dmat = fe->D_blocks + (size_t) dmat_id * fe->blk_nbf2;
+    double *thread_buf = fe->update_F_buf + (tid * fe->max_numdmat2 + dmat_id) * fe->update_F_buf_size;
+    
     const int dimQ = 15;
     
     int flag4 = (flag1 == 1 && flag2 == 1) ? 1 : 0;
@@ -545,9 +558,8 @@ static inline void update_F_opt_buffer_Q15(UPDATE_F_OPT_BUFFER_IN_ARGS)
     int flag6 = (flag2 == 1 && flag3 == 1) ? 1 : 0;
     int flag7 = (flag4 == 1 && flag3 == 1) ? 1 : 0;
     
-    double *thread_buf = update_F_buf + tid * update_F_buf_size;
     int required_buf_size = (dimP + dimN + dimM) * dimQ + (dimN + dimM) * dimP + dimM * dimN;
-    assert(required_buf_size <= update_F_buf_size); 
+    assert(required_buf_size <= fe->update_F_buf_size); 
     
     double *write_buf = thread_buf;
     
@@ -559,18 +571,17 @@ static inline void update_F_opt_buffer_Q15(UPDATE_F_OPT_BUFFER_IN_ARGS)
     double *K_NQ_buf = write_buf;  write_buf += dimN * dimQ;
     double *K_MQ_buf = write_buf;  write_buf += dimM * dimQ;
 
-    double *J_PQ = thread_F_PQ_blocks + (mat_block_ptr[P * nshells + Q] - F_PQ_offset);
-    double *K_MP = thread_F_M_band_blocks + mat_block_ptr[M * nshells + P] - thread_M_bank_offset; 
-    double *K_NP = thread_F_N_band_blocks + mat_block_ptr[N * nshells + P] - thread_N_bank_offset;
-    double *K_MQ = thread_F_M_band_blocks + mat_block_ptr[M * nshells + Q] - thread_M_bank_offset;
-    double *K_NQ = thread_F_N_band_blocks + mat_block_ptr[N * nshells + Q] - thread_N_bank_offset;
+    double *K_MP = thread_F_M_band_blocks + block_ptr(fe, M, P) - thread_M_bank_offset; 
+    double *K_NP = thread_F_N_band_blocks + block_ptr(fe, N, P) - thread_N_bank_offset;
+    double *K_MQ = thread_F_M_band_blocks + block_ptr(fe, M, Q) - thread_M_bank_offset;
+    double *K_NQ = thread_F_N_band_blocks + block_ptr(fe, N, Q) - thread_N_bank_offset;
     
-    double *D_MN_buf = D_blocks + mat_block_ptr[M * nshells + N];
-    double *D_PQ_buf = D_blocks + mat_block_ptr[P * nshells + Q];
-    double *D_MP_buf = D_blocks + mat_block_ptr[M * nshells + P];
-    double *D_NP_buf = D_blocks + mat_block_ptr[N * nshells + P];
-    double *D_MQ_buf = D_blocks + mat_block_ptr[M * nshells + Q];
-    double *D_NQ_buf = D_blocks + mat_block_ptr[N * nshells + Q];
+    double *D_MN_buf = D_dmat + block_ptr(fe, M, N);
+    double *D_PQ_buf = D_dmat + block_ptr(fe, P, Q);
+    double *D_MP_buf = D_dmat + block_ptr(fe, M, P);
+    double *D_NP_buf = D_dmat + block_ptr(fe, N, P);
+    double *D_MQ_buf = D_dmat + block_ptr(fe, M, Q);
+    double *D_NQ_buf = D_dmat + block_ptr(fe, N, Q);
 
     // Reset result buffer
     if (load_P)  memset(K_MP_buf, 0, sizeof(double) * dimP * (dimM + dimN));
@@ -625,7 +636,7 @@ static inline void update_F_opt_buffer_Q15(UPDATE_F_OPT_BUFFER_IN_ARGS)
 
     // Update to the global array using atomic_add_f64()
     update_global_vectors(
-        write_P, dimM, dimN, dimP, dimQ, 
+        fe, write_P, dimM, dimN, dimP, dimQ, 
         K_MP, K_MP_buf, K_NP, K_NP_buf, J_PQ, J_PQ_buf,
         K_MQ, K_MQ_buf, K_NQ, K_NQ_buf
     );
@@ -633,25 +644,27 @@ static inline void update_F_opt_buffer_Q15(UPDATE_F_OPT_BUFFER_IN_ARGS)
 
 static inline void update_F_1111(UPDATE_F_OPT_BUFFER_IN_ARGS)
 {
+    // D blocks and J_MN buffer of density dmat_id
+    double *D_dmat = fe->D_blocks + (size_t) dmat_id * fe->blk_nbf2;
+    double *thread_buf = fe->update_F_buf + (tid * fe->max_numdmat2 + dmat_id) * fe->update_F_buf_size;
+    
     int flag4 = (flag1 == 1 && flag2 == 1) ? 1 : 0;
     int flag5 = (flag1 == 1 && flag3 == 1) ? 1 : 0;
     int flag6 = (flag2 == 1 && flag3 == 1) ? 1 : 0;
     int flag7 = (flag4 == 1 && flag3 == 1) ? 1 : 0;
     
-    double *J_PQ = thread_F_PQ_blocks + (mat_block_ptr[P * nshells + Q] - F_PQ_offset);
-    double *K_MP = thread_F_M_band_blocks + mat_block_ptr[M * nshells + P] - thread_M_bank_offset; 
-    double *K_NP = thread_F_N_band_blocks + mat_block_ptr[N * nshells + P] - thread_N_bank_offset;
-    double *K_MQ = thread_F_M_band_blocks + mat_block_ptr[M * nshells + Q] - thread_M_bank_offset;
-    double *K_NQ = thread_F_N_band_blocks + mat_block_ptr[N * nshells + Q] - thread_N_bank_offset;
+    double *K_MP = thread_F_M_band_blocks + block_ptr(fe, M, P) - thread_M_bank_offset; 
+    double *K_NP = thread_F_N_band_blocks + block_ptr(fe, N, P) - thread_N_bank_offset;
+    double *K_MQ = thread_F_M_band_blocks + block_ptr(fe, M, Q) - thread_M_bank_offset;
+    double *K_NQ = thread_F_N_band_blocks + block_ptr(fe, N, Q) - thread_N_bank_offset;
     
-    double *D_MN_buf = D_blocks + mat_block_ptr[M * nshells + N];
-    double *D_PQ_buf = D_blocks + mat_block_ptr[P * nshells + Q];
-    double *D_MP_buf = D_blocks + mat_block_ptr[M * nshells + P];
-    double *D_NP_buf = D_blocks + mat_block_ptr[N * nshells + P];
-    double *D_MQ_buf = D_blocks + mat_block_ptr[M * nshells + Q];
-    double *D_NQ_buf = D_blocks + mat_block_ptr[N * nshells + Q];
+    double *D_MN_buf = D_dmat + block_ptr(fe, M, N);
+    double *D_PQ_buf = D_dmat + block_ptr(fe, P, Q);
+    double *D_MP_buf = D_dmat + block_ptr(fe, M, P);
+    double *D_NP_buf = D_dmat + block_ptr(fe, N, P);
+    double *D_MQ_buf = D_dmat + block_ptr(fe, M, Q);
+    double *D_NQ_buf = D_dmat + block_ptr(fe, N, Q);
 
-    double *thread_buf = update_F_buf + tid * update_F_buf_size;
     double I = integrals[0];
 
     double vMN = 2.0 * (1 + flag1 + flag2 + flag4) * D_PQ_buf[0] * I;
@@ -663,7 +676,8 @@ static inline void update_F_1111(UPDATE_F_OPT_BUFFER_IN_ARGS)
     
     //atomic_add_f64(&J_MN[0], vMN);
     thread_buf[0] += vMN;
-    atomic_add_f64(&J_PQ[0], vPQ);
+    if (fe->JPQ_acc_mode == JPQ_ACC_ATOMIC) atomic_add_f64(&J_PQ[0], vPQ);
+    else J_PQ[0] += vPQ;
     //atomic_add_f64(&K_MP[0], -vMP);
     //atomic_add_f64(&K_NP[0], -vNP);
     //atomic_add_f64(&K_MQ[0], -vMQ);
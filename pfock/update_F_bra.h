@@ -0,0 +1,80 @@
+#pragma once
+
+// update_F kernel for the quartets of a swapped bra batch. The integrals
+// of (MN|PQ) come from a Simint call with (P, Q) on the bra side and
+// (M, N) as one of the ket pairs, so they are stored in (PQ|MN) order,
+// [iP][iQ][iM][iN]. The loops follow that order: each (iP, iQ) reads a
+// contiguous dimM * dimN slice and J_PQ is updated once per element.
+
+static void update_F_bra_swapped(
+    FockEngine_t fe, int dmat_id, const double *integrals, int *fock_info_list,
+    int M, int N, int P, int Q, double *J_MN, double *J_PQ,
+    double *thread_F_M_band_blocks, int thread_M_bank_offset,
+    double *thread_F_N_band_blocks, int thread_N_bank_offset
+)
+{
+    int dimM  = fock_info_list[0];
+    int dimN  = fock_info_list[1];
+    int dimP  = fock_info_list[2];
+    int dimQ  = fock_info_list[3];
+    int flag1 = fock_info_list[4];
+    int flag2 = fock_info_list[5];
+    int flag3 = fock_info_list[6];
+    int flag4 = (flag1 == 1 && flag2 == 1) ? 1 : 0;
+    int flag5 = (flag1 == 1 && flag3 == 1) ? 1 : 0;
+    int flag6 = (flag2 == 1 && flag3 == 1) ? 1 : 0;
+    int flag7 = (flag4 == 1 && flag3 == 1) ? 1 : 0;
+    int dimMN = dimM * dimN;
+
+    double vMN_coef = 2.0 * (1 + flag1 + flag2 + flag4);
+    double vMP_coef = (1 + flag3) * 1.0;
+    double vNP_coef = (flag1 + flag5) * 1.0;
+    double vMQ_coef = (flag2 + flag6) * 1.0;
+    double vNQ_coef = (flag4 + flag7) * 1.0;
+    double vPQ_coef = 2.0 * (flag3 + flag5 + flag6 + flag7);
+
+    double *D_dmat = fe->D_blocks + (size_t) dmat_id * fe->blk_nbf2;
+    double *D_MN = D_dmat + block_ptr(fe, M, N);
+    double *D_PQ = D_dmat + block_ptr(fe, P, Q);
+    double *D_NQ = D_dmat + block_ptr(fe, N, Q);
+    double *D_MQ = D_dmat + block_ptr(fe, M, Q);
+    double *D_NP = D_dmat + block_ptr(fe, N, P);
+    double *D_MP = D_dmat + block_ptr(fe, M, P);
+    double *K_MP = thread_F_M_band_blocks + block_ptr(fe, M, P) - thread_M_bank_offset;
+    double *K_MQ = thread_F_M_band_blocks + block_ptr(fe, M, Q) - thread_M_bank_offset;
+    double *K_NP = thread_F_N_band_blocks + block_ptr(fe, N, P) - thread_N_bank_offset;
+    double *K_NQ = thread_F_N_band_blocks + block_ptr(fe, N, Q) - thread_N_bank_offset;
+
+    for (int iP = 0; iP < dimP; iP++)
+    {
+        for (int iQ = 0; iQ < dimQ; iQ++)
+        {
+            int ipq = iP * dimQ + iQ;
+            const double *I_MN = integrals + ipq * dimMN;
+            double vD_PQ = vMN_coef * D_PQ[ipq];
+            double j_PQ  = 0.0;
+            for (int iM = 0; iM < dimM; iM++)
+            {
+                double vD_MQ = vNP_coef * D_MQ[iM * dimQ + iQ];
+                double vD_MP = vNQ_coef * D_MP[iM * dimP + iP];
+                double k_MP  = 0.0, k_MQ = 0.0;
+                for (int iN = 0; iN < dimN; iN++)
+                {
+                    int imn  = iM * dimN + iN;
+                    double I = I_MN[imn];
+                    J_MN[imn] += vD_PQ * I;
+                    j_PQ += D_MN[imn] * I;
+                    k_MP += D_NQ[iN * dimQ + iQ] * I;
+                    k_MQ += D_NP[iN * dimP + iP] * I;
+                    K_NP[iN * dimP + iP] -= vD_MQ * I;
+                    K_NQ[iN * dimQ + iQ] -= vD_MP * I;
+                }
+                K_MP[iM * dimP + iP] -= vMP_coef * k_MP;
+                K_MQ[iM * dimQ + iQ] -= vMQ_coef * k_MQ;
+            }
+            j_PQ *= vPQ_coef;
+            if (fe->JPQ_acc_mode == JPQ_ACC_ATOMIC) atomic_add_f64(&J_PQ[ipq], j_PQ);
+            else J_PQ[ipq] += j_PQ;
+        }
+    }
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+// update_F kernel that vectorizes across the ket shellpairs of a batch.
+// All ket pairs in a KetShellPairList_s have the same AM(P) and AM(Q),
+// so each (iM, iN, iP, iQ) index is a vector of up to _SIMINT_NSHELL_SIMD
+// integrals, one per ket pair. Integrals and D blocks are transposed to
+// SoA [element][ipair] form, the coefficients of each ket pair are folded
+// into its D values, and the results are scattered per pair at the end.
+
+#define UPDATE_F_SIMD_NPAD _SIMINT_NSHELL_SIMD
+
+// Size of the per-thread SoA workspace for shells up to dimension max_dim
+static inline int update_F_simd_buf_entries(int max_dim)
+{
+    // I, D_PQ, J_PQ are dimP * dimQ; D_{NQ, MQ, NP, MP} and K_{MQ, NQ, MP, NP}
+    // are at most max_dim^2; plus vPQ coefficients and the J_MN accumulator
+    return (11 * max_dim * max_dim + 2) * UPDATE_F_SIMD_NPAD;
+}
+
+#define SOA_T      double
+#define SOA_WS     update_F_simd_buf
+#define SOA_PACK   pack_SoA_block
+#define SOA_UNPACK unpack_SoA_block
+#define SOA_KERNEL update_F_simd_batch
+#include "update_F_simd_kernel.h"
@@ -0,0 +1,183 @@
+// Body of the SoA update_F kernels, included once per element type by
+// update_F_simd.h (double) and update_F_sp.h (float). The including file
+// defines:
+//   SOA_T      element type of the workspace and of the inner loops
+//   SOA_WS     engine field with the per-thread workspaces
+//   SOA_PACK   name of the pack function
+//   SOA_UNPACK name of the unpack function
+//   SOA_KERNEL name of the kernel
+// The workspace layout is given by update_F_simd_buf_entries().
+// No include guard, the macros are undefined at the end.
+
+// Copy a dimA * dimB block of ket pair ipair into SoA form, scaled by coef
+static inline void SOA_PACK(
+    SOA_T *dst, const double *src, const int dimA, const int dimB,
+    const int ipair, const double coef
+)
+{
+    for (int i = 0; i < dimA * dimB; i++)
+        dst[i * UPDATE_F_SIMD_NPAD + ipair] = (SOA_T) (coef * src[i]);
+}
+
+// Add ket pair ipair's SoA result block to dst
+static inline void SOA_UNPACK(
+    double *dst, const SOA_T *src, const int dimA, const int dimB, const int ipair
+)
+{
+    for (int i = 0; i < dimA * dimB; i++)
+        dst[i] += (double) src[i * UPDATE_F_SIMD_NPAD + ipair];
+}
+
+static void SOA_KERNEL(
+    FockEngine_t fe, int tid, int dmat_id, double *batch_integrals, int batch_nints, int npairs,
+    int M, int N, int *P_list, int *Q_list, int *fock_quartet_info,
+    double **J_PQ_list,
+    double *thread_F_M_band_blocks, int thread_M_bank_offset,
+    double *thread_F_N_band_blocks, int thread_N_bank_offset
+)
+{
+    const int NPAD = UPDATE_F_SIMD_NPAD;
+    int dimM  = fock_quartet_info[0];
+    int dimN  = fock_quartet_info[1];
+    int dimP  = fock_quartet_info[2];
+    int dimQ  = fock_quartet_info[3];
+    int flag1 = fock_quartet_info[4];
+    int dimPQ = dimP * dimQ;
+
+    double *D_dmat   = fe->D_blocks + (size_t) dmat_id * fe->blk_nbf2;
+    double *J_MN_buf = fe->update_F_buf + (tid * fe->max_numdmat2 + dmat_id) * fe->update_F_buf_size;
+    double *D_MN_buf = D_dmat + block_ptr(fe, M, N);
+
+    // Setup SoA workspace pointers
+    SOA_T *ws = fe->SOA_WS + (size_t) tid * fe->update_F_simd_buf_size;
+    SOA_T *I_s    = ws;  ws += dimPQ * NPAD;
+    SOA_T *D_PQ_s = ws;  ws += dimPQ * NPAD;
+    SOA_T *J_PQ_s = ws;  ws += dimPQ * NPAD;
+    SOA_T *D_NQ_s = ws;  ws += dimN * dimQ * NPAD;
+    SOA_T *D_MQ_s = ws;  ws += dimM * dimQ * NPAD;
+    SOA_T *D_NP_s = ws;  ws += dimN * dimP * NPAD;
+    SOA_T *D_MP_s = ws;  ws += dimM * dimP * NPAD;
+    SOA_T *K_MQ_s = ws;  ws += dimM * dimQ * NPAD;
+    SOA_T *K_NQ_s = ws;  ws += dimN * dimQ * NPAD;
+    SOA_T *K_MP_s = ws;  ws += dimM * dimP * NPAD;
+    SOA_T *K_NP_s = ws;  ws += dimN * dimP * NPAD;
+    SOA_T *vPQ_s  = ws;  ws += NPAD;
+    SOA_T *jMN_s  = ws;
+
+    // Padding lanes have zero D and zero integrals, so they contribute nothing
+    size_t packed_size = (size_t) (ws - I_s);
+    memset(I_s, 0, sizeof(SOA_T) * packed_size);
+
+    // Pack D blocks with the coefficients of each ket pair folded in
+    for (int ipair = 0; ipair < npairs; ipair++)
+    {
+        int *fock_info_list = fock_quartet_info + ipair * 16;
+        int P = P_list[ipair];
+        int Q = Q_list[ipair];
+        int flag2 = fock_info_list[5];
+        int flag3 = fock_info_list[6];
+        int flag4 = (flag1 == 1 && flag2 == 1) ? 1 : 0;
+        int flag5 = (flag1 == 1 && flag3 == 1) ? 1 : 0;
+        int flag6 = (flag2 == 1 && flag3 == 1) ? 1 : 0;
+        int flag7 = (flag4 == 1 && flag3 == 1) ? 1 : 0;
+
+        double vMN_coef = 2.0 * (1 + flag1 + flag2 + flag4);
+        double vMP_coef = (1 + flag3) * 1.0;
+        double vNP_coef = (flag1 + flag5) * 1.0;
+        double vMQ_coef = (flag2 + flag6) * 1.0;
+        double vNQ_coef = (flag4 + flag7) * 1.0;
+        vPQ_s[ipair]    = (SOA_T) (2.0 * (flag3 + flag5 + flag6 + flag7));
+
+        SOA_PACK(D_PQ_s, D_dmat + block_ptr(fe, P, Q), dimP, dimQ, ipair, vMN_coef);
+        SOA_PACK(D_NQ_s, D_dmat + block_ptr(fe, N, Q), dimN, dimQ, ipair, vMP_coef);
+        SOA_PACK(D_MQ_s, D_dmat + block_ptr(fe, M, Q), dimM, dimQ, ipair, vNP_coef);
+        SOA_PACK(D_NP_s, D_dmat + block_ptr(fe, N, P), dimN, dimP, ipair, vMQ_coef);
+        SOA_PACK(D_MP_s, D_dmat + block_ptr(fe, M, P), dimM, dimP, ipair, vNQ_coef);
+    }
+
+    // Start computation, the innermost loop runs over ket pairs
+    for (int iM = 0; iM < dimM; iM++)
+    {
+        for (int iN = 0; iN < dimN; iN++)
+        {
+            int imn = iM * dimN + iN;
+            SOA_T D_MN = (SOA_T) D_MN_buf[imn];
+
+            // Transpose the (iM, iN) slice of the integrals to SoA form
+            for (int ipair = 0; ipair < npairs; ipair++)
+            {
+                double *src = batch_integrals + ipair * batch_nints + imn * dimPQ;
+                for (int ipq = 0; ipq < dimPQ; ipq++)
+                    I_s[ipq * NPAD + ipair] = (SOA_T) src[ipq];
+            }
+
+            PRAGMA_SIMD
+            for (int k = 0; k < NPAD; k++) jMN_s[k] = 0;
+
+            for (int iP = 0; iP < dimP; iP++)
+            {
+                SOA_T *K_MP_v = K_MP_s + (iM * dimP + iP) * NPAD;
+                SOA_T *K_NP_v = K_NP_s + (iN * dimP + iP) * NPAD;
+                SOA_T *D_NP_v = D_NP_s + (iN * dimP + iP) * NPAD;
+                SOA_T *D_MP_v = D_MP_s + (iM * dimP + iP) * NPAD;
+                for (int iQ = 0; iQ < dimQ; iQ++)
+                {
+                    int ipq = iP * dimQ + iQ;
+                    SOA_T *I_v    = I_s    + ipq * NPAD;
+                    SOA_T *D_PQ_v = D_PQ_s + ipq * NPAD;
+                    SOA_T *J_PQ_v = J_PQ_s + ipq * NPAD;
+                    SOA_T *D_NQ_v = D_NQ_s + (iN * dimQ + iQ) * NPAD;
+                    SOA_T *D_MQ_v = D_MQ_s + (iM * dimQ + iQ) * NPAD;
+                    SOA_T *K_MQ_v = K_MQ_s + (iM * dimQ + iQ) * NPAD;
+                    SOA_T *K_NQ_v = K_NQ_s + (iN * dimQ + iQ) * NPAD;
+
+                    PRAGMA_SIMD
+                    for (int k = 0; k < NPAD; k++)
+                    {
+                        SOA_T I = I_v[k];
+                        jMN_s[k]  += D_PQ_v[k] * I;
+                        K_MP_v[k] -= D_NQ_v[k] * I;
+                        K_NP_v[k] -= D_MQ_v[k] * I;
+                        J_PQ_v[k] += vPQ_s[k] * D_MN * I;
+                        K_MQ_v[k] -= D_NP_v[k] * I;
+                        K_NQ_v[k] -= D_MP_v[k] * I;
+                    }
+                }
+            }
+
+            double j_MN = 0.0;
+            for (int k = 0; k < NPAD; k++) j_MN += (double) jMN_s[k];
+            J_MN_buf[imn] += j_MN;
+        }
+    }
+
+    // Scatter the results of each ket pair
+    for (int ipair = 0; ipair < npairs; ipair++)
+    {
+        int P = P_list[ipair];
+        int Q = Q_list[ipair];
+        double *K_MP = thread_F_M_band_blocks + block_ptr(fe, M, P) - thread_M_bank_offset;
+        double *K_NP = thread_F_N_band_blocks + block_ptr(fe, N, P) - thread_N_bank_offset;
+        double *K_MQ = thread_F_M_band_blocks + block_ptr(fe, M, Q) - thread_M_bank_offset;
+        double *K_NQ = thread_F_N_band_blocks + block_ptr(fe, N, Q) - thread_N_bank_offset;
+        SOA_UNPACK(K_MP, K_MP_s, dimM, dimP, ipair);
+        SOA_UNPACK(K_NP, K_NP_s, dimN, dimP, ipair);
+        SOA_UNPACK(K_MQ, K_MQ_s, dimM, dimQ, ipair);
+        SOA_UNPACK(K_NQ, K_NQ_s, dimN, dimQ, ipair);
+
+        double *J_PQ = J_PQ_list[ipair];
+        if (fe->JPQ_acc_mode == JPQ_ACC_ATOMIC)
+        {
+            for (int ipq = 0; ipq < dimPQ; ipq++)
+                atomic_add_f64(&J_PQ[ipq], (double) J_PQ_s[ipq * NPAD + ipair]);
+        } else {
+            SOA_UNPACK(J_PQ, J_PQ_s, dimP, dimQ, ipair);
+        }
+    }
+}
+
+#undef SOA_T
+#undef SOA_WS
+#undef SOA_PACK
+#undef SOA_UNPACK
+#undef SOA_KERNEL
@@ -0,0 +1,15 @@
+#pragma once
+
+// Single precision version of update_F_simd_batch() for the low-precision
+// tier: ket batches whose screening bound is close to tolscr2. Integrals
+// and D blocks are rounded to float when they are transposed to SoA form
+// and the inner loops run in float; the results are added back to the
+// double precision J and K buffers. Both kernels are built from
+// update_F_simd_kernel.h, so the workspace has the layout of update_F_simd_buf.
+
+#define SOA_T      float
+#define SOA_WS     update_F_sp_buf
+#define SOA_PACK   pack_SoA_block_sp
+#define SOA_UNPACK unpack_SoA_block_sp
+#define SOA_KERNEL update_F_sp_batch
+#include "update_F_simd_kernel.h"
@@ -406,8 +406,7 @@ int main (int argc, char **argv)
 
     // set initial guess
     if (myrank == 0) printf("  initialing D ...\n");
-    pfock->num_dmat  = NUM_D;
-    pfock->num_dmat2 = NUM_D * (pfock->nosymm + 1);
+    PFock_setNumDenMat(pfock, NUM_D);
     initial_guess(pfock, basis, purif->runpurif,
                   rowstart, rowend, colstart, colend,
                   purif->D_block, purif->ldx);